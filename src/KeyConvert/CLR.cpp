@@ -3,6 +3,7 @@
 
 #include "CLR.h"
 #include <msclr\marshal_cppstd.h>
+#include <algorithm>
 #include "KeyConvert.h"
 //#include <string>
 
@@ -28,3 +29,23 @@ int KeyConvert::Convert(String ^importPath, String ^exportPath)
 
 	return result;
 }
+
+String ^KeyConvert::ConvertToPpk(String ^pem)
+{
+	char *ppk = NULL;
+	int ppk_length = 0;
+
+	std::string temp = marshal_as<std::string>(pem);
+
+	int result = KeyConvertNativeBuffer(temp.c_str(), (int)temp.size(), &ppk, &ppk_length);
+
+	std::fill(temp.begin(), temp.end(), '\0');
+
+	if (result != 0)
+		return nullptr;
+
+	String ^ret = gcnew String(ppk, 0, ppk_length);
+	KeyConvertFreeBuffer(ppk, ppk_length);
+
+	return ret;
+}
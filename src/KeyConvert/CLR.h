@@ -10,5 +10,6 @@ namespace CLR {
 	{
 	public:
 		static int Convert(String ^importPath, String ^exportPath);
+		static String ^ConvertToPpk(String ^pem);
 	};
 }
@@ -1,20 +1,16 @@
 // Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
 // SPDX-License-Identifier: MIT-0
 
-#include "CLR.h"
-
-#include "tchar.h"
-
-#include <direct.h>
-#define GetCurrentDir _getcwd
+#include <stdio.h>
 
+#include "KeyConvert.h"
 #include "ssh.h"
 
 int KeyConvertNative(char *importPath, char *exportPath)
 {
 	// idea based on https://stackoverflow.com/questions/29646720
 
-	const char *errmsg_p;
+	const char *errmsg_p = NULL;
 	Filename importFilename;
 	importFilename.path = importPath;
 	int type = SSH_KEYTYPE_OPENSSH;
@@ -25,14 +21,131 @@ int KeyConvertNative(char *importPath, char *exportPath)
 
 	ssh2_userkey *key = import_ssh2(&importFilename, type, importPassphrase, &errmsg_p);
 
-	if (errmsg_p != NULL)
+	if (errmsg_p != NULL || !key || key == SSH2_WRONG_PASSPHRASE)
 	{
-		printf("Error: %s\n", errmsg_p);
+		printf("Error: %s\n", errmsg_p ? errmsg_p : "unable to load key");
 		return 22; // EINVAL
 	}
 
-
 	int retval = ssh2_save_userkey(&exportFilename, key, exportPassphrase);
 
+	key->alg->freekey(key->data);
+	sfree(key->comment);
+	sfree(key);
+
+	if (!retval)
+	{
+		printf("Error: unable to write key file\n");
+		return 5; // EIO
+	}
+
 	return 0;
 }
+
+/*
+* As KeyConvertNative, but converting n files at once, so that the
+* hashing for all their PPK files can be done together. results[i] is
+* set to what KeyConvertNative would have returned for the i'th file.
+*/
+void KeyConvertNativeBatch(int n, char **importPaths, char **exportPaths, int *results)
+{
+	ssh2_userkey **keys = snewn(n, ssh2_userkey *);
+	Filename *exportFilenames = snewn(n, Filename);
+	int *saved = snewn(n, int);
+	int *which = snewn(n, int);
+	int i, nkeys = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		const char *errmsg_p = NULL;
+		Filename importFilename;
+		importFilename.path = importPaths[i];
+		int type = SSH_KEYTYPE_OPENSSH;
+		char *importPassphrase = NULL;
+
+		ssh2_userkey *key = import_ssh2(&importFilename, type, importPassphrase, &errmsg_p);
+
+		if (errmsg_p != NULL || !key || key == SSH2_WRONG_PASSPHRASE)
+		{
+			printf("Error: %s\n", errmsg_p ? errmsg_p : "unable to load key");
+			results[i] = 22; // EINVAL
+			continue;
+		}
+
+		keys[nkeys] = key;
+		exportFilenames[nkeys].path = exportPaths[i];
+		which[nkeys] = i;
+		nkeys++;
+	}
+
+	ssh2_save_userkeys(nkeys, exportFilenames, keys, NULL, saved);
+
+	for (i = 0; i < nkeys; i++)
+	{
+		keys[i]->alg->freekey(keys[i]->data);
+		sfree(keys[i]->comment);
+		sfree(keys[i]);
+
+		if (!saved[i])
+		{
+			printf("Error: unable to write key file\n");
+			results[which[i]] = 5; // EIO
+		}
+		else
+			results[which[i]] = 0;
+	}
+
+	sfree(keys);
+	sfree(exportFilenames);
+	sfree(saved);
+	sfree(which);
+}
+
+/*
+* As KeyConvertNative, but converting a PEM key held in memory into PPK
+* text in memory, so the key material never has to be written to a
+* temporary file. On success *ppk is set to a NUL-terminated buffer of
+* *ppkLength characters, which must be released with
+* KeyConvertFreeBuffer.
+*/
+int KeyConvertNativeBuffer(const char *pem, int pemLength, char **ppk, int *ppkLength)
+{
+	const char *errmsg_p = NULL;
+	int type = SSH_KEYTYPE_OPENSSH;
+	char *importPassphrase = NULL;
+	char *exportPassphrase = NULL;
+
+	*ppk = NULL;
+	*ppkLength = 0;
+
+	ssh2_userkey *key = import_ssh2_mem(pem, pemLength, type, importPassphrase, &errmsg_p);
+
+	if (errmsg_p != NULL || !key || key == SSH2_WRONG_PASSPHRASE)
+	{
+		printf("Error: %s\n", errmsg_p ? errmsg_p : "unable to load key");
+		return 22; // EINVAL
+	}
+
+	*ppk = ssh2_save_userkey_mem(key, exportPassphrase, ppkLength);
+
+	key->alg->freekey(key->data);
+	sfree(key->comment);
+	sfree(key);
+
+	if (!*ppk)
+	{
+		printf("Error: unable to encode key\n");
+		return 22; // EINVAL
+	}
+
+	return 0;
+}
+
+void KeyConvertFreeBuffer(char *ppk, int ppkLength)
+{
+	if (ppk)
+	{
+		smemclr(ppk, ppkLength);
+		sfree(ppk);
+	}
+}
@@ -3,4 +3,7 @@
 
 #pragma once
 
-int KeyConvertNative(char *importPath, char *exportPath);
\ No newline at end of file
+int KeyConvertNative(char *importPath, char *exportPath);
+void KeyConvertNativeBatch(int n, char **importPaths, char **exportPaths, int *results);
+int KeyConvertNativeBuffer(const char *pem, int pemLength, char **ppk, int *ppkLength);
+void KeyConvertFreeBuffer(char *ppk, int ppkLength);
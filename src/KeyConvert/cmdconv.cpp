@@ -0,0 +1,231 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* cmdconv.cpp: command-line front end to KeyConvertNative, for
+* converting OpenSSH PEM private keys to PuTTY PPK files in bulk on
+* machines without the GUI. Every argument may be a single PEM file or
+* a directory, in which case every *.pem file directly inside it is
+* converted. All conversions happen in this one process, in batches
+* of up to BATCH files, whose PPK hashing is done together.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "KeyConvert.h"
+#include "misc.h"
+#include "ssh.h"
+
+static const char *outdir = NULL;
+static int quiet = 0;
+static int nconverted = 0, nfailed = 0;
+
+#define BATCH 64
+static char *pending_in[BATCH], *pending_out[BATCH];
+static int npending = 0;
+
+static void usage(void)
+{
+	printf("usage: keyconvert [-q] [-o outdir] [--check level] path [path...]\n"
+		"       keyconvert --calibrate\n"
+		"  Converts OpenSSH PEM private keys to PuTTY PPK files.\n"
+		"  Each path is either a PEM file or a directory; for a\n"
+		"  directory every *.pem file in it is converted.\n"
+		"  -o outdir  write the .ppk files to outdir (default: next to\n"
+		"             each input file)\n"
+		"  -q         only report failures\n"
+		"  --check full|cheap|none\n"
+		"             how much to check each RSA key's consistency:\n"
+		"             everything (the default), just n == pq, or\n"
+		"             nothing, for keys from a trusted source\n"
+		"  --calibrate\n"
+		"             time the bignum multiplications that key operations\n"
+		"             do on this machine and report the Karatsuba\n"
+		"             threshold that makes them fastest\n");
+}
+
+/*
+* Work out the output path for a given input: the input's basename
+* with any .pem suffix replaced by .ppk, placed in outdir if one was
+* given. Returns a dynamically allocated string.
+*/
+static char *output_path(const char *input)
+{
+	const char *base, *slash;
+	char *ret;
+	int baselen, dirlen;
+
+	slash = strrchr(input, '/');
+	base = slash ? slash + 1 : input;
+	baselen = strlen(base);
+	if (strendswith(base, ".pem"))
+		baselen -= 4;
+
+	if (outdir) {
+		dirlen = strlen(outdir);
+		ret = snewn(dirlen + 1 + baselen + 5, char);
+		sprintf(ret, "%s/%.*s.ppk", outdir, baselen, base);
+	}
+	else {
+		dirlen = base - input;
+		ret = snewn(dirlen + baselen + 5, char);
+		sprintf(ret, "%.*s%.*s.ppk", dirlen, input, baselen, base);
+	}
+	return ret;
+}
+
+/*
+* Convert the files queued up by convert_file.
+*/
+static void flush_pending(void)
+{
+	int results[BATCH];
+	int i;
+
+	if (!npending)
+		return;
+
+	KeyConvertNativeBatch(npending, pending_in, pending_out, results);
+
+	for (i = 0; i < npending; i++) {
+		if (results[i] == 0) {
+			nconverted++;
+			if (!quiet)
+				printf("%s -> %s\n", pending_in[i], pending_out[i]);
+		}
+		else {
+			nfailed++;
+			fprintf(stderr, "keyconvert: failed to convert %s\n",
+				pending_in[i]);
+		}
+		sfree(pending_out[i]);
+		sfree(pending_in[i]);
+	}
+	npending = 0;
+}
+
+static void convert_file(const char *input)
+{
+	pending_in[npending] = dupstr(input);
+	pending_out[npending] = output_path(input);
+	if (++npending == BATCH)
+		flush_pending();
+}
+
+static void convert_dir(const char *dirname)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+
+	dir = opendir(dirname);
+	if (!dir) {
+		nfailed++;
+		fprintf(stderr, "keyconvert: unable to open directory %s\n", dirname);
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		char *path;
+
+		if (!strendswith(de->d_name, ".pem"))
+			continue;
+
+		path = snewn(strlen(dirname) + 1 + strlen(de->d_name) + 1, char);
+		sprintf(path, "%s/%s", dirname, de->d_name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			convert_file(path);
+		sfree(path);
+	}
+
+	closedir(dir);
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	int i, npaths = 0, calibrate = 0;
+
+	/*
+	* The PPK files we write hold unencrypted private keys, so make
+	* sure nobody else can read them.
+	*/
+	umask(077);
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o")) {
+			if (++i >= argc) {
+				usage();
+				return 2;
+			}
+			outdir = argv[i];
+		}
+		else if (!strcmp(argv[i], "-q")) {
+			quiet = 1;
+		}
+		else if (!strcmp(argv[i], "--check")) {
+			if (++i >= argc) {
+				usage();
+				return 2;
+			}
+			if (!strcmp(argv[i], "full"))
+				rsa_set_check_level(RSA_CHECK_FULL);
+			else if (!strcmp(argv[i], "cheap"))
+				rsa_set_check_level(RSA_CHECK_CHEAP);
+			else if (!strcmp(argv[i], "none"))
+				rsa_set_check_level(RSA_CHECK_DEFERRED);
+			else {
+				fprintf(stderr, "keyconvert: unknown check level '%s'\n",
+					argv[i]);
+				usage();
+				return 2;
+			}
+		}
+		else if (!strcmp(argv[i], "--calibrate")) {
+			calibrate = 1;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage();
+			return 0;
+		}
+		else if (argv[i][0] == '-' && argv[i][1]) {
+			fprintf(stderr, "keyconvert: unrecognised option '%s'\n", argv[i]);
+			usage();
+			return 2;
+		}
+		else {
+			argv[++npaths] = argv[i];
+		}
+	}
+
+	if (calibrate) {
+		int threshold = bignum_calibrate_karatsuba();
+		printf("Karatsuba threshold: %d words of %d bits\n",
+			threshold, BIGNUM_INT_BITS);
+		if (!npaths)
+			return 0;
+	}
+
+	if (!npaths) {
+		usage();
+		return 2;
+	}
+
+	for (i = 1; i <= npaths; i++) {
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+			convert_dir(argv[i]);
+		else
+			convert_file(argv[i]);
+	}
+	flush_pending();
+
+	if (!quiet)
+		printf("%d converted, %d failed\n", nconverted, nfailed);
+
+	return nfailed ? 1 : 0;
+}
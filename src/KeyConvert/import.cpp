@@ -93,11 +93,42 @@ struct openssh_key {
 	int keyblob_len, keyblob_size;
 };
 
-static struct openssh_key *load_openssh_key(const Filename *filename,
+/*
+* Source of lines of key file text: either an open stdio file, or a
+* buffer holding the whole key file in memory, so that keys obtained
+* from elsewhere need never be written to disk.
+*/
+struct key_lines {
+	FILE *fp;
+	const char *data, *end;
+};
+
+static char *key_lines_get(struct key_lines *src)
+{
+	const char *p, *eol;
+	char *ret;
+	int len;
+
+	if (src->fp)
+		return fgetline(src->fp);
+
+	p = src->data;
+	if (p >= src->end)
+		return NULL;
+	eol = (const char *)memchr(p, '\n', src->end - p);
+	eol = eol ? eol + 1 : src->end;
+	len = eol - p;
+	ret = snewn(len + 1, char);
+	memcpy(ret, p, len);
+	ret[len] = '\0';
+	src->data = eol;
+	return ret;
+}
+
+static struct openssh_key *load_openssh_key_lines(struct key_lines *src,
 	const char **errmsg_p)
 {
 	struct openssh_key *ret;
-	FILE *fp = NULL;
 	char *line = NULL;
 	char *errmsg, *p;
 	int headers_done;
@@ -110,13 +141,7 @@ static struct openssh_key *load_openssh_key(const Filename *filename,
 	ret->encrypted = 0;
 	memset(ret->iv, 0, sizeof(ret->iv));
 
-	fp = f_open(filename, "r", FALSE);
-	if (!fp) {
-		errmsg = "unable to open key file";
-		goto error;
-	}
-
-	if (!(line = fgetline(fp))) {
+	if (!(line = key_lines_get(src))) {
 		errmsg = "unexpected end of file";
 		goto error;
 	}
@@ -140,7 +165,7 @@ static struct openssh_key *load_openssh_key(const Filename *filename,
 
 	headers_done = 0;
 	while (1) {
-		if (!(line = fgetline(fp))) {
+		if (!(line = key_lines_get(src))) {
 			errmsg = "unexpected end of file";
 			goto error;
 		}
@@ -236,9 +261,6 @@ static struct openssh_key *load_openssh_key(const Filename *filename,
 		line = NULL;
 	}
 
-	fclose(fp);
-	fp = NULL;
-
 	if (ret->keyblob_len == 0 || !ret->keyblob) {
 		errmsg = "key body not present";
 		goto error;
@@ -269,16 +291,48 @@ error:
 		sfree(ret);
 	}
 	if (errmsg_p) *errmsg_p = errmsg;
-	if (fp) fclose(fp);
 	return NULL;
 }
 
+static struct openssh_key *load_openssh_key(const Filename *filename,
+	const char **errmsg_p)
+{
+	struct openssh_key *ret;
+	struct key_lines src;
 
-//513
-struct ssh2_userkey *openssh_read(const Filename *filename, char *passphrase,
+	src.fp = f_open(filename, "r", FALSE);
+	if (!src.fp) {
+		if (errmsg_p) *errmsg_p = "unable to open key file";
+		return NULL;
+	}
+	src.data = src.end = NULL;
+
+	ret = load_openssh_key_lines(&src, errmsg_p);
+	fclose(src.fp);
+	return ret;
+}
+
+static struct openssh_key *load_openssh_key_mem(const void *data, int len,
 	const char **errmsg_p)
 {
-	struct openssh_key *key = load_openssh_key(filename, errmsg_p);
+	struct key_lines src;
+
+	src.fp = NULL;
+	src.data = (const char *)data;
+	src.end = src.data + len;
+
+	return load_openssh_key_lines(&src, errmsg_p);
+}
+
+
+//513
+/*
+* Turn a loaded OpenSSH key into an ssh2_userkey. Consumes (and wipes)
+* the openssh_key whether or not it succeeds.
+*/
+static struct ssh2_userkey *openssh_decode(struct openssh_key *key,
+	char *passphrase, const char **errmsg_p)
+{
 	struct ssh2_userkey *retkey;
 	unsigned char *p;
 	int ret, id, len, flags;
@@ -289,6 +343,8 @@ struct ssh2_userkey *openssh_read(const Filename *filename, char *passphrase,
 	int blobsize = 0, blobptr, privptr;
 	char *modptr = NULL;
 	int modlen = 0;
+	char *crtptr[2] = { NULL, NULL };
+	int crtlen[2] = { 0, 0 };
 
 	blob = NULL;
 
@@ -419,14 +475,21 @@ struct ssh2_userkey *openssh_read(const Filename *filename, char *passphrase,
 			/*
 			* Integers 1 and 2 go into the public blob but in the
 			* opposite order; integers 3, 4, 5 and 8 go into the
-			* private blob. The other two (6 and 7) are ignored.
+			* private blob, followed by the CRT exponents 6 and 7,
+			* which rsa2_createkey keeps so it need not recompute
+			* them.
 			*/
 			if (i == 1) {
 				/* Save the details for after we deal with number 2. */
 				modptr = (char *)p;
 				modlen = len;
 			}
-			else if (i != 6 && i != 7) {
+			else if (i == 6 || i == 7) {
+				/* Save these until after number 8. */
+				crtptr[i - 6] = (char *)p;
+				crtlen[i - 6] = len;
+			}
+			else {
 				PUT_32BIT(blob + blobptr, len);
 				memcpy(blob + blobptr + 4, p, len);
 				blobptr += 4 + len;
@@ -436,6 +499,14 @@ struct ssh2_userkey *openssh_read(const Filename *filename, char *passphrase,
 					blobptr += 4 + modlen;
 					privptr = blobptr;
 				}
+				if (i == 8) {
+					int j;
+					for (j = 0; j < 2; j++) {
+						PUT_32BIT(blob + blobptr, crtlen[j]);
+						memcpy(blob + blobptr + 4, crtptr[j], crtlen[j]);
+						blobptr += 4 + crtlen[j];
+					}
+				}
 			}
 		}
 		else if (key->type == OSSH_DSA) {
@@ -488,6 +559,20 @@ error:
 	return retval;
 }
 
+struct ssh2_userkey *openssh_read(const Filename *filename, char *passphrase,
+	const char **errmsg_p)
+{
+	return openssh_decode(load_openssh_key(filename, errmsg_p),
+		passphrase, errmsg_p);
+}
+
+struct ssh2_userkey *openssh_read_mem(const void *data, int len,
+	char *passphrase, const char **errmsg_p)
+{
+	return openssh_decode(load_openssh_key_mem(data, len, errmsg_p),
+		passphrase, errmsg_p);
+}
+
 /*
 * Import an SSH-2 key.
 */
@@ -499,4 +584,15 @@ struct ssh2_userkey *import_ssh2(const Filename *filename, int type,
 	//if (type == SSH_KEYTYPE_SSHCOM)
 	//	return sshcom_read(filename, passphrase, errmsg_p);
 	return NULL;
-}
\ No newline at end of file
+}
+
+/*
+* Import an SSH-2 key from the contents of a key file held in memory.
+*/
+struct ssh2_userkey *import_ssh2_mem(const void *data, int len, int type,
+	char *passphrase, const char **errmsg_p)
+{
+	if (type == SSH_KEYTYPE_OPENSSH)
+		return openssh_read_mem(data, len, passphrase, errmsg_p);
+	return NULL;
+}
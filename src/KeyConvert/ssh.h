@@ -2,13 +2,27 @@
 // SPDX-License-Identifier: MIT-0
 
 #include "misc.h"
+#include "sshbn.h"
 
 
 //78
 #ifndef BIGNUM_INTERNAL
-typedef unsigned __int32 *Bignum; // this is only true if defined _MSC_VER && defined _M_IX86. If retargeting, see sshbn.h
+typedef BignumInt *Bignum;
 #endif
 
+typedef struct MontyContext MontyContext;
+typedef struct MontyComb MontyComb;
+typedef struct SshLock SshLock;
+
+/*
+* An RSA key may be used by several threads at once. What using it
+* changes (the Montgomery contexts and blinding pair, set up on first
+* use, the blinding pair again on every private-key operation, and a
+* deferred check, which may put p and q the other way round) is only
+* changed with the key's lock held, and each operation takes the lock
+* before reading any of it. Nothing else may change a key while it is
+* in use, and freersakey must wait until every thread has finished.
+*/
 struct RSAKey {
 int bits;
 int bytes;
@@ -22,14 +36,30 @@ Bignum private_exponent;
 Bignum p;
 Bignum q;
 Bignum iqmp;
+Bignum dmp1;	/* private_exponent mod (p-1), for CRT */
+Bignum dmq1;	/* private_exponent mod (q-1), for CRT */
+MontyContext *monty_n, *monty_p, *monty_q;	/* set up on first use */
+Bignum blind_fwd, blind_inv;	/* blinding pair r^e, r^-1 mod n, ditto */
+int unchecked;	/* rsa_verify deferred to first private op */
+int checkops;	/* only partly checked: check each private op's result */
+SshLock *lock;	/* see above */
 #endif
 char *comment;
 };
 
 struct dss_key {
 	Bignum p, q, g, y, x;
+	MontyContext *monty_p;	/* set up on first use */
+	MontyComb *comb_g;	/* powers of g mod p, ditto */
+	SshLock *lock;	/* guards the two lines above */
 };
 
+int rsa_verify(struct RSAKey *key);
+
+/* How thoroughly RSA private keys are checked when loaded. */
+enum { RSA_CHECK_FULL, RSA_CHECK_CHEAP, RSA_CHECK_DEFERRED };
+void rsa_set_check_level(int level);
+
 
 //118
 #ifndef PUTTY_UINT32_DEFINED
@@ -39,10 +69,7 @@ typedef unsigned int uint32;
 #endif
 typedef uint32 word32;
 
-// from int64.h
-typedef struct {
-	unsigned long hi, lo;
-} uint64;
+typedef unsigned long long uint64;
 
 /* 134
 * SSH2 RSA key exchange functions
@@ -96,7 +123,89 @@ void SHA_Init(SHA_State * s);
 void SHA_Bytes(SHA_State * s, const void *p, int len);
 void SHA_Final(SHA_State * s, unsigned char *output);
 void SHA_Simple(const void *p, int len, unsigned char *output);
+void SHA_Simple_multi(int n, const void *const *p, const int *len,
+	unsigned char *const *output);
+
+typedef struct {
+	uint32 h[8];
+	unsigned char block[64];
+	int blkused;
+	uint32 lenhi, lenlo;
+} SHA256_State;
+void SHA256_Init(SHA256_State * s);
+void SHA256_Bytes(SHA256_State * s, const void *p, int len);
+void SHA256_Final(SHA256_State * s, unsigned char *output);
+void SHA256_Simple(const void *p, int len, unsigned char *output);
+void SHA256_Simple_multi(int n, const void *const *p, const int *len,
+	unsigned char *const *output);
+
+void *hmacsha256_make_context(void);
+void hmacsha256_free_context(void *handle);
+void hmacsha256_key(void *handle, void const *key, int len);
+void hmacsha256_do_hmac(void *handle, unsigned char const *blk, int len,
+	unsigned char *hmac);
+void hmacsha256_do_hmac_multi(void *handle, int n,
+	unsigned char const *const *blk, const int *len,
+	unsigned char *const *hmac);
+
+/*
+* sha_set_simd chooses the fastest SHA-1 and SHA-256 code that may be
+* used, if the CPU has it; SHA_SIMD_NI, allowing anything, is the
+* default. (There is no SSSE3 code for SHA-256.)
+*
+* The _multi functions hash many independent messages at once. Below
+* SHA_SIMD_NI, or on CPUs without the SHA extensions, they use the
+* AVX2 multi-buffer code if the CPU has it and there are enough
+* messages; otherwise they hash the messages one at a time.
+*/
+enum { SHA_SIMD_NONE, SHA_SIMD_SSSE3, SHA_SIMD_NI };
+void sha_set_simd(int level);
+int sha_get_simd(void);
+
+/*
+* The x86-64 CPU features, in sshcpu.cpp. cpu_cpuid returns CPUID.1:ECX
+* and CPUID.7.0:EBX. The AVX2 and AVX-512 code also needs the OS to
+* save the YMM and ZMM registers: cpu_xsave_features returns EBX7 and
+* XCR0, which says which register state the OS saves, for the caller to
+* test its own bits in, or 0 if the OS hasn't enabled XSAVE at all.
+* cpu_has_avx2 does that test for AVX2.
+*/
+#if defined __x86_64__ || defined _M_AMD64
+void cpu_cpuid(unsigned int *ecx1, unsigned int *ebx7);
+int cpu_xsave_features(unsigned int *ebx7, unsigned long long *xcr0);
+int cpu_has_avx2(void);
+#endif
 
+/*
+* The SHA extensions (SHA-NI) and SSSE3 code in sshshasimd.cpp, and
+* the AVX2 multi-buffer code in sshshamulti.cpp, for x86-64. Define
+* SHA_NO_SIMD to leave them out.
+*/
+#if (defined __x86_64__ || defined _M_AMD64) && !defined SHA_NO_SIMD
+#define SHA_SIMD
+int sha_ni_available(void);
+int sha_ssse3_available(void);
+void sha1_ni_blocks(uint32 *h, const unsigned char *p, int nblocks);
+void sha1_ssse3_schedule(uint32 *wk, const unsigned char *block);
+void sha256_ni_blocks(uint32 *h, const unsigned char *p, int nblocks,
+	const uint32 *k);
+int sha_use_multi(int n);
+int sha_multi_available(void);
+void sha1_multi(int n, const uint32 *init, int prefix,
+	const unsigned char *const *p, const int *len, unsigned char *const *out);
+void sha256_multi(int n, const uint32 *init, int prefix,
+	const unsigned char *const *p, const int *len, unsigned char *const *out,
+	const uint32 *k);
+#endif
+
+void *hmacsha1_make_context(void);
+void hmacsha1_free_context(void *handle);
+void hmacsha1_key(void *handle, void const *key, int len);
+void hmacsha1_do_hmac(void *handle, unsigned char const *blk, int len,
+	unsigned char *hmac);
+void hmacsha1_do_hmac_multi(void *handle, int n,
+	unsigned char const *const *blk, const int *len,
+	unsigned char *const *hmac);
 void hmac_sha1_simple(void *key, int keylen, void *data, int datalen,
 	unsigned char *output);
 
@@ -107,12 +216,24 @@ typedef struct {
 	uint64 h[8];
 	unsigned char block[128];
 	int blkused;
-	uint32 len[4];
+	uint64 lenhi, lenlo;	       /* bytes so far */
 } SHA512_State;
 void SHA512_Init(SHA512_State * s);
 void SHA512_Bytes(SHA512_State * s, const void *p, int len);
 void SHA512_Final(SHA512_State * s, unsigned char *output);
 void SHA512_Simple(const void *p, int len, unsigned char *output);
+void sha512_set_avx2(int enable);
+
+/*
+* The AVX2 message schedule in sshsh512avx2.cpp, for x86-64. Define
+* SHA512_NO_AVX2 to leave it out.
+*/
+#if (defined __x86_64__ || defined _M_AMD64) && !defined SHA512_NO_AVX2
+#define SHA512_AVX2
+int sha512_avx2_available(void);
+void sha512_avx2_schedule(uint64 *wk, const unsigned char *block,
+	const uint64 *k);
+#endif
 
 struct ssh_cipher {
 	void *(*make_context)(void);
@@ -201,6 +322,10 @@ struct ssh_signkey {
 		char *data, int datalen);
 	unsigned char *(*sign) (void *key, char *data, int datalen,
 		int *siglen);
+	/* Sign nmsgs messages at once, as if by sign() on each, putting
+	* the signatures in sigs[] and their lengths in siglens[]. */
+	void(*sign_batch) (void *key, int nmsgs, char **data, int *datalens,
+		unsigned char **sigs, int *siglens);
 	char *name;
 	char *keytype;		       /* for host key cache */
 };
@@ -234,11 +359,11 @@ extern const struct ssh_hash ssh_sha256;
 extern const struct ssh_signkey ssh_dss;
 extern const struct ssh_signkey ssh_rsa;
 //extern const struct ssh_mac ssh_hmac_md5;
-//extern const struct ssh_mac ssh_hmac_sha1;
+extern const struct ssh_mac ssh_hmac_sha1;
 //extern const struct ssh_mac ssh_hmac_sha1_buggy;
 //extern const struct ssh_mac ssh_hmac_sha1_96;
 //extern const struct ssh_mac ssh_hmac_sha1_96_buggy;
-//extern const struct ssh_mac ssh_hmac_sha256;
+extern const struct ssh_mac ssh_hmac_sha256;
 
 void *aes_make_context(void);
 void aes_free_context(void *handle);
@@ -249,6 +374,29 @@ void aes_iv(void *handle, unsigned char *iv);
 void aes_ssh2_encrypt_blk(void *handle, unsigned char *blk, int len);
 void aes_ssh2_decrypt_blk(void *handle, unsigned char *blk, int len);
 
+/*
+* aes_set_ni(0) makes contexts set up afterwards use the portable
+* table code even if the CPU has the AES instructions.
+*/
+void aes_set_ni(int enable);
+
+/*
+* The AES-NI code in sshaesni.cpp, for x86-64. Define AES_NO_NI to
+* leave it out.
+*/
+#if (defined __x86_64__ || defined _M_AMD64) && !defined AES_NO_NI
+#define AES_NI
+int aes_ni_available(void);
+void aes_ni_setup(unsigned char *keys, unsigned char *invkeys,
+	const unsigned char *key, int keylen);
+void aes_ni_encrypt_cbc(const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len);
+void aes_ni_decrypt_cbc(const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len);
+void aes_ni_sdctr(const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len);
+#endif
+
 //370
 int random_byte(void);
 
@@ -260,7 +408,32 @@ void bn_restore_invariant(Bignum b);
 //Bignum bignum_from_long(unsigned long n);
 void freebn(Bignum b);
 Bignum modpow(Bignum base, Bignum exp, Bignum mod);
+Bignum dual_modpow(Bignum a, Bignum x, Bignum b, Bignum y, Bignum mod);
 Bignum modmul(Bignum a, Bignum b, Bignum mod);
+MontyContext *monty_new(Bignum mod);
+void monty_free(MontyContext *mc);
+Bignum monty_modpow(MontyContext *mc, Bignum base, Bignum exp);
+Bignum monty_modpow_secret(MontyContext *mc, Bignum base, Bignum exp);
+Bignum monty_dual_modpow(MontyContext *mc, Bignum a, Bignum x,
+	Bignum b, Bignum y);
+Bignum monty_modmul(MontyContext *mc, Bignum a, Bignum b);
+MontyComb *monty_comb_new(MontyContext *mc, Bignum base, int maxbits);
+void monty_comb_free(MontyComb *comb);
+Bignum monty_comb_modpow(MontyComb *comb, Bignum exp);
+void bignum_set_karatsuba_threshold(int len);
+void bignum_set_ifma(int enable);
+int bn_arena_begin(void);
+Bignum bn_arena_end(int mark, Bignum keep);
+Bignum bn_arena_keep(Bignum b);
+void bn_arena_cleanup(void);
+int bignum_calibrate_karatsuba(void);
+int ssh_pool_start(void);
+void ssh_pool_stop(void);
+void ssh_pool_run2(void(*fa)(void *), void *ca, void(*fb)(void *), void *cb);
+SshLock *ssh_lock_new(void);
+void ssh_lock_free(SshLock *l);
+void ssh_lock(SshLock *l);
+void ssh_unlock(SshLock *l);
 void decbn(Bignum n);
 extern Bignum Zero, One;
 Bignum bignum_from_bytes(const unsigned char *data, int nbytes);
@@ -269,6 +442,7 @@ int bignum_bitcount(Bignum bn);
 int ssh1_bignum_length(Bignum bn);
 int ssh2_bignum_length(Bignum bn);
 int bignum_byte(Bignum bn, int i);
+void bignum_to_bytes(Bignum bn, int lo, unsigned char *data, int nbytes);
 //int bignum_bit(Bignum bn, int i);
 void bignum_set_bit(Bignum bn, int i, int value);
 int ssh1_write_bignum(void *data, Bignum bn);
@@ -294,6 +468,7 @@ int base64_lines(int datalen);
 
 //554
 void base64_encode(FILE *fp, unsigned char *data, int datalen, int cpl);
+int base64_encode_buf(char *out, unsigned char *data, int datalen, int cpl);
 
 
 //556
@@ -304,6 +479,12 @@ extern struct ssh2_userkey ssh2_wrong_passphrase;
 //566
 int ssh2_save_userkey(const Filename *filename, struct ssh2_userkey *key,
 	char *passphrase);
+char *ssh2_save_userkey_mem(struct ssh2_userkey *key, char *passphrase,
+	int *len);
+int ssh2_save_userkeys_mem(int n, struct ssh2_userkey **keys,
+	char *passphrase, char **texts, int *lens);
+void ssh2_save_userkeys(int n, const Filename *filenames,
+	struct ssh2_userkey **keys, char *passphrase, int *results);
 
 
 //570
@@ -318,6 +499,8 @@ enum {
 //584
 struct ssh2_userkey *import_ssh2(const Filename *filename, int type,
 	char *passphrase, const char **errmsg_p);
+struct ssh2_userkey *import_ssh2_mem(const void *data, int len, int type,
+	char *passphrase, const char **errmsg_p);
 
 //593
 void des3_decrypt_pubkey_ossh(unsigned char *key, unsigned char *iv,
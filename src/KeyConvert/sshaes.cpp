@@ -28,6 +28,9 @@
 * GET_32BIT_LSB_FIRST for GET_32BIT_MSB_FIRST, I could create an
 * implementation that worked internally little-endian and gave the
 * same answers at the same speed.
+*
+* On x86-64 CPUs with the AES instructions, the 128-bit block modes
+* use sshaesni.cpp instead, chosen when the key is set up.
 */
 
 #include <assert.h>
@@ -50,8 +53,29 @@ struct AESContext {
 	void(*decrypt) (AESContext * ctx, word32 * block);
 	word32 iv[MAX_NB];
 	int Nb, Nr;
+#ifdef AES_NI
+	/* Round keys for sshaesni.cpp, used instead of the above if ni */
+	unsigned char ni_keys[(MAX_NR + 1) * 16];
+	unsigned char ni_invkeys[(MAX_NR + 1) * 16];
+	int ni;
+#endif
 };
 
+#ifdef AES_NI
+/*
+* Whether to use the AES instructions when the CPU has them; see
+* aes_set_ni.
+*/
+static int aes_use_ni = 1;
+#endif
+
+void aes_set_ni(int enable)
+{
+#ifdef AES_NI
+	aes_use_ni = enable;
+#endif
+}
+
 static const unsigned char Sbox[256] = {
 	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
 	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
@@ -954,6 +978,19 @@ static void aes_setup(AESContext * ctx, int blocklen,
 	else if (ctx->Nb == 4)
 		ctx->encrypt = aes_encrypt_nb_4, ctx->decrypt = aes_decrypt_nb_4;
 
+#ifdef AES_NI
+	/*
+	* With the AES instructions, the modes below don't use the
+	* functions above, and only need the sshaesni.cpp key schedule.
+	*/
+	ctx->ni = 0;
+	if (aes_use_ni && ctx->Nb == 4 && aes_ni_available()) {
+		aes_ni_setup(ctx->ni_keys, ctx->ni_invkeys, key, keylen);
+		ctx->ni = 1;
+		return;
+	}
+#endif
+
 	/*
 	* Now do the key setup itself.
 	*/
@@ -1029,6 +1066,25 @@ static void aes_decrypt(AESContext * ctx, word32 * block)
 	ctx->decrypt(ctx, block);
 }
 
+#ifdef AES_NI
+/*
+* Run one of the sshaesni.cpp modes, which take the IV as bytes.
+*/
+static void aes_ni_mode(void (*mode) (const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len),
+	const unsigned char *keys, AESContext * ctx, unsigned char *blk, int len)
+{
+	unsigned char iv[16];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		PUT_32BIT_MSB_FIRST(iv + 4 * i, ctx->iv[i]);
+	mode(keys, ctx->Nr, iv, blk, len);
+	for (i = 0; i < 4; i++)
+		ctx->iv[i] = GET_32BIT_MSB_FIRST(iv + 4 * i);
+}
+#endif
+
 static void aes_encrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 {
 	word32 iv[4];
@@ -1036,6 +1092,13 @@ static void aes_encrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 
 	assert((len & 15) == 0);
 
+#ifdef AES_NI
+	if (ctx->ni) {
+		aes_ni_mode(aes_ni_encrypt_cbc, ctx->ni_keys, ctx, blk, len);
+		return;
+	}
+#endif
+
 	memcpy(iv, ctx->iv, sizeof(iv));
 
 	while (len > 0) {
@@ -1058,6 +1121,13 @@ static void aes_decrypt_cbc(unsigned char *blk, int len, AESContext * ctx)
 
 	assert((len & 15) == 0);
 
+#ifdef AES_NI
+	if (ctx->ni) {
+		aes_ni_mode(aes_ni_decrypt_cbc, ctx->ni_invkeys, ctx, blk, len);
+		return;
+	}
+#endif
+
 	memcpy(iv, ctx->iv, sizeof(iv));
 
 	while (len > 0) {
@@ -1082,6 +1152,13 @@ static void aes_sdctr(unsigned char *blk, int len, AESContext *ctx)
 
 	assert((len & 15) == 0);
 
+#ifdef AES_NI
+	if (ctx->ni) {
+		aes_ni_mode(aes_ni_sdctr, ctx->ni_keys, ctx, blk, len);
+		return;
+	}
+#endif
+
 	memcpy(iv, ctx->iv, sizeof(iv));
 
 	while (len > 0) {
@@ -1236,3 +1313,199 @@ const struct ssh2_ciphers ssh2_aes = {
 	sizeof(aes_list) / sizeof(*aes_list),
 	aes_list
 };
+
+#ifdef TEST
+
+/*
+* This tests AES against the FIPS-197 examples, and checks that the
+* AES-NI code gives the same results as the table code in every mode.
+* 'sshaes --bench' measures the speed of both.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+static void (*const key_fns[])(void *, unsigned char *) = {
+	aes128_key, aes192_key, aes256_key
+};
+
+static int ni_usable(void) {
+#ifdef AES_NI
+	return aes_ni_available();
+#else
+	return 0;
+#endif
+}
+
+static void bench(void) {
+	static unsigned char buf[65536];
+	unsigned char key[32], iv[16];
+	void *ctx = aes_make_context();
+	int ni, mode;
+	long i, reps;
+
+	static const char *const mode_names[] = {
+		"CBC encrypt", "CBC decrypt", "SDCTR      "
+	};
+
+	memset(key, 0x5A, sizeof(key));
+	memset(iv, 0xA5, sizeof(iv));
+	for (ni = 0; ni <= ni_usable(); ni++) {
+		aes_set_ni(ni);
+		aes256_key(ctx, key);
+		aes_iv(ctx, iv);
+		for (mode = 0; mode < 3; mode++) {
+			clock_t start;
+			double secs;
+
+			reps = (64L << 20) / sizeof(buf);
+			start = clock();
+			for (i = 0; i < reps; i++) {
+				if (mode == 0)
+					aes_ssh2_encrypt_blk(ctx, buf, sizeof(buf));
+				else if (mode == 1)
+					aes_ssh2_decrypt_blk(ctx, buf, sizeof(buf));
+				else
+					aes_ssh2_sdctr(ctx, buf, sizeof(buf));
+			}
+			secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+			printf("AES-256 %s %s: %.1f MB/s\n", mode_names[mode],
+				ni ? "aes-ni" : "tables", reps * (double)sizeof(buf) / secs / 1e6);
+		}
+	}
+	aes_set_ni(1);
+	aes_free_context(ctx);
+}
+
+int main(int argc, char **argv) {
+	static const unsigned char plaintext[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff,
+	};
+	static const unsigned char expected[3][16] = {
+		{ 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		  0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a },
+		{ 0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0,
+		  0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 },
+		{ 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+		  0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 },
+	};
+	static unsigned char buf[2][1040], orig[1040];
+	unsigned char key[32], iv[16], zeroiv[16], blk[16];
+	void *ctx[2];
+	int ni, ks, len, mode, i, errors;
+
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench();
+		return 0;
+	}
+
+	errors = 0;
+	ctx[0] = aes_make_context();
+	ctx[1] = aes_make_context();
+	memset(zeroiv, 0, sizeof(zeroiv));
+	for (i = 0; i < 32; i++)
+		key[i] = (unsigned char)i;
+
+	/*
+	* FIPS-197 appendix C: one block with each key size, which CBC
+	* with a zero IV encrypts as it is.
+	*/
+	for (ni = 0; ni <= ni_usable(); ni++) {
+		aes_set_ni(ni);
+		for (ks = 0; ks < 3; ks++) {
+			key_fns[ks](ctx[0], key);
+			aes_iv(ctx[0], zeroiv);
+			memcpy(blk, plaintext, 16);
+			aes_ssh2_encrypt_blk(ctx[0], blk, 16);
+			if (memcmp(blk, expected[ks], 16)) {
+				fprintf(stderr, "AES-%d %s: wrong ciphertext\n",
+					128 + 64 * ks, ni ? "aes-ni" : "tables");
+				errors++;
+			}
+			aes_iv(ctx[0], zeroiv);
+			aes_ssh2_decrypt_blk(ctx[0], blk, 16);
+			if (memcmp(blk, plaintext, 16)) {
+				fprintf(stderr, "AES-%d %s: wrong plaintext\n",
+					128 + 64 * ks, ni ? "aes-ni" : "tables");
+				errors++;
+			}
+		}
+	}
+
+	/*
+	* Each mode, with each key size and a range of lengths, on the
+	* table code (ctx[0]) and the AES-NI code (ctx[1]). The IV's low
+	* words are near all ones, so SDCTR carries between the halves of
+	* the counter. Each call carries on from where the last left the
+	* IV, so the IV updates are checked too.
+	*/
+	if (ni_usable()) {
+		for (i = 0; i < (int)sizeof(orig); i++)
+			orig[i] = (unsigned char)(i * 29 + 3);
+		for (i = 0; i < 16; i++)
+			iv[i] = i < 9 ? (unsigned char)(i + 1) : 0xFF;
+		iv[15] = 0xFD;
+
+		for (ks = 0; ks < 3; ks++) {
+			for (ni = 0; ni < 2; ni++) {
+				aes_set_ni(ni);
+				key_fns[ks](ctx[ni], key);
+				aes_iv(ctx[ni], iv);
+				memcpy(buf[ni], orig, sizeof(orig));
+			}
+			aes_set_ni(1);
+
+			for (mode = 0; mode < 3; mode++) {
+				for (len = 0; len <= 1040; len += 16 * (len < 160 ? 1 : 11)) {
+					for (ni = 0; ni < 2; ni++) {
+						if (mode == 0)
+							aes_ssh2_encrypt_blk(ctx[ni], buf[ni], len);
+						else if (mode == 1)
+							aes_ssh2_decrypt_blk(ctx[ni], buf[ni], len);
+						else
+							aes_ssh2_sdctr(ctx[ni], buf[ni], len);
+					}
+					if (memcmp(buf[0], buf[1], len) ||
+						memcmp(((AESContext *)ctx[0])->iv,
+						((AESContext *)ctx[1])->iv, 16)) {
+						fprintf(stderr, "AES-%d mode %d length %d: "
+							"aes-ni differs from tables\n",
+							128 + 64 * ks, mode, len);
+						errors++;
+					}
+				}
+			}
+		}
+
+		/* aes256_encrypt_pubkey and aes256_decrypt_pubkey */
+		for (ni = 0; ni < 2; ni++) {
+			aes_set_ni(ni);
+			memcpy(buf[ni], orig, sizeof(orig));
+			aes256_encrypt_pubkey(key, buf[ni], 1024);
+		}
+		if (memcmp(buf[0], buf[1], 1024)) {
+			fprintf(stderr, "aes256_encrypt_pubkey: aes-ni differs from "
+				"tables\n");
+			errors++;
+		}
+		aes256_decrypt_pubkey(key, buf[1], 1024);
+		if (memcmp(buf[1], orig, 1024)) {
+			fprintf(stderr, "aes256_decrypt_pubkey: wrong plaintext\n");
+			errors++;
+		}
+		aes_set_ni(1);
+	}
+	else {
+		printf("no AES instructions; only the table code was tested\n");
+	}
+
+	aes_free_context(ctx[0]);
+	aes_free_context(ctx[1]);
+
+	printf("%d errors\n", errors);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,294 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* AES using the x86 AES instructions (AES-NI), for the 128-bit block
+* size SSH uses. The key schedule is expanded with AESKEYGENASSIST,
+* and the round keys are kept as bytes, in the order the instructions
+* want them, rather than as the big-endian words of sshaes.cpp.
+*
+* CBC encryption is a serial chain, one block after another; CBC
+* decryption and SDCTR have independent blocks, and do four at a time
+* to keep the AES unit busy.
+*/
+
+#include "ssh.h"
+
+#ifdef AES_NI
+
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+
+#if defined __GNUC__ || defined __clang__
+#define AESNI_TARGET __attribute__((target("aes,sse4.1,ssse3")))
+#else
+#define AESNI_TARGET
+#endif
+
+/*
+* Check whether the CPU has the AES instructions, which are
+* CPUID.1:ECX bit 25. We also use SSSE3 (bit 9) and SSE4.1 (bit 19).
+*/
+int aes_ni_available(void)
+{
+	unsigned int c1, b7;
+
+	cpu_cpuid(&c1, &b7);
+	return (c1 & (1U << 25)) && (c1 & (1U << 9)) && (c1 & (1U << 19));
+}
+
+/*
+* One step of the AES-128 and AES-256 key schedules: fold the previous
+* four words into each other, and add in t, which AESKEYGENASSIST has
+* made from the last word of the key material before.
+*/
+AESNI_TARGET static inline __m128i expand_step(__m128i k, __m128i t)
+{
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, t);
+}
+
+/*
+* AES-192 adds six words at a time: the four in a, and two in the low
+* half of b.
+*/
+AESNI_TARGET static inline void expand_step_192(__m128i *a, __m128i *b,
+	__m128i t)
+{
+	*a = expand_step(*a, _mm_shuffle_epi32(t, 0x55));
+	t = _mm_shuffle_epi32(*a, 0xFF);
+	*b = _mm_xor_si128(*b, _mm_slli_si128(*b, 4));
+	*b = _mm_xor_si128(*b, t);
+}
+
+/* Join the low 64 bits of a to the low 64 bits of b, and so on */
+#define LOLO(a, b) _mm_unpacklo_epi64(a, b)
+#define HILO(a, b) _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(a), \
+	_mm_castsi128_pd(b), 1))
+
+/*
+* Expand a key of keylen bytes (16, 24 or 32) into the round keys for
+* encryption, in keys, and for decryption with AESDEC, in invkeys:
+* (nr + 1) * 16 bytes each, where nr is 10, 12 or 14.
+*/
+AESNI_TARGET void aes_ni_setup(unsigned char *keys, unsigned char *invkeys,
+	const unsigned char *key, int keylen)
+{
+	__m128i rk[15];
+	__m128i a, b;
+	int nr, i;
+
+	if (keylen == 16) {
+		nr = 10;
+		rk[0] = _mm_loadu_si128((const __m128i *)key);
+#define EXPAND128(i, rcon) rk[i] = expand_step(rk[(i) - 1], _mm_shuffle_epi32( \
+	_mm_aeskeygenassist_si128(rk[(i) - 1], rcon), 0xFF))
+		EXPAND128(1, 0x01);
+		EXPAND128(2, 0x02);
+		EXPAND128(3, 0x04);
+		EXPAND128(4, 0x08);
+		EXPAND128(5, 0x10);
+		EXPAND128(6, 0x20);
+		EXPAND128(7, 0x40);
+		EXPAND128(8, 0x80);
+		EXPAND128(9, 0x1B);
+		EXPAND128(10, 0x36);
+#undef EXPAND128
+	}
+	else if (keylen == 24) {
+		/*
+		* Each step makes six words, which straddle the 16-byte
+		* round keys: three steps fill four and a half round keys,
+		* so the steps go in pairs.
+		*/
+		nr = 12;
+		a = _mm_loadu_si128((const __m128i *)key);
+		b = _mm_loadl_epi64((const __m128i *)(key + 16));
+		rk[0] = a;
+#define EXPAND192(i, rcon1, rcon2) \
+		rk[i] = b; \
+		expand_step_192(&a, &b, _mm_aeskeygenassist_si128(b, rcon1)); \
+		rk[i] = LOLO(rk[i], a); \
+		rk[(i) + 1] = HILO(a, b); \
+		expand_step_192(&a, &b, _mm_aeskeygenassist_si128(b, rcon2)); \
+		rk[(i) + 2] = a
+		EXPAND192(1, 0x01, 0x02);
+		EXPAND192(4, 0x04, 0x08);
+		EXPAND192(7, 0x10, 0x20);
+		rk[10] = b;
+		expand_step_192(&a, &b, _mm_aeskeygenassist_si128(b, 0x40));
+		rk[10] = LOLO(rk[10], a);
+		rk[11] = HILO(a, b);
+		expand_step_192(&a, &b, _mm_aeskeygenassist_si128(b, 0x80));
+		rk[12] = a;
+#undef EXPAND192
+	}
+	else {
+		nr = 14;
+		rk[0] = _mm_loadu_si128((const __m128i *)key);
+		rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+#define EXPAND256(i, rcon) \
+		rk[i] = expand_step(rk[(i) - 2], _mm_shuffle_epi32( \
+			_mm_aeskeygenassist_si128(rk[(i) - 1], rcon), 0xFF)); \
+		if ((i) < 14) \
+			rk[(i) + 1] = expand_step(rk[(i) - 1], _mm_shuffle_epi32( \
+				_mm_aeskeygenassist_si128(rk[i], 0), 0xAA))
+		EXPAND256(2, 0x01);
+		EXPAND256(4, 0x02);
+		EXPAND256(6, 0x04);
+		EXPAND256(8, 0x08);
+		EXPAND256(10, 0x10);
+		EXPAND256(12, 0x20);
+		EXPAND256(14, 0x40);
+#undef EXPAND256
+	}
+
+	/*
+	* The decryption keys are the same keys backwards, with
+	* InvMixColumns applied to all but the first and last.
+	*/
+	for (i = 0; i <= nr; i++) {
+		_mm_storeu_si128((__m128i *)(keys + 16 * i), rk[i]);
+		_mm_storeu_si128((__m128i *)(invkeys + 16 * (nr - i)),
+			(i == 0 || i == nr) ? rk[i] : _mm_aesimc_si128(rk[i]));
+	}
+
+	smemclr(rk, sizeof(rk));
+}
+
+#define ROUNDKEY(i) _mm_loadu_si128((const __m128i *)(keys + 16 * (i)))
+
+AESNI_TARGET void aes_ni_encrypt_cbc(const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len)
+{
+	__m128i x;
+	int r;
+
+	x = _mm_loadu_si128((const __m128i *)iv);
+	for (; len > 0; len -= 16, blk += 16) {
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)blk));
+		x = _mm_xor_si128(x, ROUNDKEY(0));
+		for (r = 1; r < nr; r++)
+			x = _mm_aesenc_si128(x, ROUNDKEY(r));
+		x = _mm_aesenclast_si128(x, ROUNDKEY(nr));
+		_mm_storeu_si128((__m128i *)blk, x);
+	}
+	_mm_storeu_si128((__m128i *)iv, x);
+}
+
+/*
+* Run four blocks through the same rounds at once; ENC is either
+* aesenc or aesdec.
+*/
+#define ROUNDS4(ENC, LAST) \
+	k = ROUNDKEY(0); \
+	x0 = _mm_xor_si128(x0, k); \
+	x1 = _mm_xor_si128(x1, k); \
+	x2 = _mm_xor_si128(x2, k); \
+	x3 = _mm_xor_si128(x3, k); \
+	for (r = 1; r < nr; r++) { \
+		k = ROUNDKEY(r); \
+		x0 = ENC(x0, k); \
+		x1 = ENC(x1, k); \
+		x2 = ENC(x2, k); \
+		x3 = ENC(x3, k); \
+	} \
+	k = ROUNDKEY(nr); \
+	x0 = LAST(x0, k); \
+	x1 = LAST(x1, k); \
+	x2 = LAST(x2, k); \
+	x3 = LAST(x3, k)
+
+#define ROUNDS1(ENC, LAST) \
+	x0 = _mm_xor_si128(x0, ROUNDKEY(0)); \
+	for (r = 1; r < nr; r++) \
+		x0 = ENC(x0, ROUNDKEY(r)); \
+	x0 = LAST(x0, ROUNDKEY(nr))
+
+#define LOAD(i) _mm_loadu_si128((const __m128i *)(blk + 16 * (i)))
+#define STORE(i, x) _mm_storeu_si128((__m128i *)(blk + 16 * (i)), x)
+
+/*
+* keys here is the decryption schedule from aes_ni_setup.
+*/
+AESNI_TARGET void aes_ni_decrypt_cbc(const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len)
+{
+	__m128i prev, c0, c1, c2, c3, x0, x1, x2, x3, k;
+	int r;
+
+	prev = _mm_loadu_si128((const __m128i *)iv);
+	for (; len >= 64; len -= 64, blk += 64) {
+		x0 = c0 = LOAD(0);
+		x1 = c1 = LOAD(1);
+		x2 = c2 = LOAD(2);
+		x3 = c3 = LOAD(3);
+		ROUNDS4(_mm_aesdec_si128, _mm_aesdeclast_si128);
+		STORE(0, _mm_xor_si128(x0, prev));
+		STORE(1, _mm_xor_si128(x1, c0));
+		STORE(2, _mm_xor_si128(x2, c1));
+		STORE(3, _mm_xor_si128(x3, c2));
+		prev = c3;
+	}
+	for (; len > 0; len -= 16, blk += 16) {
+		x0 = c0 = LOAD(0);
+		ROUNDS1(_mm_aesdec_si128, _mm_aesdeclast_si128);
+		STORE(0, _mm_xor_si128(x0, prev));
+		prev = c0;
+	}
+	_mm_storeu_si128((__m128i *)iv, prev);
+}
+
+/*
+* SDCTR: the counter is a 128-bit big-endian number, which we keep as
+* two native 64-bit halves.
+*/
+AESNI_TARGET void aes_ni_sdctr(const unsigned char *keys, int nr,
+	unsigned char *iv, unsigned char *blk, int len)
+{
+	/* Reverse the bytes of each 64-bit half */
+	const __m128i bswap = _mm_set_epi8(
+		8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	unsigned long long hi, lo;
+	__m128i x0, x1, x2, x3, k;
+	int r;
+
+	hi = ((unsigned long long)GET_32BIT_MSB_FIRST(iv) << 32) |
+		GET_32BIT_MSB_FIRST(iv + 4);
+	lo = ((unsigned long long)GET_32BIT_MSB_FIRST(iv + 8) << 32) |
+		GET_32BIT_MSB_FIRST(iv + 12);
+
+#define COUNTER(x) \
+	x = _mm_shuffle_epi8(_mm_set_epi64x((long long)lo, (long long)hi), \
+		bswap); \
+	if (++lo == 0) \
+		hi++
+
+	for (; len >= 64; len -= 64, blk += 64) {
+		COUNTER(x0);
+		COUNTER(x1);
+		COUNTER(x2);
+		COUNTER(x3);
+		ROUNDS4(_mm_aesenc_si128, _mm_aesenclast_si128);
+		STORE(0, _mm_xor_si128(x0, LOAD(0)));
+		STORE(1, _mm_xor_si128(x1, LOAD(1)));
+		STORE(2, _mm_xor_si128(x2, LOAD(2)));
+		STORE(3, _mm_xor_si128(x3, LOAD(3)));
+	}
+	for (; len > 0; len -= 16, blk += 16) {
+		COUNTER(x0);
+		ROUNDS1(_mm_aesenc_si128, _mm_aesenclast_si128);
+		STORE(0, _mm_xor_si128(x0, LOAD(0)));
+	}
+#undef COUNTER
+
+	PUT_32BIT_MSB_FIRST(iv, (uint32)(hi >> 32));
+	PUT_32BIT_MSB_FIRST(iv + 4, (uint32)hi);
+	PUT_32BIT_MSB_FIRST(iv + 8, (uint32)(lo >> 32));
+	PUT_32BIT_MSB_FIRST(iv + 12, (uint32)lo);
+}
+
+#endif
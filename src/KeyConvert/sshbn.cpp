@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #include "misc.h"
 
@@ -39,13 +40,176 @@ BignumInt bnOne[2] = { 1, 1 };
 
 Bignum Zero = bnZero, One = bnOne;
 
+/*
+* Bignum arenas.
+*
+* Between bn_arena_begin() and bn_arena_end(), the Bignums made by
+* newbn and copybn on the calling thread, and the scratch arrays the
+* arithmetic below works in, are carved one after another out of a
+* block of memory kept for the thread, instead of each being a heap
+* allocation of its own. freebn and bn_scratch_free leave them alone;
+* bn_arena_end wipes everything the scope allocated with a single
+* smemclr, and the block is reused by the next scope.
+*
+* Anything made in a scope that must outlive it has to be passed out
+* through bn_arena_end (the scope's one result) or copied to the heap
+* with bn_arena_keep. Scopes nest: an inner scope's result is moved
+* down to where the scope began, so it stays in the arena.
+*
+* If the block fills up, further allocations come from the heap as
+* before, and the block is made bigger when the outermost scope ends.
+*/
+#ifdef _MSC_VER
+#define BN_THREAD_LOCAL __declspec(thread)
+#else
+#define BN_THREAD_LOCAL __thread
+#endif
+
+#define BN_ARENA_MIN_WORDS 4096
+
+struct BignumArena {
+	BignumInt *block;
+	int size;		       /* words in block */
+	int top;		       /* words in use */
+	int spilled;		       /* words that didn't fit */
+	int want;		       /* size that would have been enough */
+	int depth;		       /* scopes open */
+};
+static BN_THREAD_LOCAL struct BignumArena bn_arena;
+
+static int bn_arena_owns(const BignumInt *p)
+{
+	return (bn_arena.block && p >= bn_arena.block &&
+		p < bn_arena.block + bn_arena.size);
+}
+
+/*
+* Allocate and free n-word scratch arrays, from the arena if a scope
+* is open. Heap ones are wiped when freed.
+*/
+static BignumInt *bn_scratch_new(int n)
+{
+	struct BignumArena *ar = &bn_arena;
+
+	if (ar->depth > 0) {
+		/* (Strictly less, so that even a zero-length array starts
+		* inside the block and bn_arena_owns recognises it.) */
+		if (n < ar->size - ar->top) {
+			BignumInt *p = ar->block + ar->top;
+			ar->top += n;
+			return p;
+		}
+		ar->spilled += n;
+		if (ar->top + ar->spilled > ar->want)
+			ar->want = ar->top + ar->spilled;
+	}
+	return snewn(n, BignumInt);
+}
+
+static void bn_scratch_free(BignumInt *p, int n)
+{
+	if (bn_arena_owns(p))
+		return;
+	smemclr(p, n * sizeof(BignumInt));
+	sfree(p);
+}
+
+/*
+* Open a scope, returning the mark to pass to bn_arena_end.
+*/
+int bn_arena_begin(void)
+{
+	struct BignumArena *ar = &bn_arena;
+
+	if (ar->depth++ == 0 && !ar->block) {
+		ar->size = (ar->want > BN_ARENA_MIN_WORDS ?
+			ar->want : BN_ARENA_MIN_WORDS);
+		ar->block = snewn(ar->size, BignumInt);
+	}
+	return ar->top;
+}
+
+/*
+* Close a scope, wiping everything allocated since it was opened
+* except keep (which may be NULL, or any Bignum at all). Returns where
+* keep now lives, which the caller must use instead.
+*/
+Bignum bn_arena_end(int mark, Bignum keep)
+{
+	struct BignumArena *ar = &bn_arena;
+	int top = ar->top, len;
+
+	assert(ar->depth > 0);
+	ar->depth--;
+
+	if (keep && bn_arena_owns(keep) && keep >= ar->block + mark) {
+		len = keep[0] + 1;
+		if (ar->depth > 0) {
+			memmove(ar->block + mark, keep, len * sizeof(BignumInt));
+			keep = ar->block + mark;
+			mark += len;
+		}
+		else {
+			Bignum b = snewn(len, BignumInt);
+			memcpy(b, keep, len * sizeof(BignumInt));
+			keep = b;
+		}
+	}
+
+	smemclr(ar->block + mark, (top - mark) * sizeof(BignumInt));
+	ar->top = mark;
+
+	if (ar->depth == 0) {
+		/* Grow the block next time if this scope overflowed it. */
+		if (ar->want > ar->size) {
+			sfree(ar->block);
+			ar->block = NULL;
+			ar->size = 0;
+		}
+		ar->spilled = 0;
+	}
+	return keep;
+}
+
+/*
+* Return b, copied to the heap if it's in the arena. This is for
+* values made in a scope that are kept after it, such as new fields
+* of a key.
+*/
+Bignum bn_arena_keep(Bignum b)
+{
+	Bignum ret;
+
+	if (!b || !bn_arena_owns(b))
+		return b;
+	ret = snewn(b[0] + 1, BignumInt);
+	memcpy(ret, b, (b[0] + 1) * sizeof(BignumInt));
+	return ret;
+}
+
+/*
+* Free the calling thread's arena block. Threads that use arenas
+* should call this before they exit.
+*/
+void bn_arena_cleanup(void)
+{
+	struct BignumArena *ar = &bn_arena;
+
+	assert(ar->depth == 0);
+	if (ar->block) {
+		smemclr(ar->block, ar->size * sizeof(BignumInt));
+		sfree(ar->block);
+	}
+	memset(ar, 0, sizeof(*ar));
+}
+
 static Bignum newbn(int length)
 {
 	Bignum b;
 
 	assert(length >= 0 && length < INT_MAX / BIGNUM_INT_BITS);
 
-	b = snewn(length + 1, BignumInt);
+	b = bn_scratch_new(length + 1);
 	if (!b)
 		abort();		       /* FIXME */
 	memset(b, 0, (length + 1) * sizeof(*b));
@@ -61,7 +225,7 @@ void bn_restore_invariant(Bignum b)
 
 Bignum copybn(Bignum orig)
 {
-	Bignum b = snewn(orig[0] + 1, BignumInt);
+	Bignum b = bn_scratch_new(orig[0] + 1);
 	if (!b)
 		abort();		       /* FIXME */
 	memcpy(b, orig, (orig[0] + 1) * sizeof(*b));
@@ -71,10 +235,10 @@ Bignum copybn(Bignum orig)
 void freebn(Bignum b)
 {
 	/*
-	* Burn the evidence, just in case.
+	* Burn the evidence, just in case. (Arena ones are burnt when the
+	* scope ends.)
 	*/
-	smemclr(b, sizeof(b[0]) * (b[0] + 1));
-	sfree(b);
+	bn_scratch_free(b, b[0] + 1);
 }
 
 Bignum bn_power_2(int n)
@@ -97,33 +261,121 @@ static BignumInt internal_add(const BignumInt *a, const BignumInt *b,
 	BignumInt *c, int len)
 {
 	int i;
-	BignumDblInt carry = 0;
+	BignumCarry carry = 0;
 
-	for (i = len - 1; i >= 0; i--) {
-		carry += (BignumDblInt)a[i] + b[i];
-		c[i] = (BignumInt)carry;
-		carry >>= BIGNUM_INT_BITS;
-	}
+	for (i = len - 1; i >= 0; i--)
+		BignumADC(c[i], carry, a[i], b[i], carry);
 
 	return (BignumInt)carry;
 }
 
 /*
 * Internal subtraction. Sets c = a - b, where 'a', 'b' and 'c' are
-* all big-endian arrays of 'len' BignumInts. Any borrow from the top
-* is ignored.
+* all big-endian arrays of 'len' BignumInts. Returns 1 if there was
+* no borrow from the top (i.e. a >= b), 0 if there was; callers that
+* don't care can ignore it.
 */
-static void internal_sub(const BignumInt *a, const BignumInt *b,
+static BignumInt internal_sub(const BignumInt *a, const BignumInt *b,
 	BignumInt *c, int len)
 {
 	int i;
-	BignumDblInt carry = 1;
+	BignumCarry carry = 1;
 
-	for (i = len - 1; i >= 0; i--) {
-		carry += (BignumDblInt)a[i] + (b[i] ^ BIGNUM_INT_MASK);
-		c[i] = (BignumInt)carry;
-		carry >>= BIGNUM_INT_BITS;
-	}
+	for (i = len - 1; i >= 0; i--)
+		BignumADC(c[i], carry, a[i], b[i] ^ BIGNUM_INT_MASK, carry);
+
+	return (BignumInt)carry;
+}
+
+/*
+* Lengths (in words) above which the multiplication and squaring
+* routines switch from the O(N^2) method to Karatsuba (except at the
+* lengths with unrolled Comba kernels, below, which are always done
+* directly). The default
+* can be replaced at run time, by bignum_set_karatsuba_threshold or by
+* measuring with bignum_calibrate_karatsuba, but never with anything
+* below KARATSUBA_MIN_THRESHOLD: scratch space is always sized for
+* that, so that changing the threshold can't invalidate buffers
+* allocated under the old one.
+*/
+#define KARATSUBA_THRESHOLD 50
+#define KARATSUBA_MIN_THRESHOLD 8
+#define KARATSUBA_MAX_THRESHOLD 256
+static int karatsuba_threshold = KARATSUBA_THRESHOLD;
+
+/*
+* Comba (product-scanning) multiplication. Rather than adding a * b_j
+* into the output for each word b_j in turn, this works out each word
+* of the output in turn, summing every product a_i b_j that lands in
+* it in a three-word accumulator c2:c1:c0 held in registers, so that
+* each output word is written exactly once.
+*
+* a and b are big-endian arrays of len words. The ncols least
+* significant words of the product are written to the ncols words
+* ending just before cend: ncols == 2*len gives the full product,
+* ncols == len just the low half.
+*/
+#define COMBA_LOOPS(UNROLL, len, ncols) do { \
+	const BignumInt *aend = a + (len), *bend = b + (len); \
+	BignumInt c0 = 0, c1 = 0, c2 = 0; \
+	int i, k, lo, hi; \
+	UNROLL \
+	for (k = 0; k < (ncols); k++) { \
+		lo = (k < (len) ? 0 : k - (len) + 1); \
+		hi = (k < (len) ? k : (len) - 1); \
+		UNROLL \
+		for (i = lo; i <= hi; i++) \
+			BignumMULACC(c2, c1, c0, aend[-1 - i], bend[-1 - (k - i)]); \
+		cend[-1 - k] = c0; \
+		c0 = c1; \
+		c1 = c2; \
+		c2 = 0; \
+	} \
+} while (0)
+
+static void comba_mul(const BignumInt *a, const BignumInt *b,
+	BignumInt *cend, int len, int ncols)
+{
+	COMBA_LOOPS(, len, ncols);
+}
+
+/*
+* Copies of the kernel for the operand lengths of 1024- and 2048-bit
+* numbers, which between them cover the CRT halves of 2048- and
+* 4096-bit RSA keys and the moduli of DSA keys. With the length fixed
+* the compiler can unroll both loops completely, which it's told to do
+* where we know how. These beat a Karatsuba split at their lengths
+* whatever the threshold is set to, so mul_direct always sends those
+* lengths here; 4096-bit operands split into 2048-bit halves.
+*/
+#if defined __clang__
+#define COMBA_UNROLL _Pragma("unroll")
+#elif defined __GNUC__ && __GNUC__ >= 8
+#define COMBA_UNROLL _Pragma("GCC unroll 128")
+#else
+#define COMBA_UNROLL
+#endif
+
+#define COMBA_WORDS(bits) ((bits) / BIGNUM_INT_BITS)
+#define COMBA_FIXED(name, len, ncols) \
+static void name(const BignumInt *a, const BignumInt *b, BignumInt *cend) \
+{ \
+	COMBA_LOOPS(COMBA_UNROLL, len, ncols); \
+}
+COMBA_FIXED(comba_mul_1024, COMBA_WORDS(1024), 2 * COMBA_WORDS(1024))
+COMBA_FIXED(comba_mul_low_1024, COMBA_WORDS(1024), COMBA_WORDS(1024))
+COMBA_FIXED(comba_mul_2048, COMBA_WORDS(2048), 2 * COMBA_WORDS(2048))
+COMBA_FIXED(comba_mul_low_2048, COMBA_WORDS(2048), COMBA_WORDS(2048))
+#undef COMBA_FIXED
+
+/*
+* Whether internal_mul, internal_sqr and internal_mul_low should work
+* on len words directly rather than by Karatsuba.
+*/
+static int mul_direct(int len)
+{
+	return (len <= karatsuba_threshold || len == COMBA_WORDS(1024) ||
+		len == COMBA_WORDS(2048));
 }
 
 /*
@@ -135,11 +387,10 @@ static void internal_sub(const BignumInt *a, const BignumInt *b,
 * mul_compute_scratch(len). (This covers the needs of internal_mul
 * and all its recursive calls to itself.)
 */
-#define KARATSUBA_THRESHOLD 50
 static int mul_compute_scratch(int len)
 {
 	int ret = 0;
-	while (len > KARATSUBA_THRESHOLD) {
+	while (len > KARATSUBA_MIN_THRESHOLD) {
 		int toplen = len / 2, botlen = len - toplen; /* botlen is the bigger */
 		int midlen = botlen + 1;
 		ret += 4 * midlen;
@@ -150,7 +401,7 @@ static int mul_compute_scratch(int len)
 static void internal_mul(const BignumInt *a, const BignumInt *b,
 	BignumInt *c, int len, BignumInt *scratch)
 {
-	if (len > KARATSUBA_THRESHOLD) {
+	if (!mul_direct(len)) {
 		int i;
 
 		/*
@@ -187,7 +438,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 
 		int toplen = len / 2, botlen = len - toplen; /* botlen is the bigger */
 		int midlen = botlen + 1;
-		BignumDblInt carry;
+		BignumCarry carry;
 #ifdef KARA_DEBUG
 		int i;
 #endif
@@ -202,13 +453,13 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 		printf("a1,a0 = 0x");
 		for (i = 0; i < len; i++) {
 			if (i == toplen) printf(", 0x");
-			printf("%0*x", BIGNUM_INT_BITS / 4, a[i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)a[i]);
 		}
 		printf("\n");
 		printf("b1,b0 = 0x");
 		for (i = 0; i < len; i++) {
 			if (i == toplen) printf(", 0x");
-			printf("%0*x", BIGNUM_INT_BITS / 4, b[i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)b[i]);
 		}
 		printf("\n");
 #endif
@@ -218,7 +469,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("a1b1 = 0x");
 		for (i = 0; i < 2 * toplen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, c[i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)c[i]);
 		}
 		printf("\n");
 #endif
@@ -228,7 +479,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("a0b0 = 0x");
 		for (i = 0; i < 2 * botlen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, c[2 * toplen + i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)c[2 * toplen + i]);
 		}
 		printf("\n");
 #endif
@@ -248,7 +499,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("a1plusa0 = 0x");
 		for (i = 0; i < midlen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, scratch[i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)scratch[i]);
 		}
 		printf("\n");
 #endif
@@ -258,7 +509,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("b1plusb0 = 0x");
 		for (i = 0; i < midlen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, scratch[midlen + i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)scratch[midlen + i]);
 		}
 		printf("\n");
 #endif
@@ -271,7 +522,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("a1plusa0timesb1plusb0 = 0x");
 		for (i = 0; i < 2 * midlen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, scratch[2 * midlen + i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)scratch[2 * midlen + i]);
 		}
 		printf("\n");
 #endif
@@ -289,7 +540,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("a1b1plusa0b0 = 0x");
 		for (i = 0; i < 2 * midlen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, scratch[i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)scratch[i]);
 		}
 		printf("\n");
 #endif
@@ -299,7 +550,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 #ifdef KARA_DEBUG
 		printf("a1b0plusa0b1 = 0x");
 		for (i = 0; i < 2 * midlen; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, scratch[2 * midlen + i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)scratch[2 * midlen + i]);
 		}
 		printf("\n");
 #endif
@@ -316,43 +567,140 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 		i = 2 * len - botlen - 2 * midlen - 1;
 		while (carry) {
 			assert(i >= 0);
-			carry += c[i];
-			c[i] = (BignumInt)carry;
-			carry >>= BIGNUM_INT_BITS;
+			BignumADC(c[i], carry, c[i], 0, carry);
 			i--;
 		}
 #ifdef KARA_DEBUG
 		printf("ab = 0x");
 		for (i = 0; i < 2 * len; i++) {
-			printf("%0*x", BIGNUM_INT_BITS / 4, c[i]);
+			printf("%0*llx", BIGNUM_INT_BITS / 4, (unsigned long long)c[i]);
 		}
 		printf("\n");
 #endif
 
 	}
 	else {
+		/*
+		* Multiply in the ordinary O(N^2) way.
+		*/
+		if (len == COMBA_WORDS(1024))
+			comba_mul_1024(a, b, c + 2 * len);
+		else if (len == COMBA_WORDS(2048))
+			comba_mul_2048(a, b, c + 2 * len);
+		else
+			comba_mul(a, b, c + 2 * len, len, 2 * len);
+	}
+}
+
+/*
+* Compute c = a * a, as internal_mul(a, a, c, len, scratch) would, but
+* faster. Input is in the first len words of a; the result is returned
+* in the first 2*len words of c. 'scratch' is as for internal_mul.
+*/
+static void internal_sqr(const BignumInt *a, BignumInt *c, int len,
+	BignumInt *scratch)
+{
+	if (!mul_direct(len)) {
 		int i;
-		BignumInt carry;
-		BignumDblInt t;
-		const BignumInt *ap, *bp;
-		BignumInt *cp, *cps;
 
 		/*
-		* Multiply in the ordinary O(N^2) way.
+		* Karatsuba again, in the same form as internal_mul. With
+		*
+		*   a = a_1 D + a_0
+		*
+		* the square is a_1^2 D^2 + 2 a_1 a_0 D + a_0^2, and we get
+		* the middle coefficient by squaring (a_1 + a_0) and
+		* subtracting the other two. So a square of length N costs
+		* three squares of length N/2.
+		*
+		* We use the same layout of 'scratch' as internal_mul (simply
+		* leaving the part that would hold b_1 + b_0 unused), so that
+		* mul_compute_scratch covers us too.
+		*/
+
+		int toplen = len / 2, botlen = len - toplen; /* botlen is the bigger */
+		int midlen = botlen + 1;
+		BignumCarry carry;
+
+		/* a_1^2 and a_0^2, in place */
+		internal_sqr(a, c, toplen, scratch);
+		internal_sqr(a + toplen, c + 2 * toplen, botlen, scratch);
+
+		/* a_1 + a_0 */
+		scratch[0] = scratch[1] = 0;
+		for (i = 0; i < toplen; i++)
+			scratch[midlen - toplen + i] = a[i];
+		scratch[0] = internal_add(scratch + 1, a + toplen, scratch + 1, botlen);
+
+		/* (a_1 + a_0)^2 */
+		internal_sqr(scratch, scratch + 2 * midlen, midlen, scratch + 4 * midlen);
+
+		/* Subtract a_1^2 + a_0^2 to get 2 a_1 a_0 */
+		scratch[0] = scratch[1] = scratch[2] = scratch[3] = 0;
+		for (i = 0; i < 2 * toplen; i++)
+			scratch[2 * midlen - 2 * toplen + i] = c[i];
+		scratch[1] = internal_add(scratch + 2, c + 2 * toplen,
+			scratch + 2, 2 * botlen);
+		internal_sub(scratch + 2 * midlen, scratch,
+			scratch + 2 * midlen, 2 * midlen);
+
+		/* And add it back into the output. */
+		carry = internal_add(c + 2 * len - botlen - 2 * midlen,
+			scratch + 2 * midlen,
+			c + 2 * len - botlen - 2 * midlen, 2 * midlen);
+		i = 2 * len - botlen - 2 * midlen - 1;
+		while (carry) {
+			assert(i >= 0);
+			BignumADC(c[i], carry, c[i], 0, carry);
+			i--;
+		}
+	}
+	else {
+		int i, j;
+		BignumInt carry, hi, lo;
+		BignumCarry cc;
+
+		/*
+		* Square in the O(N^2) way, but only computing each cross
+		* term a_i a_j (i != j) once: sum them, double the total with
+		* a one-bit shift, and then add on the squares a_i^2 down the
+		* diagonal. That's about half the multiplications of the
+		* general case.
+		*
+		* Indices here count words from the least significant end,
+		* which for these big-endian arrays means a[len - 1 - i] and
+		* c[2 * len - 1 - i].
 		*/
+#define SQR_A(i) a[len - 1 - (i)]
+#define SQR_C(i) c[2 * len - 1 - (i)]
 
 		for (i = 0; i < 2 * len; i++)
 			c[i] = 0;
 
-		for (cps = c + 2 * len, ap = a + len; ap-- > a; cps--) {
+		for (i = 0; i < len - 1; i++) {
 			carry = 0;
-			for (cp = cps, bp = b + len; cp--, bp-- > b;) {
-				t = (MUL_WORD(*ap, *bp) + carry) + *cp;
-				*cp = (BignumInt)t;
-				carry = (BignumInt)(t >> BIGNUM_INT_BITS);
-			}
-			*cp = carry;
+			for (j = i + 1; j < len; j++)
+				BignumMULADD2(carry, SQR_C(i + j), SQR_A(i), SQR_A(j),
+					SQR_C(i + j), carry);
+			SQR_C(i + len) = carry;
+		}
+
+		carry = 0;
+		for (i = 0; i < 2 * len; i++) {
+			BignumInt top = SQR_C(i) >> (BIGNUM_INT_BITS - 1);
+			SQR_C(i) = (SQR_C(i) << 1) | carry;
+			carry = top;
 		}
+
+		cc = 0;
+		for (i = 0; i < len; i++) {
+			BignumMUL(hi, lo, SQR_A(i), SQR_A(i));
+			BignumADC(SQR_C(2 * i), cc, SQR_C(2 * i), lo, cc);
+			BignumADC(SQR_C(2 * i + 1), cc, SQR_C(2 * i + 1), hi, cc);
+		}
+
+#undef SQR_A
+#undef SQR_C
 	}
 }
 
@@ -364,7 +712,7 @@ static void internal_mul(const BignumInt *a, const BignumInt *b,
 static void internal_mul_low(const BignumInt *a, const BignumInt *b,
 	BignumInt *c, int len, BignumInt *scratch)
 {
-	if (len > KARATSUBA_THRESHOLD) {
+	if (!mul_direct(len)) {
 		int i;
 
 		/*
@@ -434,28 +782,145 @@ static void internal_mul_low(const BignumInt *a, const BignumInt *b,
 
 	}
 	else {
-		int i;
-		BignumInt carry;
-		BignumDblInt t;
-		const BignumInt *ap, *bp;
-		BignumInt *cp, *cps;
-
 		/*
 		* Multiply in the ordinary O(N^2) way.
 		*/
+		if (len == COMBA_WORDS(1024))
+			comba_mul_low_1024(a, b, c + len);
+		else if (len == COMBA_WORDS(2048))
+			comba_mul_low_2048(a, b, c + len);
+		else
+			comba_mul(a, b, c + len, len, len);
+	}
+}
 
-		for (i = 0; i < len; i++)
-			c[i] = 0;
+/*
+* Set the Karatsuba threshold (see KARATSUBA_THRESHOLD), clamped to
+* the range we support. This is a process-wide setting, meant to be
+* made once at startup before any other thread is using the bignum
+* code.
+*/
+void bignum_set_karatsuba_threshold(int len)
+{
+	if (len < KARATSUBA_MIN_THRESHOLD)
+		len = KARATSUBA_MIN_THRESHOLD;
+	if (len > KARATSUBA_MAX_THRESHOLD)
+		len = KARATSUBA_MAX_THRESHOLD;
+	karatsuba_threshold = len;
+}
 
-		for (cps = c + len, ap = a + len; ap-- > a; cps--) {
-			carry = 0;
-			for (cp = cps, bp = b + len; bp--, cp-- > c;) {
-				t = (MUL_WORD(*ap, *bp) + carry) + *cp;
-				*cp = (BignumInt)t;
-				carry = (BignumInt)(t >> BIGNUM_INT_BITS);
-			}
-		}
+/*
+* Time 'reps' multiplications and squarings of length len with the
+* given threshold, in clock() ticks.
+*/
+static clock_t time_mul(int threshold, const BignumInt *a, const BignumInt *b,
+	BignumInt *c, int len, BignumInt *scratch, int reps)
+{
+	clock_t start;
+	int i;
+
+	karatsuba_threshold = threshold;
+	start = clock();
+	for (i = 0; i < reps; i++) {
+		internal_mul(a, b, c, len, scratch);
+		internal_sqr(a, c, len, scratch);
+	}
+	return clock() - start;
+}
+
+/*
+* The lengths, in bits, of the numbers multiplied in key operations:
+* the CRT halves and moduli of 1024- to 4096-bit RSA keys, and DSA
+* moduli.
+*/
+static const int calibrate_bits[] = { 512, 768, 1024, 1536, 2048, 3072, 4096 };
+
+/*
+* Measure which Karatsuba threshold is fastest on this machine and
+* with this BignumInt size, set it, and return it.
+*
+* There isn't a single crossover length to look for: the Comba
+* kernels make some lengths much cheaper than their neighbours, and
+* where Karatsuba stops recursing depends on the length it starts
+* from. So we time the multiplications and squarings of each length
+* in calibrate_bits, through internal_mul and internal_sqr as they
+* are used, under each threshold that puts one of those lengths on a
+* different side, and keep the threshold with the least total time
+* (or the default, unless something beats it by a clear margin).
+* Each length counts equally: its repetition count is chosen to make
+* it take about the same time as the others. This takes a second or
+* two; it's meant to be run once (e.g. by 'keyconvert --calibrate')
+* and the answer passed to bignum_set_karatsuba_threshold thereafter.
+*/
+int bignum_calibrate_karatsuba(void)
+{
+	enum { NLENS = lenof(calibrate_bits), NCANDS = NLENS + 3 };
+	int maxlen = calibrate_bits[NLENS - 1] / BIGNUM_INT_BITS;
+	int wslen = 4 * maxlen + mul_compute_scratch(maxlen);
+	BignumInt *ws = snewn(wslen, BignumInt);
+	BignumInt *a = ws, *b = ws + maxlen, *c = ws + 2 * maxlen;
+	BignumInt *scratch = ws + 4 * maxlen;
+	int lens[NLENS], reps[NLENS], cands[NCANDS], ncands = 0;
+	clock_t best[NCANDS], besttime;
+	int i, l, run, result;
+
+	/* Any old non-trivial data will do. */
+	for (i = 0; i < 2 * maxlen; i++)
+		a[i] = (BignumInt)((i + 1) * 0x9E3779B9UL) ^ ((BignumInt)i << 7);
+
+	/*
+	* The candidates: the default, then none of the lengths done
+	* directly (bar the Comba ones), just the shortest, the two
+	* shortest, and so on up to all of them.
+	*/
+	cands[ncands++] = KARATSUBA_THRESHOLD;
+	cands[ncands++] = KARATSUBA_MIN_THRESHOLD;
+	for (l = 0; l < NLENS; l++) {
+		lens[l] = calibrate_bits[l] / BIGNUM_INT_BITS;
+		if (lens[l] > KARATSUBA_MIN_THRESHOLD &&
+			lens[l] < KARATSUBA_MAX_THRESHOLD)
+			cands[ncands++] = lens[l];
 	}
+	cands[ncands++] = KARATSUBA_MAX_THRESHOLD;
+
+	/*
+	* Find a repetition count for each length that makes it take a
+	* measurable time, then take the best of three runs under each
+	* candidate, interleaved so they all see the same conditions.
+	*/
+	for (l = 0; l < NLENS; l++)
+		for (reps[l] = 1;; reps[l] *= 2)
+			if (time_mul(KARATSUBA_THRESHOLD, a, b, c, lens[l], scratch,
+				reps[l]) >= CLOCKS_PER_SEC / 200 || reps[l] >= (1 << 24))
+				break;
+	for (run = 0; run < 3; run++)
+		for (i = 0; i < ncands; i++) {
+			clock_t total = 0;
+			for (l = 0; l < NLENS; l++)
+				total += time_mul(cands[i], a, b, c, lens[l], scratch,
+					reps[l]);
+			if (run == 0 || total < best[i])
+				best[i] = total;
+		}
+
+	/*
+	* Thresholds that do about as well as each other would otherwise
+	* be chosen between by noise, so a candidate has to be 2% faster
+	* than the best so far (starting with the default) to win.
+	*/
+	result = cands[0];
+	besttime = best[0];
+	for (i = 1; i < ncands; i++)
+		if (best[i] < besttime - besttime / 50) {
+			besttime = best[i];
+			result = cands[i];
+		}
+
+	smemclr(ws, wslen * sizeof(BignumInt));
+	sfree(ws);
+
+	bignum_set_karatsuba_threshold(result);
+	return karatsuba_threshold;
 }
 
 /*
@@ -476,7 +941,7 @@ static void monty_reduce(BignumInt *x, const BignumInt *n,
 	const BignumInt *mninv, BignumInt *tmp, int len)
 {
 	int i;
-	BignumInt carry;
+	BignumInt carry, mask;
 
 	/*
 	* Multiply x by (-n)^{-1} mod r. This gives us a value m such
@@ -509,30 +974,73 @@ static void monty_reduce(BignumInt *x, const BignumInt *n,
 	*  + so 0 <= mn < rn, obviously
 	*  + hence we only need 0 <= x < rn to guarantee that 0 <= mn+x < 2rn
 	*  + yielding 0 <= (mn+x)/r < 2n as required.
+	*
+	* We always do the subtraction, and then select the right answer
+	* with a mask, so that the time taken doesn't depend on whether
+	* t >= n. t >= n exactly when the addition above carried out of
+	* the top or the subtraction doesn't borrow.
 	*/
-	if (!carry) {
-		for (i = 0; i < len; i++)
-			if (x[len + i] != n[i])
-				break;
+	mask = internal_sub(x + len, n, tmp, len);
+	mask = (BignumInt)(0 - (mask | carry));
+	for (i = 0; i < len; i++)
+		x[len + i] ^= (x[len + i] ^ tmp[i]) & mask;
+}
+
+#ifndef DIVMOD_WORD
+/*
+* Portable DIVMOD_WORD, for platforms where sshbn.h has no
+* double-width division to offer: plain shift-and-subtract long
+* division of hi:lo by w, one quotient bit at a time. As with the
+* native versions, the caller must ensure hi < w so that the quotient
+* fits in a BignumInt.
+*/
+static void divmod_word(BignumInt *q, BignumInt *r,
+	BignumInt hi, BignumInt lo, BignumInt w)
+{
+	BignumInt quot = 0, top;
+	int i;
+
+	for (i = 0; i < BIGNUM_INT_BITS; i++) {
+		top = hi >> (BIGNUM_INT_BITS - 1);
+		hi = (hi << 1) | (lo >> (BIGNUM_INT_BITS - 1));
+		lo <<= 1;
+		quot <<= 1;
+		if (top || hi >= w) {
+			hi -= w;
+			quot |= 1;
+		}
 	}
-	if (carry || i >= len || x[len + i] > n[i])
-		internal_sub(x + len, n, x + len, len);
+	*q = quot;
+	*r = hi;
 }
+#define DIVMOD_WORD(q, r, hi, lo, w) divmod_word(&(q), &(r), hi, lo, w)
+#endif
 
 static void internal_add_shifted(BignumInt *number,
 	BignumInt n, int shift)
 {
 	unsigned int word = 1 + (shift / BIGNUM_INT_BITS);
 	int bshift = shift % BIGNUM_INT_BITS;
-	BignumDblInt addend;
-
-	addend = (BignumDblInt)n << bshift;
-
-	while (addend) {
+	BignumInt addendh, addendl;
+	BignumCarry carry;
+
+	if (!n)
+		return;
+
+	addendl = n << bshift;
+	addendh = (bshift == 0 ? 0 : n >> (BIGNUM_INT_BITS - bshift));
+
+	assert(word <= number[0]);
+	BignumADC(number[word], carry, number[word], addendl, 0);
+	word++;
+	if (!addendh && !carry)
+		return;
+	assert(word <= number[0]);
+	BignumADC(number[word], carry, number[word], addendh, carry);
+	word++;
+	while (carry) {
 		assert(word <= number[0]);
-		addend += number[word];
-		number[word] = (BignumInt)addend & BIGNUM_INT_MASK;
-		addend >>= BIGNUM_INT_BITS;
+		BignumADC(number[word], carry, number[word], 0, carry);
 		word++;
 	}
 }
@@ -562,7 +1070,7 @@ static void internal_mod(BignumInt *a, int alen,
 		m1 = 0;
 
 	for (i = 0; i <= alen - mlen; i++) {
-		BignumDblInt t;
+		BignumInt th, tl;
 		BignumInt q, r, c, ai1;
 
 		if (i == 0) {
@@ -605,36 +1113,31 @@ static void internal_mod(BignumInt *a, int alen,
 
 			/* Refine our estimate of q by looking at
 			h:a[i]:a[i+1] / m0:m1 */
-			t = MUL_WORD(m1, q);
-			if (t > ((BignumDblInt)r << BIGNUM_INT_BITS) + ai1) {
+			BignumMUL(th, tl, m1, q);
+			if (th > r || (th == r && tl > ai1)) {
 				q--;
-				t -= m1;
+				tl -= m1;
+				th -= (tl > (BignumInt)~m1);   /* borrow */
 				r = (r + m0) & BIGNUM_INT_MASK;     /* overflow? */
-				if (r >= (BignumDblInt)m0 &&
-					t > ((BignumDblInt)r << BIGNUM_INT_BITS) + ai1) q--;
+				if (r >= m0 && (th > r || (th == r && tl > ai1)))
+					q--;
 			}
 		}
 
 		/* Subtract q * m from a[i...] */
 		c = 0;
 		for (k = mlen - 1; k >= 0; k--) {
-			t = MUL_WORD(q, m[k]);
-			t += c;
-			c = (BignumInt)(t >> BIGNUM_INT_BITS);
-			if ((BignumInt)t > a[i + k])
+			BignumMULADD(c, tl, q, m[k], c);
+			if (tl > a[i + k])
 				c++;
-			a[i + k] -= (BignumInt)t;
+			a[i + k] -= tl;
 		}
 
 		/* Add back m in case of borrow */
 		if (c != h) {
-			t = 0;
-			for (k = mlen - 1; k >= 0; k--) {
-				t += m[k];
-				t += a[i + k];
-				a[i + k] = (BignumInt)t;
-				t = t >> BIGNUM_INT_BITS;
-			}
+			BignumCarry carry = 0;
+			for (k = mlen - 1; k >= 0; k--)
+				BignumADC(a[i + k], carry, m[k], a[i + k], carry);
 			q--;
 		}
 		if (quot)
@@ -667,7 +1170,7 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 	/* Allocate m of size mlen, copy mod to m */
 	/* We use big endian internally */
 	mlen = mod[0];
-	m = snewn(mlen, BignumInt);
+	m = bn_scratch_new(mlen);
 	for (j = 0; j < mlen; j++)
 		m[j] = mod[mod[0] - j];
 
@@ -682,7 +1185,7 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 	}
 
 	/* Allocate n of size mlen, copy base to n */
-	n = snewn(mlen, BignumInt);
+	n = bn_scratch_new(mlen);
 	i = mlen - base[0];
 	for (j = 0; j < i; j++)
 		n[j] = 0;
@@ -690,15 +1193,15 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 		n[i + j] = base[base[0] - j];
 
 	/* Allocate a and b of size 2*mlen. Set a = 1 */
-	a = snewn(2 * mlen, BignumInt);
-	b = snewn(2 * mlen, BignumInt);
+	a = bn_scratch_new(2 * mlen);
+	b = bn_scratch_new(2 * mlen);
 	for (i = 0; i < 2 * mlen; i++)
 		a[i] = 0;
 	a[2 * mlen - 1] = 1;
 
 	/* Scratch space for multiplies */
 	scratchlen = mul_compute_scratch(mlen);
-	scratch = snewn(scratchlen, BignumInt);
+	scratch = bn_scratch_new(scratchlen);
 
 	/* Skip leading zero bits of exp. */
 	i = 0;
@@ -714,7 +1217,7 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 	/* Main computation */
 	while (i < (int)exp[0]) {
 		while (j >= 0) {
-			internal_mul(a + mlen, a + mlen, b, mlen, scratch);
+			internal_sqr(a + mlen, b, mlen, scratch);
 			internal_mod(b, mlen * 2, m, mlen, NULL, 0);
 			if ((exp[exp[0] - i] & ((BignumInt)1 << j)) != 0) {
 				internal_mul(b + mlen, n, a, mlen, scratch);
@@ -750,16 +1253,11 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 		result[0]--;
 
 	/* Free temporary arrays */
-	smemclr(a, 2 * mlen * sizeof(*a));
-	sfree(a);
-	smemclr(scratch, scratchlen * sizeof(*scratch));
-	sfree(scratch);
-	smemclr(b, 2 * mlen * sizeof(*b));
-	sfree(b);
-	smemclr(m, mlen * sizeof(*m));
-	sfree(m);
-	smemclr(n, mlen * sizeof(*n));
-	sfree(n);
+	bn_scratch_free(a, 2 * mlen);
+	bn_scratch_free(scratch, scratchlen);
+	bn_scratch_free(b, 2 * mlen);
+	bn_scratch_free(m, mlen);
+	bn_scratch_free(n, mlen);
 
 	freebn(base);
 
@@ -767,14 +1265,150 @@ Bignum modpow_simple(Bignum base_in, Bignum exp, Bignum mod)
 }
 
 /*
-* Compute (base ^ exp) % mod. Uses the Montgomery multiplication
-* technique where possible, falling back to modpow_simple otherwise.
+* Largest window, in bits, used by the windowed exponentiations. The
+* working storage holds a table of up to 2^MONTY_MAX_WINDOW powers of
+* the base.
+*/
+#define MONTY_MAX_WINDOW 5
+
+/*
+* A Montgomery context holds everything modpow needs to know about an
+* odd modulus n, so that repeated operations with the same modulus
+* (such as every signature made with one key) don't have to work it
+* out again: n itself and -n^{-1} mod r in the big-endian form used
+* by monty_reduce, r mod n (the Montgomery form of 1) and r^2 mod n
+* (used to convert numbers into Montgomery form by a Montgomery
+* multiplication instead of a division). Here r = 2^(len *
+* BIGNUM_INT_BITS), where len is the word length of n. For single
+* modular multiplications, where converting in and out of Montgomery
+* form would cost more than it saves, it also keeps n shifted left
+* so that its top bit is set, ready for internal_mod.
+*
+* The exponentiations work on 'elements': numbers in Montgomery form,
+* elen words long. Normally these are the same len-word big-endian
+* arrays as everything else here, with r = 2^(BIGNUM_INT_BITS*len).
+* But when the AVX-512 IFMA code in sshbnifma.cpp is in use they are
+* arrays of 52-bit limbs, with r = 2^(52*elen) instead, and monty_mul,
+* monty_sqr, monty_enter and monty_leave hand them to that code.
+*
+* Nothing in a context changes once it has been made, so one context
+* may be used by any number of threads at once. The working storage
+* for each operation is a MontyWork, taken from the calling thread's
+* arena for the length of the operation.
+*/
+struct MontyContext {
+	Bignum modulus;		       /* our own copy of n */
+	int len, elen;
+	BignumInt *n, *mninv, *rn, *rsq;   /* len words each */
+	BignumInt *m;		       /* n << mshift, len words */
+	int mshift;
+	BignumInt *one;		       /* 1 in Montgomery form, elen words */
+#ifdef BIGNUM_IFMA
+	int ifma;		       /* use ifma_monty_mul */
+	BignumInt k0;		       /* -n^{-1} mod 2^52 */
+	BignumInt *in, *irn, *irsq;	       /* n, r and r^2 mod n as limbs */
+#endif
+	int scratchlen;		       /* sizes of a MontyWork's arrays */
+	int worklen;
+	BignumInt *storage;		       /* all of the above arrays */
+	int storagelen;
+};
+
+/*
+* The working storage for one operation with a context, in a single
+* block of mc->worklen words.
+*/
+typedef struct MontyWork {
+	BignumInt *a;		       /* 2*len words */
+	BignumInt *x, *y;		       /* max(len, elen) words each */
+	BignumInt *scratch;		       /* mc->scratchlen words */
+	BignumInt *table;		       /* max(len, elen) << MONTY_MAX_WINDOW */
+	BignumInt *storage;		       /* all of the above arrays */
+} MontyWork;
+
+#ifdef BIGNUM_IFMA
+/*
+* Whether to use the AVX-512 IFMA code for contexts made from now on,
+* if the CPU has it and the modulus is a size it handles.
+*/
+static int ifma_enabled = 1;
+#endif
+
+void bignum_set_ifma(int enable)
+{
+#ifdef BIGNUM_IFMA
+	ifma_enabled = enable;
+#endif
+}
+
+/*
+* Copy a little-endian Bignum into a big-endian array of len words,
+* zero-padding at the top. The Bignum must fit.
 */
-Bignum modpow(Bignum base_in, Bignum exp, Bignum mod)
+static void monty_import(BignumInt *dst, Bignum src, int len)
 {
-	BignumInt *a, *b, *x, *n, *mninv, *scratch;
-	int len, scratchlen, i, j;
-	Bignum base, base2, r, rn, inv, result;
+	int j;
+
+	assert((int)src[0] <= len);
+	for (j = 0; j < len; j++)
+		dst[len - 1 - j] = (j < (int)src[0] ? src[j + 1] : 0);
+}
+
+/*
+* Set mninv = -n^{-1} mod r, where r = 2^(BIGNUM_INT_BITS * len), for
+* monty_reduce. n and mninv are big-endian arrays of len words, and t
+* is len words of workspace.
+*
+* This works up from the bottom word. t holds 1 + n * (the words of
+* mninv found so far), and each new word of mninv is chosen to clear
+* the next word of t, which only takes -n^{-1} mod one word (found by
+* Newton's iteration). That is about as much work as one
+* multiplication, far less than a general modinv against r.
+*/
+static void monty_neg_inverse(BignumInt *mninv, const BignumInt *n,
+	BignumInt *t, int len)
+{
+	unsigned long long n0 = n[len - 1], x;
+	BignumInt y, carry;
+	int i, j;
+
+	/* n0 is its own inverse mod 8, and each step doubles the
+	* correct bits. */
+	x = n0;
+	for (i = 0; i < 5; i++)
+		x *= 2 - n0 * x;
+	x = 0 - x;
+
+	memset(t, 0, len * sizeof(BignumInt));
+	t[len - 1] = 1;
+	for (i = 0; i < len; i++) {
+		y = (BignumInt)(t[len - 1 - i] * x);
+		mninv[len - 1 - i] = y;
+		carry = 0;
+		for (j = len - 1 - i; j >= 0; j--)
+			BignumMULADD2(carry, t[j], n[j + i], y, t[j], carry);
+	}
+	smemclr(t, len * sizeof(BignumInt));
+}
+
+/*
+* Build a Montgomery context for the modulus mod. Returns NULL if
+* mod is even (or zero), in which case the caller must fall back to
+* the plain division-based functions.
+*
+* Contexts are usually kept (on a key, say), so their storage comes
+* from the heap even inside an arena scope, unless 'scoped' is set
+* to say that this one will be freed before the scope ends.
+*/
+static MontyContext *monty_create(Bignum mod, int scoped)
+{
+	MontyContext *mc;
+	Bignum r, rn, rsq;
+	BignumInt *t;
+	int len, xlen, fixedlen;
+
+	if (!(mod[1] & 1))
+		return NULL;
 
 	/*
 	* The most significant word of mod needs to be non-zero. It
@@ -782,135 +1416,773 @@ Bignum modpow(Bignum base_in, Bignum exp, Bignum mod)
 	*/
 	assert(mod[mod[0]] != 0);
 
+	mc = snew(MontyContext);
+	mc->modulus = (scoped ? copybn(mod) : bn_arena_keep(copybn(mod)));
+	mc->len = len = mod[0];
+
+	mc->elen = len;
+	fixedlen = 5 * len;
+#ifdef BIGNUM_IFMA
+	mc->ifma = (ifma_enabled && len >= 1024 / BIGNUM_INT_BITS &&
+		len <= 4096 / BIGNUM_INT_BITS && ifma_available());
+	if (mc->ifma) {
+		mc->elen = ifma_limbs(bignum_bitcount(mod));
+		assert(mc->elen <= IFMA_MAX_LIMBS && mc->elen <= 2 * len);
+		fixedlen += 3 * mc->elen;
+	}
+#endif
+	xlen = (mc->elen > len ? mc->elen : len);
+
+	mc->scratchlen = 3 * len + mul_compute_scratch(len);
+	mc->worklen = 2 * len + 2 * xlen + mc->scratchlen +
+		(xlen << MONTY_MAX_WINDOW);
+	mc->storagelen = fixedlen;
+	mc->storage = (scoped ? bn_scratch_new(mc->storagelen) :
+		snewn(mc->storagelen, BignumInt));
+	mc->n = mc->storage;
+	mc->mninv = mc->n + len;
+	mc->rn = mc->mninv + len;
+	mc->rsq = mc->rn + len;
+	mc->m = mc->rsq + len;
+	mc->one = mc->rn;
+
+	t = bn_scratch_new(len);
+	monty_import(mc->n, mod, len);
+	monty_neg_inverse(mc->mninv, mc->n, t, len);
+
+	/* Shift a copy of n left to make its msb set, for internal_mod */
+	memcpy(mc->m, mc->n, len * sizeof(BignumInt));
+	for (mc->mshift = 0; mc->mshift < BIGNUM_INT_BITS - 1; mc->mshift++)
+		if ((mc->m[0] << mc->mshift) & BIGNUM_TOP_BIT)
+			break;
+	if (mc->mshift) {
+		int i;
+		for (i = 0; i < len - 1; i++)
+			mc->m[i] = (mc->m[i] << mc->mshift) |
+			(mc->m[i + 1] >> (BIGNUM_INT_BITS - mc->mshift));
+		mc->m[len - 1] = mc->m[len - 1] << mc->mshift;
+	}
+
+	r = bn_power_2(BIGNUM_INT_BITS * len);
+	rn = bigmod(r, mod);	       /* r mod n, i.e. Montgomerified 1 */
+	monty_import(mc->rn, rn, len);
+	freebn(rn);
+	freebn(r);
+
+	r = bn_power_2(2 * BIGNUM_INT_BITS * len);
+	rsq = bigmod(r, mod);
+	monty_import(mc->rsq, rsq, len);
+	freebn(rsq);
+	freebn(r);
+
+#ifdef BIGNUM_IFMA
+	if (mc->ifma) {
+		/*
+		* The same constants again for the IFMA code's r, which is
+		* 2^(52*elen), in its limb format. -n^{-1} mod 2^52 is just
+		* the bottom 52 bits of the value mod the larger power of 2
+		* we already have.
+		*/
+		int elen = mc->elen;
+
+		mc->in = mc->m + len;
+		mc->irn = mc->in + elen;
+		mc->irsq = mc->irn + elen;
+		mc->k0 = mc->mninv[len - 1] & ((((BignumInt)1) << 52) - 1);
+		ifma_from_words(mc->in, mc->n, len, elen);
+
+		r = bn_power_2(52 * elen);
+		rn = bigmod(r, mod);
+		monty_import(t, rn, len);
+		ifma_from_words(mc->irn, t, len, elen);
+		freebn(rn);
+		freebn(r);
+
+		r = bn_power_2(2 * 52 * elen);
+		rsq = bigmod(r, mod);
+		monty_import(t, rsq, len);
+		ifma_from_words(mc->irsq, t, len, elen);
+		freebn(rsq);
+		freebn(r);
+
+		mc->one = mc->irn;
+	}
+#endif
+
+	bn_scratch_free(t, len);
+	return mc;
+}
+
+MontyContext *monty_new(Bignum mod)
+{
+	return monty_create(mod, 0);
+}
+
+void monty_free(MontyContext *mc)
+{
+	if (!mc)
+		return;
+	freebn(mc->modulus);
+	bn_scratch_free(mc->storage, mc->storagelen);
+	smemclr(mc, sizeof(*mc));
+	sfree(mc);
+}
+
+/*
+* Set up the working storage for an operation with mc. This must be
+* called inside an arena scope, which the storage belongs to; it is
+* wiped when the scope ends (or by monty_work_free, if the arena was
+* full and it came from the heap).
+*/
+static void monty_work_new(MontyContext *mc, MontyWork *wk)
+{
+	int len = mc->len;
+	int xlen = (mc->elen > len ? mc->elen : len);
+
+	wk->storage = bn_scratch_new(mc->worklen);
+	wk->a = wk->storage;
+	wk->x = wk->a + 2 * len;
+	wk->y = wk->x + xlen;
+	wk->scratch = wk->y + xlen;
+	wk->table = wk->scratch + mc->scratchlen;
+}
+
+static void monty_work_free(MontyContext *mc, MontyWork *wk)
+{
+	bn_scratch_free(wk->storage, mc->worklen);
+}
+
+/*
+* Load x, reduced mod n if it isn't already, into a big-endian array
+* of mc->len words.
+*/
+static void monty_load(MontyContext *mc, BignumInt *dst, Bignum x)
+{
+	if (bignum_cmp(x, mc->modulus) >= 0) {
+		Bignum reduced = bigmod(x, mc->modulus);
+		monty_import(dst, reduced, mc->len);
+		freebn(reduced);
+	}
+	else {
+		monty_import(dst, x, mc->len);
+	}
+}
+
+/*
+* Turn the result in the top half of a 2*len array into a Bignum.
+*/
+static Bignum monty_result(MontyContext *mc, const BignumInt *a)
+{
+	int len = mc->len, i;
+	Bignum result;
+
+	result = newbn(len);
+	for (i = 0; i < len; i++)
+		result[result[0] - i] = a[i + len];
+	while (result[0] > 1 && result[result[0]] == 0)
+		result[0]--;
+
+	return result;
+}
+
+/*
+* Set r = x * y * r^-1 mod n, where all three are elements (see
+* MontyContext). r may be the same array as x or y. Uses wk's 'a'
+* array for the double-length product.
+*/
+static void monty_mul(MontyContext *mc, MontyWork *wk, BignumInt *r,
+	const BignumInt *x, const BignumInt *y)
+{
+	int len = mc->len;
+
+#ifdef BIGNUM_IFMA
+	if (mc->ifma) {
+		ifma_monty_mul(r, x, y, mc->in, mc->k0, mc->elen);
+		return;
+	}
+#endif
+
+	internal_mul(x, y, wk->a, len, wk->scratch);
+	monty_reduce(wk->a, mc->n, mc->mninv, wk->scratch, len);
+	memcpy(r, wk->a + len, len * sizeof(BignumInt));
+}
+
+/*
+* As monty_mul, but setting r = x^2 * r^-1 mod n.
+*/
+static void monty_sqr(MontyContext *mc, MontyWork *wk, BignumInt *r,
+	const BignumInt *x)
+{
+	int len = mc->len;
+
+#ifdef BIGNUM_IFMA
+	if (mc->ifma) {
+		ifma_monty_mul(r, x, x, mc->in, mc->k0, mc->elen);
+		return;
+	}
+#endif
+
+	internal_sqr(x, wk->a, len, wk->scratch);
+	monty_reduce(wk->a, mc->n, mc->mninv, wk->scratch, len);
+	memcpy(r, wk->a + len, len * sizeof(BignumInt));
+}
+
+/*
+* Get base into Montgomery representation, base * r mod n, in the
+* element dst, by Montgomery-multiplying it by r^2 mod n.
+*/
+static void monty_enter(MontyContext *mc, MontyWork *wk, BignumInt *dst,
+	Bignum base)
+{
+	monty_load(mc, wk->x, base);
+#ifdef BIGNUM_IFMA
+	if (mc->ifma) {
+		ifma_from_words(wk->a, wk->x, mc->len, mc->elen);
+		ifma_monty_mul(dst, wk->a, mc->irsq, mc->in, mc->k0, mc->elen);
+		return;
+	}
+#endif
+	monty_mul(mc, wk, dst, wk->x, mc->rsq);
+}
+
+/*
+* Turn the element acc back into an ordinary Bignum (one last
+* Montgomery reduction divides out the factor of r).
+*/
+static Bignum monty_leave(MontyContext *mc, MontyWork *wk,
+	const BignumInt *acc)
+{
+	int len = mc->len, j;
+
+#ifdef BIGNUM_IFMA
+	if (mc->ifma) {
+		/* Montgomery-multiply by plain 1 */
+		memset(wk->a, 0, mc->elen * sizeof(BignumInt));
+		wk->a[0] = 1;
+		ifma_monty_mul(wk->x, acc, wk->a, mc->in, mc->k0, mc->elen);
+		memset(wk->a, 0, len * sizeof(BignumInt));
+		ifma_to_words(wk->a + len, wk->x, len, mc->elen);
+		return monty_result(mc, wk->a);
+	}
+#endif
+
+	for (j = 0; j < len; j++) {
+		wk->a[j] = 0;
+		wk->a[len + j] = acc[j];
+	}
+	monty_reduce(wk->a, mc->n, mc->mninv, wk->scratch, len);
+
+	return monty_result(mc, wk->a);
+}
+
+/*
+* Extract w bits (w < BIGNUM_INT_BITS) of exp starting at bit pos,
+* counting from the least significant bit. Bits beyond the top of exp
+* read as zero. Which words are read depends only on pos and w, never
+* on the value of exp.
+*/
+static BignumInt exp_bits(Bignum exp, int pos, int w)
+{
+	int word = pos / BIGNUM_INT_BITS, bit = pos % BIGNUM_INT_BITS;
+	BignumInt v = 0;
+
+	if (word < (int)exp[0])
+		v = exp[word + 1] >> bit;
+	if (bit + w > BIGNUM_INT_BITS && word + 1 < (int)exp[0])
+		v |= exp[word + 2] << (BIGNUM_INT_BITS - bit);
+	return v & (((BignumInt)1 << w) - 1);
+}
+
+/*
+* Choose a window size for an exponent of the given length, trading
+* the cost of building the table against the multiplications it
+* saves.
+*/
+static int monty_window(int bits)
+{
+	if (bits > 239)
+		return MONTY_MAX_WINDOW;
+	if (bits > 79)
+		return 4;
+	if (bits > 23)
+		return 3;
+	if (bits > 6)
+		return 2;
+	return 1;
+}
+
+/*
+* Fill in table[k] = base^(2k+1) for k < 2^(w-1), the odd powers used
+* by the sliding windows below, using wk->x to hold base^2.
+*/
+static void monty_odd_powers(MontyContext *mc, MontyWork *wk,
+	BignumInt *table, Bignum base, int w)
+{
+	int elen = mc->elen, k;
+
+	monty_enter(mc, wk, table, base);
+	if (w > 1)
+		monty_sqr(mc, wk, wk->x, table);
+	for (k = 1; k < (1 << (w - 1)); k++)
+		monty_mul(mc, wk, table + k * elen, table + (k - 1) * elen, wk->x);
+}
+
+/*
+* Compute (base ^ exp) % n, for the modulus n of a Montgomery context.
+*
+* This uses sliding windows over the exponent, with a table of the odd
+* powers base^1, base^3, ..., base^(2^w - 1). The sequence of
+* operations depends on the bits of exp, so this must only be used
+* with public exponents; see monty_modpow_secret for the rest.
+*/
+Bignum monty_modpow(MontyContext *mc, Bignum base, Bignum exp)
+{
+	int elen = mc->elen;
+	MontyWork wk;
+	BignumInt *acc, *table;
+	Bignum result;
+	int bits, w, i, k, l, started;
+	int mark = bn_arena_begin();
+
+	monty_work_new(mc, &wk);
+	acc = wk.y;
+	table = wk.table;
+
+	bits = bignum_bitcount(exp);
+	w = monty_window(bits);
+
 	/*
-	* mod had better be odd, or we can't do Montgomery multiplication
-	* using a power of two at all.
+	* A table is no help with a short exponent that has only a couple
+	* of bits set, such as the usual RSA public exponent 65537: plain
+	* square-and-multiply does 16 squarings and one multiplication.
 	*/
-	if (!(mod[1] & 1))
-		return modpow_simple(base_in, exp, mod);
+	if (bits <= 64) {
+		for (i = k = 0; i < bits; i++)
+			k += (int)exp_bits(exp, i, 1);
+		if (k <= 2)
+			w = 1;
+	}
+
+	monty_odd_powers(mc, &wk, table, base, w);
+
+	/* Start the accumulator off at 1, in Montgomery form. */
+	memcpy(acc, mc->one, elen * sizeof(BignumInt));
+	started = 0;
 
 	/*
-	* Make sure the base is smaller than the modulus, by reducing
-	* it modulo the modulus if not.
+	* Work down from the top of exp. A zero bit costs one squaring;
+	* otherwise we take the longest run of at most w bits which
+	* starts here and ends in a one, and do a squaring for each of
+	* its bits followed by a single multiplication from the table.
+	* Squarings of the accumulator before the first window are
+	* squarings of 1, so we skip them.
 	*/
-	base = bigmod(base_in, mod);
+	i = bits - 1;
+	while (i >= 0) {
+		if (!exp_bits(exp, i, 1)) {
+			if (started)
+				monty_sqr(mc, &wk, acc, acc);
+			i--;
+			continue;
+		}
+
+		l = i - w + 1;
+		if (l < 0)
+			l = 0;
+		while (!exp_bits(exp, l, 1))
+			l++;
+
+		k = (int)(exp_bits(exp, l, i - l + 1) >> 1);
+		if (started) {
+			for (; i >= l; i--)
+				monty_sqr(mc, &wk, acc, acc);
+			monty_mul(mc, &wk, acc, acc, table + k * elen);
+		}
+		else {
+			memcpy(acc, table + k * elen, elen * sizeof(BignumInt));
+			started = 1;
+		}
+		i = l - 1;
+	}
+
+	result = monty_leave(mc, &wk, acc);
+	monty_work_free(mc, &wk);
+	return bn_arena_end(mark, result);
+}
+
+/*
+* Compute (a ^ x) * (b ^ y) % n, for the modulus n of a Montgomery
+* context, in a single pass: Shamir's trick, with sliding windows.
+*
+* Both exponents are scanned from the top at once, sharing one run
+* of squarings, and each has its own sliding windows and table of
+* odd powers (the two tables share the working table space). That
+* costs about as much as one of the exponentiations alone, plus the
+* multiplications for the other's windows. As with monty_modpow, the
+* sequence of operations depends on x and y, so they must be public,
+* as they are in a DSA signature check.
+*/
+Bignum monty_dual_modpow(MontyContext *mc, Bignum a, Bignum x,
+	Bignum b, Bignum y)
+{
+	int elen = mc->elen;
+	MontyWork wk;
+	BignumInt *acc;
+	BignumInt *table[2];
+	Bignum exp[2], result;
+	int w[2], lo[2], k[2];
+	int bits, i, l, e, started;
+	int mark = bn_arena_begin();
+
+	monty_work_new(mc, &wk);
+	acc = wk.y;
+	exp[0] = x;
+	exp[1] = y;
+	table[0] = wk.table;
+	table[1] = wk.table + (elen << (MONTY_MAX_WINDOW - 1));
+	bits = 0;
+	for (e = 0; e < 2; e++) {
+		l = bignum_bitcount(exp[e]);
+		if (l > bits)
+			bits = l;
+		w[e] = monty_window(l);
+		lo[e] = -1;		       /* no window under way */
+	}
+	monty_odd_powers(mc, &wk, table[0], a, w[0]);
+	monty_odd_powers(mc, &wk, table[1], b, w[1]);
+
+	memcpy(acc, mc->one, elen * sizeof(BignumInt));
+	started = 0;
 
 	/*
-	* Compute the inverse of n mod r, for monty_reduce. (In fact we
-	* want the inverse of _minus_ n mod r, but we'll sort that out
-	* below.)
+	* At each bit, square (unless the accumulator is still 1), then
+	* for each exponent: if a set bit starts a new window here, note
+	* where the window ends (at its lowest set bit, at most w bits
+	* down) and which odd power it is; and when we reach the end of
+	* a window, multiply that power in.
 	*/
-	len = mod[0];
-	r = bn_power_2(BIGNUM_INT_BITS * len);
-	inv = modinv(mod, r);
-	assert(inv); /* cannot fail, since mod is odd and r is a power of 2 */
+	for (i = bits - 1; i >= 0; i--) {
+		if (started)
+			monty_sqr(mc, &wk, acc, acc);
+		for (e = 0; e < 2; e++) {
+			if (lo[e] < 0 && exp_bits(exp[e], i, 1)) {
+				l = i - w[e] + 1;
+				if (l < 0)
+					l = 0;
+				while (!exp_bits(exp[e], l, 1))
+					l++;
+				lo[e] = l;
+				k[e] = (int)(exp_bits(exp[e], l, i - l + 1) >> 1);
+			}
+			if (lo[e] == i) {
+				if (started) {
+					monty_mul(mc, &wk, acc, acc, table[e] + k[e] * elen);
+				}
+				else {
+					memcpy(acc, table[e] + k[e] * elen,
+						elen * sizeof(BignumInt));
+					started = 1;
+				}
+				lo[e] = -1;
+			}
+		}
+	}
+
+	result = monty_leave(mc, &wk, acc);
+	monty_work_free(mc, &wk);
+	return bn_arena_end(mark, result);
+}
+
+/*
+* Copy entry idx of table, which has nentries elements, into dst.
+* Every entry is read, and selected with a mask rather than a branch
+* or an index, so that neither the time taken nor the memory access
+* pattern depends on idx.
+*/
+static void monty_select(MontyContext *mc, BignumInt *dst,
+	const BignumInt *table, int nentries, BignumInt idx)
+{
+	int elen = mc->elen, i, j;
+	const BignumInt *entry;
+	BignumInt e, mask;
+
+	memset(dst, 0, elen * sizeof(BignumInt));
+	for (i = 0, entry = table; i < nentries; i++, entry += elen) {
+		/*
+		* mask = all ones if e == 0, else zero. (The casts keep this
+		* right when BignumInt is narrower than int.)
+		*/
+		e = (BignumInt)i ^ idx;
+		mask = (BignumInt)(0 - e);
+		mask = (BignumInt)((e | mask) >> (BIGNUM_INT_BITS - 1));
+		mask = (BignumInt)(mask - 1);
+		for (j = 0; j < elen; j++)
+			dst[j] |= entry[j] & mask;
+	}
+}
+
+/*
+* Compute (base ^ exp) % n, for the modulus n of a Montgomery context,
+* where exp is secret (a private exponent, or a DSA nonce).
+*
+* This uses fixed windows with a table of every power base^0 ...
+* base^(2^w - 1), and does exactly the same sequence of squarings,
+* multiplications and table reads for every exp of a given number of
+* words: each window is looked up in constant time and multiplied in
+* even when it is zero. Only the word length of exp is revealed, not
+* its bit length.
+*/
+Bignum monty_modpow_secret(MontyContext *mc, Bignum base, Bignum exp)
+{
+	int elen = mc->elen;
+	MontyWork wk;
+	BignumInt *acc, *table;
+	Bignum result;
+	int bits, w, nentries, pos, k;
+	int mark = bn_arena_begin();
+
+	monty_work_new(mc, &wk);
+	acc = wk.y;
+	table = wk.table;
+
+	bits = exp[0] * BIGNUM_INT_BITS;
+	w = monty_window(bits);
+	nentries = 1 << w;
 
 	/*
-	* Multiply the base by r mod n, to get it into Montgomery
-	* representation.
+	* Fill in table[k] = base^k, for 0 <= k < 2^w.
 	*/
-	base2 = modmul(base, r, mod);
-	freebn(base);
-	base = base2;
+	memcpy(table, mc->one, elen * sizeof(BignumInt));
+	monty_enter(mc, &wk, table + elen, base);
+	for (k = 2; k < nentries; k++)
+		monty_mul(mc, &wk, table + k * elen, table + (k - 1) * elen,
+			table + elen);
 
-	rn = bigmod(r, mod);               /* r mod n, i.e. Montgomerified 1 */
+	/*
+	* The first (top) window goes straight into the accumulator.
+	* Then for each further window, do w squarings and multiply in
+	* the table entry.
+	*/
+	pos = (bits - 1) / w * w;
+	monty_select(mc, acc, table, nentries, exp_bits(exp, pos, w));
+	for (pos -= w; pos >= 0; pos -= w) {
+		for (k = 0; k < w; k++)
+			monty_sqr(mc, &wk, acc, acc);
+		monty_select(mc, wk.x, table, nentries, exp_bits(exp, pos, w));
+		monty_mul(mc, &wk, acc, acc, wk.x);
+	}
 
-	freebn(r);                         /* won't need this any more */
+	result = monty_leave(mc, &wk, acc);
+	monty_work_free(mc, &wk);
+	return bn_arena_end(mark, result);
+}
+
+/*
+* Fixed-base exponentiation, for a base such as a DSA generator that
+* is raised to many different powers.
+*
+* This is Lim and Lee's comb method. An exponent of up to h*d bits is
+* written as h rows of d bits each, and the table holds, for each of
+* the 2^h possible columns c (one bit from each row), the product of
+* base^(2^(j*d)) over the rows j whose bit is set in c. Then base^exp
+* takes only d squarings and d multiplications, one for each column,
+* against the hundreds of squarings of an ordinary exponentiation.
+* The table costs about as much as one ordinary exponentiation to
+* build.
+*
+* The context must outlive the comb. Like the context, a comb doesn't
+* change once made, so it may be used by several threads at once.
+*/
+#define MONTY_COMB_TEETH 5
+
+struct MontyComb {
+	MontyContext *mc;
+	Bignum base;		       /* our own copy */
+	int words;			       /* longest exponent, in words */
+	int spacing;		       /* d, the bits in each row */
+	BignumInt *table;		       /* elen << MONTY_COMB_TEETH words */
+};
+
+/*
+* Make a comb for base, modulo mc's modulus, for exponents up to
+* maxbits long. (The rows are made long enough to cover whole words,
+* since monty_comb_modpow looks only at the word length of the
+* exponent.)
+*/
+MontyComb *monty_comb_new(MontyContext *mc, Bignum base, int maxbits)
+{
+	MontyComb *comb;
+	MontyWork wk;
+	int elen = mc->elen, h = MONTY_COMB_TEETH, i, j, v;
+	BignumInt *t;
+	int mark;
+
+	comb = snew(MontyComb);
+	comb->mc = mc;
+	comb->base = bn_arena_keep(copybn(base));
+	comb->words = (maxbits + BIGNUM_INT_BITS - 1) / BIGNUM_INT_BITS;
+	if (comb->words < 1)
+		comb->words = 1;
+	comb->spacing = (comb->words * BIGNUM_INT_BITS + h - 1) / h;
+	comb->table = snewn(elen << h, BignumInt);
 
 	/*
-	* Set up internal arrays of the right lengths, in big-endian
-	* format, containing the base, the modulus, and the modulus's
-	* inverse.
+	* table[2^j] = base^(2^(j*d)), by squaring the previous one d
+	* times; then each table[2^j + v] = table[2^j] * table[v].
 	*/
-	n = snewn(len, BignumInt);
-	for (j = 0; j < len; j++)
-		n[len - 1 - j] = mod[j + 1];
+	mark = bn_arena_begin();
+	monty_work_new(mc, &wk);
+	t = comb->table;
+	memcpy(t, mc->one, elen * sizeof(BignumInt));
+	monty_enter(mc, &wk, t + elen, base);
+	for (j = 1; j < h; j++) {
+		t = comb->table + (elen << j);
+		memcpy(t, comb->table + (elen << (j - 1)), elen * sizeof(BignumInt));
+		for (i = 0; i < comb->spacing; i++)
+			monty_sqr(mc, &wk, t, t);
+		for (v = 1; v < (1 << j); v++)
+			monty_mul(mc, &wk, t + v * elen, t, comb->table + v * elen);
+	}
+	monty_work_free(mc, &wk);
+	bn_arena_end(mark, NULL);
 
-	mninv = snewn(len, BignumInt);
-	for (j = 0; j < len; j++)
-		mninv[len - 1 - j] = (j < (int)inv[0] ? inv[j + 1] : 0);
-	freebn(inv);         /* we don't need this copy of it any more */
-	/* Now negate mninv mod r, so it's the inverse of -n rather than +n. */
-	x = snewn(len, BignumInt);
-	for (j = 0; j < len; j++)
-		x[j] = 0;
-	internal_sub(x, mninv, mninv, len);
+	return comb;
+}
+
+void monty_comb_free(MontyComb *comb)
+{
+	if (!comb)
+		return;
+	smemclr(comb->table, (comb->mc->elen << MONTY_COMB_TEETH) *
+		sizeof(BignumInt));
+	sfree(comb->table);
+	freebn(comb->base);
+	smemclr(comb, sizeof(*comb));
+	sfree(comb);
+}
+
+/*
+* Compute (base ^ exp) % n for the comb's base. exp may be secret: as
+* in monty_modpow_secret, the same operations and table reads are
+* done for every exp of a given word length. An exp longer than the
+* comb was made for is handed to monty_modpow_secret instead.
+*/
+Bignum monty_comb_modpow(MontyComb *comb, Bignum exp)
+{
+	MontyContext *mc = comb->mc;
+	MontyWork wk;
+	BignumInt *acc, idx;
+	Bignum result;
+	int h = MONTY_COMB_TEETH, d = comb->spacing, i, j;
+	int mark;
+
+	if ((int)exp[0] > comb->words)
+		return monty_modpow_secret(mc, comb->base, exp);
+
+	mark = bn_arena_begin();
+	monty_work_new(mc, &wk);
+	acc = wk.y;
+
+	for (i = d - 1; i >= 0; i--) {
+		idx = 0;
+		for (j = 0; j < h; j++)
+			idx |= exp_bits(exp, i + j * d, 1) << j;
+		if (i == d - 1) {
+			monty_select(mc, acc, comb->table, 1 << h, idx);
+		}
+		else {
+			monty_sqr(mc, &wk, acc, acc);
+			monty_select(mc, wk.x, comb->table, 1 << h, idx);
+			monty_mul(mc, &wk, acc, acc, wk.x);
+		}
+	}
 
-	/* x = snewn(len, BignumInt); */ /* already done above */
-	for (j = 0; j < len; j++)
-		x[len - 1 - j] = (j < (int)base[0] ? base[j + 1] : 0);
-	freebn(base);        /* we don't need this copy of it any more */
+	result = monty_leave(mc, &wk, acc);
+	monty_work_free(mc, &wk);
+	return bn_arena_end(mark, result);
+}
 
-	a = snewn(2 * len, BignumInt);
-	b = snewn(2 * len, BignumInt);
-	for (j = 0; j < len; j++)
-		a[2 * len - 1 - j] = (j < (int)rn[0] ? rn[j + 1] : 0);
-	freebn(rn);
+/*
+* Compute (p * q) % n, for the modulus n of a Montgomery context. This
+* is the same division-based method as modmul, but using the
+* context's ready-shifted modulus.
+*/
+Bignum monty_modmul(MontyContext *mc, Bignum p, Bignum q)
+{
+	MontyWork wk;
+	BignumInt *a, *m = mc->m;
+	Bignum result;
+	int len = mc->len, mshift = mc->mshift, i;
+	int mark = bn_arena_begin();
 
-	/* Scratch space for multiplies */
-	scratchlen = 3 * len + mul_compute_scratch(len);
-	scratch = snewn(scratchlen, BignumInt);
+	monty_work_new(mc, &wk);
+	a = wk.a;
+	monty_load(mc, wk.x, p);
+	monty_load(mc, wk.y, q);
+	internal_mul(wk.x, wk.y, a, len, wk.scratch);
+	internal_mod(a, len * 2, m, len, NULL, 0);
 
-	/* Skip leading zero bits of exp. */
-	i = 0;
-	j = BIGNUM_INT_BITS - 1;
-	while (i < (int)exp[0] && (exp[exp[0] - i] & ((BignumInt)1 << j)) == 0) {
-		j--;
-		if (j < 0) {
-			i++;
-			j = BIGNUM_INT_BITS - 1;
-		}
+	/* Fixup result in case the modulus was shifted */
+	if (mshift) {
+		for (i = len - 1; i < 2 * len - 1; i++)
+			a[i] = (a[i] << mshift) | (a[i + 1] >> (BIGNUM_INT_BITS - mshift));
+		a[2 * len - 1] = a[2 * len - 1] << mshift;
+		internal_mod(a, len * 2, m, len, NULL, 0);
+		for (i = 2 * len - 1; i >= len; i--)
+			a[i] = (a[i] >> mshift) | (a[i - 1] << (BIGNUM_INT_BITS - mshift));
 	}
 
-	/* Main computation */
-	while (i < (int)exp[0]) {
-		while (j >= 0) {
-			internal_mul(a + len, a + len, b, len, scratch);
-			monty_reduce(b, n, mninv, scratch, len);
-			if ((exp[exp[0] - i] & ((BignumInt)1 << j)) != 0) {
-				internal_mul(b + len, x, a, len, scratch);
-				monty_reduce(a, n, mninv, scratch, len);
-			}
-			else {
-				BignumInt *t;
-				t = a;
-				a = b;
-				b = t;
-			}
-			j--;
-		}
-		i++;
-		j = BIGNUM_INT_BITS - 1;
-	}
+	result = monty_result(mc, a);
+	monty_work_free(mc, &wk);
+	return bn_arena_end(mark, result);
+}
+
+/*
+* Compute (base ^ exp) % mod. Uses the Montgomery multiplication
+* technique where possible, falling back to modpow_simple otherwise.
+*/
+Bignum modpow(Bignum base, Bignum exp, Bignum mod)
+{
+	MontyContext *mc;
+	Bignum result;
+	int mark = bn_arena_begin();
 
 	/*
-	* Final monty_reduce to get back from the adjusted Montgomery
-	* representation.
+	* mod had better be odd, or we can't do Montgomery multiplication
+	* using a power of two at all.
 	*/
-	monty_reduce(a, n, mninv, scratch, len);
+	mc = monty_create(mod, 1);
+	if (!mc)
+		return bn_arena_end(mark, modpow_simple(base, exp, mod));
 
-	/* Copy result to buffer */
-	result = newbn(mod[0]);
-	for (i = 0; i < len; i++)
-		result[result[0] - i] = a[i + len];
-	while (result[0] > 1 && result[result[0]] == 0)
-		result[0]--;
+	result = monty_modpow(mc, base, exp);
+	monty_free(mc);
+	return bn_arena_end(mark, result);
+}
 
-	/* Free temporary arrays */
-	smemclr(scratch, scratchlen * sizeof(*scratch));
-	sfree(scratch);
-	smemclr(a, 2 * len * sizeof(*a));
-	sfree(a);
-	smemclr(b, 2 * len * sizeof(*b));
-	sfree(b);
-	smemclr(mninv, len * sizeof(*mninv));
-	sfree(mninv);
-	smemclr(n, len * sizeof(*n));
-	sfree(n);
-	smemclr(x, len * sizeof(*x));
-	sfree(x);
+/*
+* Compute (a ^ x) * (b ^ y) % mod, for public x and y. See
+* monty_dual_modpow.
+*/
+Bignum dual_modpow(Bignum a, Bignum x, Bignum b, Bignum y, Bignum mod)
+{
+	MontyContext *mc;
+	Bignum result, ax, by;
+	int mark = bn_arena_begin();
+
+	mc = monty_create(mod, 1);
+	if (!mc) {
+		ax = modpow_simple(a, x, mod);
+		by = modpow_simple(b, y, mod);
+		result = modmul(ax, by, mod);
+		freebn(ax);
+		freebn(by);
+		return bn_arena_end(mark, result);
+	}
 
-	return result;
+	result = monty_dual_modpow(mc, a, x, b, y);
+	monty_free(mc);
+	return bn_arena_end(mark, result);
 }
 
 /*
@@ -924,6 +2196,7 @@ Bignum modmul(Bignum p, Bignum q, Bignum mod)
 	int mshift, scratchlen;
 	int pqlen, mlen, rlen, i, j;
 	Bignum result;
+	int mark = bn_arena_begin();
 
 	/*
 	* The most significant word of mod needs to be non-zero. It
@@ -934,7 +2207,7 @@ Bignum modmul(Bignum p, Bignum q, Bignum mod)
 	/* Allocate m of size mlen, copy mod to m */
 	/* We use big endian internally */
 	mlen = mod[0];
-	m = snewn(mlen, BignumInt);
+	m = bn_scratch_new(mlen);
 	for (j = 0; j < mlen; j++)
 		m[j] = mod[mod[0] - j];
 
@@ -958,7 +2231,7 @@ Bignum modmul(Bignum p, Bignum q, Bignum mod)
 		pqlen = mlen / 2 + 1;
 
 	/* Allocate n of size pqlen, copy p to n */
-	n = snewn(pqlen, BignumInt);
+	n = bn_scratch_new(pqlen);
 	i = pqlen - p[0];
 	for (j = 0; j < i; j++)
 		n[j] = 0;
@@ -966,7 +2239,7 @@ Bignum modmul(Bignum p, Bignum q, Bignum mod)
 		n[i + j] = p[p[0] - j];
 
 	/* Allocate o of size pqlen, copy q to o */
-	o = snewn(pqlen, BignumInt);
+	o = bn_scratch_new(pqlen);
 	i = pqlen - q[0];
 	for (j = 0; j < i; j++)
 		o[j] = 0;
@@ -974,11 +2247,11 @@ Bignum modmul(Bignum p, Bignum q, Bignum mod)
 		o[i + j] = q[q[0] - j];
 
 	/* Allocate a of size 2*pqlen for result */
-	a = snewn(2 * pqlen, BignumInt);
+	a = bn_scratch_new(2 * pqlen);
 
 	/* Scratch space for multiplies */
 	scratchlen = mul_compute_scratch(pqlen);
-	scratch = snewn(scratchlen, BignumInt);
+	scratch = bn_scratch_new(scratchlen);
 
 	/* Main computation */
 	internal_mul(n, o, a, pqlen, scratch);
@@ -1003,18 +2276,13 @@ Bignum modmul(Bignum p, Bignum q, Bignum mod)
 		result[0]--;
 
 	/* Free temporary arrays */
-	smemclr(scratch, scratchlen * sizeof(*scratch));
-	sfree(scratch);
-	smemclr(a, 2 * pqlen * sizeof(*a));
-	sfree(a);
-	smemclr(m, mlen * sizeof(*m));
-	sfree(m);
-	smemclr(n, pqlen * sizeof(*n));
-	sfree(n);
-	smemclr(o, pqlen * sizeof(*o));
-	sfree(o);
+	bn_scratch_free(scratch, scratchlen);
+	bn_scratch_free(a, 2 * pqlen);
+	bn_scratch_free(m, mlen);
+	bn_scratch_free(n, pqlen);
+	bn_scratch_free(o, pqlen);
 
-	return result;
+	return bn_arena_end(mark, result);
 }
 
 /*
@@ -1039,7 +2307,7 @@ static void bigdivmod(Bignum p, Bignum mod, Bignum result, Bignum quotient)
 	/* Allocate m of size mlen, copy mod to m */
 	/* We use big endian internally */
 	mlen = mod[0];
-	m = snewn(mlen, BignumInt);
+	m = bn_scratch_new(mlen);
 	for (j = 0; j < mlen; j++)
 		m[j] = mod[mod[0] - j];
 
@@ -1059,7 +2327,7 @@ static void bigdivmod(Bignum p, Bignum mod, Bignum result, Bignum quotient)
 		plen = mlen + 1;
 
 	/* Allocate n of size plen, copy p to n */
-	n = snewn(plen, BignumInt);
+	n = bn_scratch_new(plen);
 	for (j = 0; j < plen; j++)
 		n[j] = 0;
 	for (j = 1; j <= (int)p[0]; j++)
@@ -1087,10 +2355,8 @@ static void bigdivmod(Bignum p, Bignum mod, Bignum result, Bignum quotient)
 	}
 
 	/* Free temporary arrays */
-	smemclr(m, mlen * sizeof(*m));
-	sfree(m);
-	smemclr(n, plen * sizeof(*n));
-	sfree(n);
+	bn_scratch_free(m, mlen);
+	bn_scratch_free(n, plen);
 }
 
 /*
@@ -1195,6 +2461,40 @@ int bignum_byte(Bignum bn, int i)
 		((i % BIGNUM_INT_BYTES) * 8)) & 0xFF;
 }
 
+/*
+* Write bytes lo to lo+nbytes-1 of a bignum (numbered as in
+* bignum_byte) to data, most significant first, so that
+* bignum_to_bytes(bn, 0, data, n) gives the same as n calls to
+* bignum_byte counting down. This goes a word at a time.
+*/
+void bignum_to_bytes(Bignum bn, int lo, unsigned char *data, int nbytes)
+{
+	int i = lo, w, shift;
+	BignumInt v;
+
+	assert(lo >= 0 && nbytes >= 0);
+	data += nbytes;
+
+	/* Bytes up to the first word boundary above lo */
+	while (nbytes > 0 && i % BIGNUM_INT_BYTES) {
+		*--data = (unsigned char)bignum_byte(bn, i);
+		i++;
+		nbytes--;
+	}
+
+	/* Then whole words */
+	for (w = i / BIGNUM_INT_BYTES; nbytes >= BIGNUM_INT_BYTES;
+		w++, nbytes -= BIGNUM_INT_BYTES) {
+		v = w < (int)bn[0] ? bn[w + 1] : 0;
+		for (shift = 0; shift < BIGNUM_INT_BITS; shift += 8)
+			*--data = (unsigned char)(v >> shift);
+	}
+
+	/* And the bottom part of the last one */
+	for (i = w * BIGNUM_INT_BYTES; nbytes > 0; i++, nbytes--)
+		*--data = (unsigned char)bignum_byte(bn, i);
+}
+
 /*
 * Return a bit from a bignum; 0 is least significant, etc.
 */
@@ -1317,14 +2617,18 @@ Bignum bigmuladd(Bignum a, Bignum b, Bignum addend)
 	/* mlen space for a, mlen space for b, 2*mlen for result,
 	* plus scratch space for multiplication */
 	wslen = mlen * 4 + mul_compute_scratch(mlen);
-	workspace = snewn(wslen, BignumInt);
+	workspace = bn_scratch_new(wslen);
 	for (i = 0; i < mlen; i++) {
 		workspace[0 * mlen + i] = (mlen - i <= (int)a[0] ? a[mlen - i] : 0);
 		workspace[1 * mlen + i] = (mlen - i <= (int)b[0] ? b[mlen - i] : 0);
 	}
 
-	internal_mul(workspace + 0 * mlen, workspace + 1 * mlen,
-		workspace + 2 * mlen, mlen, workspace + 4 * mlen);
+	if (a == b)
+		internal_sqr(workspace + 0 * mlen, workspace + 2 * mlen, mlen,
+			workspace + 4 * mlen);
+	else
+		internal_mul(workspace + 0 * mlen, workspace + 1 * mlen,
+			workspace + 2 * mlen, mlen, workspace + 4 * mlen);
 
 	/* now just copy the result back */
 	rlen = alen + blen + 1;
@@ -1341,20 +2645,18 @@ Bignum bigmuladd(Bignum a, Bignum b, Bignum addend)
 
 	/* now add in the addend, if any */
 	if (addend) {
-		BignumDblInt carry = 0;
+		BignumCarry carry = 0;
 		for (i = 1; i <= rlen; i++) {
-			carry += (i <= (int)ret[0] ? ret[i] : 0);
-			carry += (i <= (int)addend[0] ? addend[i] : 0);
-			ret[i] = (BignumInt)carry & BIGNUM_INT_MASK;
-			carry >>= BIGNUM_INT_BITS;
+			BignumInt retword = (i <= (int)ret[0] ? ret[i] : 0);
+			BignumInt addword = (i <= (int)addend[0] ? addend[i] : 0);
+			BignumADC(ret[i], carry, retword, addword, carry);
 			if (ret[i] != 0 && i > maxspot)
 				maxspot = i;
 		}
 	}
 	ret[0] = maxspot;
 
-	smemclr(workspace, wslen * sizeof(*workspace));
-	sfree(workspace);
+	bn_scratch_free(workspace, wslen);
 	return ret;
 }
 
@@ -1375,17 +2677,16 @@ Bignum bigadd(Bignum a, Bignum b)
 	int rlen = (alen > blen ? alen : blen) + 1;
 	int i, maxspot;
 	Bignum ret;
-	BignumDblInt carry;
+	BignumCarry carry;
 
 	ret = newbn(rlen);
 
 	carry = 0;
 	maxspot = 0;
 	for (i = 1; i <= rlen; i++) {
-		carry += (i <= (int)a[0] ? a[i] : 0);
-		carry += (i <= (int)b[0] ? b[i] : 0);
-		ret[i] = (BignumInt)carry & BIGNUM_INT_MASK;
-		carry >>= BIGNUM_INT_BITS;
+		BignumInt aword = (i <= (int)a[0] ? a[i] : 0);
+		BignumInt bword = (i <= (int)b[0] ? b[i] : 0);
+		BignumADC(ret[i], carry, aword, bword, carry);
 		if (ret[i] != 0 && i > maxspot)
 			maxspot = i;
 	}
@@ -1405,17 +2706,16 @@ Bignum bigsub(Bignum a, Bignum b)
 	int rlen = (alen > blen ? alen : blen);
 	int i, maxspot;
 	Bignum ret;
-	BignumDblInt carry;
+	BignumCarry carry;
 
 	ret = newbn(rlen);
 
 	carry = 1;
 	maxspot = 0;
 	for (i = 1; i <= rlen; i++) {
-		carry += (i <= (int)a[0] ? a[i] : 0);
-		carry += (i <= (int)b[0] ? b[i] ^ BIGNUM_INT_MASK : BIGNUM_INT_MASK);
-		ret[i] = (BignumInt)carry & BIGNUM_INT_MASK;
-		carry >>= BIGNUM_INT_BITS;
+		BignumInt aword = (i <= (int)a[0] ? a[i] : 0);
+		BignumInt bword = (i <= (int)b[0] ? b[i] : 0);
+		BignumADC(ret[i], carry, aword, bword ^ BIGNUM_INT_MASK, carry);
 		if (ret[i] != 0 && i > maxspot)
 			maxspot = i;
 	}
@@ -1455,18 +2755,24 @@ Bignum bignum_bitmask(Bignum n)
 }
 
 /*
-* Convert a (max 32-bit) long into a bignum.
+* Convert an unsigned long into a bignum.
 */
-Bignum bignum_from_long(unsigned long nn)
+Bignum bignum_from_long(unsigned long n)
 {
+	const int maxwords =
+		(sizeof(unsigned long) + sizeof(BignumInt) - 1) / sizeof(BignumInt);
 	Bignum ret;
-	BignumDblInt n = nn;
+	int i;
 
-	ret = newbn(3);
-	ret[1] = (BignumInt)(n & BIGNUM_INT_MASK);
-	ret[2] = (BignumInt)((n >> BIGNUM_INT_BITS) & BIGNUM_INT_MASK);
-	ret[3] = 0;
-	ret[0] = (ret[2] ? 2 : 1);
+	ret = newbn(maxwords);
+	ret[0] = 1;
+	for (i = 0; i < maxwords; i++) {
+		ret[i + 1] = (BignumInt)n;
+		if (ret[i + 1] != 0)
+			ret[0] = i + 1;
+		/* two shifts, since BIGNUM_INT_BITS may be the width of n */
+		n = (n >> (BIGNUM_INT_BITS - 1)) >> 1;
+	}
 	return ret;
 }
 
@@ -1477,14 +2783,13 @@ Bignum bignum_add_long(Bignum number, unsigned long addendx)
 {
 	Bignum ret = newbn(number[0] + 1);
 	int i, maxspot = 0;
-	BignumDblInt carry = 0, addend = addendx;
+	BignumCarry carry = 0;
+	unsigned long addend = addendx;
 
 	for (i = 1; i <= (int)ret[0]; i++) {
-		carry += addend & BIGNUM_INT_MASK;
-		carry += (i <= (int)number[0] ? number[i] : 0);
-		addend >>= BIGNUM_INT_BITS;
-		ret[i] = (BignumInt)carry & BIGNUM_INT_MASK;
-		carry >>= BIGNUM_INT_BITS;
+		BignumInt nword = (i <= (int)number[0] ? number[i] : 0);
+		BignumADC(ret[i], carry, nword, (BignumInt)addend, carry);
+		addend = (addend >> (BIGNUM_INT_BITS - 1)) >> 1;
 		if (ret[i] != 0)
 			maxspot = i;
 	}
@@ -1497,13 +2802,15 @@ Bignum bignum_add_long(Bignum number, unsigned long addendx)
 */
 unsigned short bignum_mod_short(Bignum number, unsigned short modulus)
 {
-	BignumDblInt mod, r;
+	unsigned long mod = modulus, r = 0;
+	/* Precompute 2^BIGNUM_INT_BITS mod modulus */
+	unsigned long base_r = (BIGNUM_INT_MASK - modulus + 1) % mod;
 	int i;
 
-	r = 0;
-	mod = modulus;
-	for (i = number[0]; i > 0; i--)
-		r = (r * (BIGNUM_TOP_BIT % mod) * 2 + number[i] % mod) % mod;
+	for (i = number[0]; i > 0; i--) {
+		/* Conceptually, ((r << BIGNUM_INT_BITS) + number[i]) % mod */
+		r = (r * base_r + number[i] % mod) % mod;
+	}
 	return (unsigned short)r;
 }
 
@@ -1577,9 +2884,11 @@ Bignum biggcd(Bignum av, Bignum bv)
 }
 
 /*
-* Modular inverse, using Euclid's extended algorithm.
+* Modular inverse, using Euclid's extended algorithm. This is only used
+* for even moduli now (see modinv below), which in practice means
+* monty_new's power of 2.
 */
-Bignum modinv(Bignum number, Bignum modulus)
+static Bignum modinv_euclid(Bignum number, Bignum modulus)
 {
 	Bignum a = copybn(modulus);
 	Bignum b = copybn(number);
@@ -1653,6 +2962,344 @@ Bignum modinv(Bignum number, Bignum modulus)
 	return x;
 }
 
+/*
+* modinv_binary and its helpers work on len-word little-endian arrays
+* (the same order as a Bignum's words, without the length word). They
+* do the same work whatever the values involved, with every choice
+* made by an all-zeros or all-ones mask.
+*
+* INV_K is how many binary GCD steps are done at a time on 64-bit
+* approximations of the numbers. The update factors are at most
+* 2^INV_K, and the sums they make in inv_lin_mod at most 2^(INV_K+1)
+* times the modulus, so INV_K must be at most BIGNUM_INT_BITS - 3 for
+* those to fit in one extra word with a sign bit.
+*/
+#if BIGNUM_INT_BITS > 32
+#define INV_K 31
+#else
+#define INV_K (BIGNUM_INT_BITS - 3)
+#endif
+#define INV_KMASK ((((unsigned long long)1) << INV_K) - 1)
+
+/*
+* inv_sub sets r = a - (b & mask) and returns the borrow; inv_add sets
+* r = a + (b & mask) and returns the carry.
+*/
+static BignumInt inv_sub(BignumInt *r, const BignumInt *a, const BignumInt *b,
+	BignumInt mask, int len)
+{
+	BignumCarry carry = 1;
+	int i;
+
+	for (i = 0; i < len; i++)
+		BignumADC(r[i], carry, a[i], (BignumInt)~(b[i] & mask), carry);
+	return (BignumInt)(1 - carry);
+}
+
+static BignumInt inv_add(BignumInt *r, const BignumInt *a, const BignumInt *b,
+	BignumInt mask, int len)
+{
+	BignumCarry carry = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		BignumADC(r[i], carry, a[i], (BignumInt)(b[i] & mask), carry);
+	return (BignumInt)carry;
+}
+
+/*
+* The bit length of the larger of a and b.
+*/
+static int inv_bitlen(const BignumInt *a, const BignumInt *b, int len)
+{
+	BignumInt top = 0, w, nz;
+	int i, s, idx = 0, n;
+
+	/* Find the top nonzero word of a | b... */
+	for (i = 0; i < len; i++) {
+		w = a[i] | b[i];
+		nz = (BignumInt)(0 - (BignumInt)((w | (BignumInt)(0 - w)) >>
+			(BIGNUM_INT_BITS - 1)));
+		top ^= (top ^ w) & nz;
+		idx ^= (idx ^ i) & -(int)(nz & 1);
+	}
+
+	/* ... and the length of that word, by binary search. */
+	n = idx * BIGNUM_INT_BITS;
+	for (s = BIGNUM_INT_BITS / 2; s > 0; s >>= 1) {
+		w = (BignumInt)(top >> s);
+		nz = (BignumInt)(0 - (BignumInt)((w | (BignumInt)(0 - w)) >>
+			(BIGNUM_INT_BITS - 1)));
+		n += s & -(int)(nz & 1);
+		top ^= (top ^ w) & nz;
+	}
+	return n + (int)top;
+}
+
+/*
+* Bits pos to pos+count-1 of a, for count <= 33.
+*/
+static unsigned long long inv_bits(const BignumInt *a, int len, int pos,
+	int count)
+{
+	unsigned long long r = 0, mask;
+	int i, d, neg, in, ls, rs;
+
+	for (i = 0; i < len; i++) {
+		/*
+		* Word i overlaps the bits we want if -BIGNUM_INT_BITS < d <
+		* count; it is then shifted left d bits, or right -d.
+		*/
+		d = i * BIGNUM_INT_BITS - pos;
+		in = (int)(((unsigned)(d + BIGNUM_INT_BITS - 1) |
+			(unsigned)(count - 1 - d)) >> (sizeof(unsigned) * 8 - 1)) ^ 1;
+		neg = -(int)((unsigned)d >> (sizeof(unsigned) * 8 - 1));
+		ls = d & ~neg & -in;
+		rs = -d & neg & -in;
+		mask = 0 - (unsigned long long)in;
+		r |= (((unsigned long long)a[i] >> rs) << ls) & mask;
+	}
+	return r & ((((unsigned long long)1) << count) - 1);
+}
+
+/*
+* The main loop of inv_lin and inv_lin_mod: the word at a time
+* computation of a * f + b * g, for signed factors with |f| + |g| <=
+* 2^INV_K, as a (len+1)-word two's complement number. This works out
+* a[i] * |f| and b[i] * |g|, negates each product stream as it goes if
+* its factor is negative, and adds them up; 'top' gets the last word.
+*/
+#define INV_LIN_SETUP(f, g) \
+	BignumInt fm = (BignumInt)0 - (BignumInt)((f) >> 63); \
+	BignumInt gm = (BignumInt)0 - (BignumInt)((g) >> 63); \
+	BignumInt fa = (BignumInt)(((f) ^ (0 - ((f) >> 63))) + ((f) >> 63)); \
+	BignumInt ga = (BignumInt)(((g) ^ (0 - ((g) >> 63))) + ((g) >> 63)); \
+	BignumInt ph = 0, qh = 0, pl, ql; \
+	BignumCarry fc = (BignumCarry)(fm & 1), gc = (BignumCarry)(gm & 1); \
+	BignumCarry sc = 0
+#define INV_LIN_WORD(s, aw, bw) do { \
+	BignumMULADD(ph, pl, aw, fa, ph); \
+	BignumMULADD(qh, ql, bw, ga, qh); \
+	BignumADC(pl, fc, (BignumInt)(pl ^ fm), 0, fc); \
+	BignumADC(ql, gc, (BignumInt)(ql ^ gm), 0, gc); \
+	BignumADC(s, sc, pl, ql, sc); \
+} while (0)
+#define INV_LIN_TOP(s) INV_LIN_WORD(s, 0, 0)
+
+/*
+* Set r = |a * f + b * g| / 2^INV_K, where the division is known to be
+* exact. Returns an all-ones mask if the sum was negative.
+*/
+static unsigned long long inv_lin(BignumInt *r, const BignumInt *a,
+	const BignumInt *b, unsigned long long f, unsigned long long g, int len)
+{
+	INV_LIN_SETUP(f, g);
+	BignumInt s, prev = 0, neg;
+	BignumCarry carry;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		INV_LIN_WORD(s, a[i], b[i]);
+		if (i > 0)
+			r[i - 1] = (BignumInt)((prev >> INV_K) |
+				(s << (BIGNUM_INT_BITS - INV_K)));
+		prev = s;
+	}
+	INV_LIN_TOP(s);
+	r[len - 1] = (BignumInt)((prev >> INV_K) | (s << (BIGNUM_INT_BITS - INV_K)));
+
+	neg = (BignumInt)(0 - (BignumInt)(s >> (BIGNUM_INT_BITS - 1)));
+	carry = (BignumCarry)(neg & 1);
+	for (i = 0; i < len; i++)
+		BignumADC(r[i], carry, (BignumInt)(r[i] ^ neg), 0, carry);
+	return 0 - (unsigned long long)(neg & 1);
+}
+
+/*
+* Set r = (u * f + v * g) / 2^INV_K mod m, where u, v < m and m0inv is
+* -m^{-1} mod 2^INV_K. As in Montgomery reduction, a multiple of m is
+* added to make the sum divisible by 2^INV_K; the quotient is then
+* between -m and 2m, and is brought into range with at most one
+* addition or subtraction of m. tmp is len words of scratch space.
+*/
+static void inv_lin_mod(BignumInt *r, const BignumInt *u, const BignumInt *v,
+	unsigned long long f, unsigned long long g, const BignumInt *m,
+	BignumInt m0inv, BignumInt *tmp, int len)
+{
+	INV_LIN_SETUP(f, g);
+	BignumInt s, prev = 0, t = 0, mh = 0, hi, mask;
+	BignumCarry mc = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		INV_LIN_WORD(s, u[i], v[i]);
+		if (i == 0)
+			t = (BignumInt)(((unsigned long long)s * m0inv) & INV_KMASK);
+		BignumMULADD2(mh, s, m[i], t, s, mh);
+		if (i > 0)
+			r[i - 1] = (BignumInt)((prev >> INV_K) |
+				(s << (BIGNUM_INT_BITS - INV_K)));
+		prev = s;
+	}
+	INV_LIN_TOP(s);
+	BignumADC(s, mc, s, mh, mc);
+	r[len - 1] = (BignumInt)((prev >> INV_K) | (s << (BIGNUM_INT_BITS - INV_K)));
+
+	/* hi is the rest of the quotient: -1, 0 or 1. */
+	mask = (BignumInt)(0 - (BignumInt)(s >> (BIGNUM_INT_BITS - 1)));
+	hi = (BignumInt)((s >> INV_K) | (mask << (BIGNUM_INT_BITS - INV_K)));
+
+	/* If it's negative, add m. */
+	mask = (BignumInt)(0 - (BignumInt)(hi >> (BIGNUM_INT_BITS - 1)));
+	hi = (BignumInt)(hi + inv_add(r, r, m, mask, len));
+
+	/* If it's still m or more, subtract m. */
+	hi = (BignumInt)(hi - inv_sub(tmp, r, m, BIGNUM_INT_MASK, len));
+	mask = (BignumInt)((hi >> (BIGNUM_INT_BITS - 1)) - 1);
+	for (i = 0; i < len; i++)
+		r[i] ^= (r[i] ^ tmp[i]) & mask;
+}
+
+/*
+* Modular inverse for an odd modulus, by the binary GCD algorithm in
+* the form given in Thomas Pornin's "Optimized Binary GCD for Modular
+* Inversion": with a = number and b = modulus, repeatedly
+*
+*  - if a is odd, replace a with |a - b|, and b with min(a, b);
+*  - halve a;
+*
+* keeping u and v with a = u * number and b = v * number mod modulus.
+* When a reaches zero b is the gcd, and if that is 1 then v is the
+* inverse.
+*
+* Rather than stepping through the whole numbers each time, INV_K
+* steps at a time are worked out from a 64-bit approximation to each
+* number (its top INV_K+2 and bottom INV_K bits), as a matrix of
+* factors that is then applied to a, b, u and v in one go. The
+* approximation can make a step subtract the wrong way, which leaves
+* a or b negative; the sign is put right afterwards. Each step removes
+* at least a bit from a or b, so 2 * (bits in the modulus) steps in
+* total are enough; one extra round of INV_K allows for the slack the
+* approximation introduces.
+*
+* The sequence of operations is the same whatever the inputs, so this
+* is safe for secret values like RSA blinding factors and DSA nonces.
+* Unlike Euclid there is no division, and everything lives in one
+* buffer, wiped before it is freed.
+*/
+static Bignum modinv_binary(Bignum number, Bignum modulus)
+{
+	int len = modulus[0], rounds, i, j, n, d;
+	BignumInt *work, *a, *b, *u, *v, *na, *nb, *nu, *nv, *m, *tmp, *sw;
+	BignumInt m0inv, diff;
+	unsigned long long aw, bw, f0, g0, f1, g1, odd, swap, z, x;
+	Bignum reduced = NULL, result;
+
+	if (bignum_cmp(number, modulus) >= 0)
+		number = reduced = bigmod(number, modulus);
+
+	work = bn_scratch_new(10 * len);
+	a = work;
+	b = a + len;
+	u = b + len;
+	v = u + len;
+	na = v + len;
+	nb = na + len;
+	nu = nb + len;
+	nv = nu + len;
+	m = nv + len;
+	tmp = m + len;
+	for (i = 0; i < len; i++) {
+		a[i] = (i < (int)number[0] ? number[i + 1] : 0);
+		b[i] = m[i] = modulus[i + 1];
+		u[i] = v[i] = 0;
+	}
+	u[0] = 1;
+
+	/* -m^{-1} mod 2^INV_K, by Newton's iteration (m is its own
+	* inverse mod 8, and each step doubles the correct bits). */
+	x = m[0];
+	for (i = 0; i < 4; i++)
+		x *= 2 - m[0] * x;
+	m0inv = (BignumInt)((0 - x) & INV_KMASK);
+
+	rounds = (2 * bignum_bitcount(modulus) + INV_K - 1) / INV_K + 1;
+	for (i = 0; i < rounds; i++) {
+		n = inv_bitlen(a, b, len);
+		d = n - (2 * INV_K + 2);
+		n -= d & -(int)((unsigned)d >> (sizeof(unsigned) * 8 - 1));
+		aw = (inv_bits(a, len, n - INV_K - 2, INV_K + 2) << INV_K) |
+			(a[0] & INV_KMASK);
+		bw = (inv_bits(b, len, n - INV_K - 2, INV_K + 2) << INV_K) |
+			(b[0] & INV_KMASK);
+
+		f0 = g1 = 1;
+		g0 = f1 = 0;
+		for (j = 0; j < INV_K; j++) {
+			odd = 0 - (aw & 1);
+			z = aw - bw;
+			swap = odd & (0 - ((z ^ ((aw ^ bw) & (bw ^ z))) >> 63));
+			z = (aw ^ bw) & swap; aw ^= z; bw ^= z;
+			z = (f0 ^ f1) & swap; f0 ^= z; f1 ^= z;
+			z = (g0 ^ g1) & swap; g0 ^= z; g1 ^= z;
+			aw -= bw & odd;
+			f0 -= f1 & odd;
+			g0 -= g1 & odd;
+			aw >>= 1;
+			f1 <<= 1;
+			g1 <<= 1;
+		}
+
+		z = inv_lin(na, a, b, f0, g0, len);
+		f0 = (f0 ^ z) - z;
+		g0 = (g0 ^ z) - z;
+		z = inv_lin(nb, a, b, f1, g1, len);
+		f1 = (f1 ^ z) - z;
+		g1 = (g1 ^ z) - z;
+		inv_lin_mod(nu, u, v, f0, g0, m, m0inv, tmp, len);
+		inv_lin_mod(nv, u, v, f1, g1, m, m0inv, tmp, len);
+
+		sw = a; a = na; na = sw;
+		sw = b; b = nb; nb = sw;
+		sw = u; u = nu; nu = sw;
+		sw = v; v = nv; nv = sw;
+	}
+
+	/* Now a is zero, and b is the gcd. */
+	diff = b[0] ^ 1;
+	for (i = 1; i < len; i++)
+		diff |= b[i];
+
+	result = NULL;
+	if (!diff) {
+		result = newbn(len);
+		for (i = 0; i < len; i++)
+			result[i + 1] = v[i];
+		while (result[0] > 1 && result[result[0]] == 0)
+			result[0]--;
+	}
+
+	bn_scratch_free(work, 10 * len);
+	if (reduced)
+		freebn(reduced);
+	return result;
+}
+
+/*
+* Modular inverse: number^-1 mod modulus, or NULL if they have a
+* common factor.
+*/
+Bignum modinv(Bignum number, Bignum modulus)
+{
+	assert(number[number[0]] != 0);
+	assert(modulus[modulus[0]] != 0);
+
+	if (modulus[1] & 1)
+		return modinv_binary(number, modulus);
+	else
+		return modinv_euclid(number, modulus);
+}
+
 /*
 * Render a bignum into decimal. Return a malloced string holding
 * the decimal representation.
@@ -1661,7 +3308,7 @@ char *bignum_decimal(Bignum x)
 {
 	int ndigits, ndigit;
 	int i, iszero;
-	BignumDblInt carry;
+	BignumInt carry, word, q, ten = 10;
 	char *ret;
 	BignumInt *workspace;
 
@@ -1708,11 +3355,12 @@ char *bignum_decimal(Bignum x)
 		iszero = 1;
 		carry = 0;
 		for (i = 0; i < (int)x[0]; i++) {
-			carry = (carry << BIGNUM_INT_BITS) + workspace[i];
-			workspace[i] = (BignumInt)(carry / 10);
+			/* carry < 10, so the quotient fits in a word */
+			word = workspace[i];
+			DIVMOD_WORD(q, carry, carry, word, ten);
+			workspace[i] = q;
 			if (workspace[i])
 				iszero = 0;
-			carry %= 10;
 		}
 		ret[--ndigit] = (char)(carry + '0');
 	} while (!iszero);
@@ -1737,6 +3385,7 @@ char *bignum_decimal(Bignum x)
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <thread>
 
 /*
 * gcc -Wall -g -O0 -DTESTBN -o testbn sshbn.c misc.c conf.c tree234.c unix/uxmisc.c -I. -I unix -I charset
@@ -1764,12 +3413,288 @@ int random_byte(void)
 
 #define fromxdigit(c) ( (c)>'9' ? ((c)&0xDF) - 'A' + 10 : (c) - '0' )
 
+/*
+* Fill in made-up (not random) odd moduli of the given number of
+* words, with their top bits set, and smaller numbers to go with them,
+* for the benchmarks below.
+*/
+static void bench_numbers(Bignum *mod, Bignum *num, int n, int words,
+	unsigned long *seed)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		mod[i] = newbn(words);
+		num[i] = newbn(words);
+		for (j = 1; j <= words; j++) {
+			*seed = *seed * 1103515245 + 12345;
+			mod[i][j] = (BignumInt)(*seed >> 3);
+			*seed = *seed * 1103515245 + 12345;
+			num[i][j] = (BignumInt)(*seed >> 3);
+			if (BIGNUM_INT_BITS > 16) {
+				*seed = *seed * 1103515245 + 12345;
+				mod[i][j] ^= (BignumInt)(*seed >> 3) << 16;
+				num[i][j] ^= (BignumInt)(*seed >> 7) << 16;
+			}
+		}
+		mod[i][1] |= 1;
+		mod[i][words] |= BIGNUM_TOP_BIT;
+		num[i][words] &= ~BIGNUM_TOP_BIT;
+		num[i][words] |= 1;
+	}
+}
+
+/*
+* 'testbn --bench-modinv' times modinv against the old Euclid code on
+* odd moduli of typical RSA sizes.
+*/
+static void bench_modinv(void)
+{
+	static const int sizes[] = { 1024, 2048, 3072, 4096 };
+	unsigned long seed = 1;
+	int s, i, j, reps;
+
+	for (s = 0; s < (int)lenof(sizes); s++) {
+		Bignum mod[16], num[16], r;
+		int words = sizes[s] / BIGNUM_INT_BITS;
+		clock_t start, tbinary, teuclid;
+
+		bench_numbers(mod, num, 16, words, &seed);
+
+		reps = 8192 / words;
+		start = clock();
+		for (j = 0; j < reps; j++)
+			for (i = 0; i < 16; i++)
+				if ((r = modinv(num[i], mod[i])) != NULL)
+					freebn(r);
+		tbinary = clock() - start;
+		start = clock();
+		for (j = 0; j < reps; j++)
+			for (i = 0; i < 16; i++)
+				if ((r = modinv_euclid(num[i], mod[i])) != NULL)
+					freebn(r);
+		teuclid = clock() - start;
+
+		printf("%d bits: binary %.1f us, Euclid %.1f us\n", sizes[s],
+			1e6 * tbinary / CLOCKS_PER_SEC / (16 * reps),
+			1e6 * teuclid / CLOCKS_PER_SEC / (16 * reps));
+
+		for (i = 0; i < 16; i++) {
+			freebn(mod[i]);
+			freebn(num[i]);
+		}
+	}
+}
+
+/*
+* 'testbn --bench-verify' times the exponentiation in an RSA signature
+* check, x^65537 mod n, both from scratch with modpow (so including
+* setting up the Montgomery context) and with a context set up
+* beforehand, as rsa2_verifysig keeps one with the key.
+*/
+static void bench_verify(void)
+{
+	static const int sizes[] = { 1024, 2048, 4096 };
+	unsigned long seed = 1;
+	int s, i, j, reps;
+	Bignum e = bignum_from_long(65537);
+
+	for (s = 0; s < (int)lenof(sizes); s++) {
+		Bignum mod[16], num[16], r;
+		MontyContext *mc[16];
+		int words = sizes[s] / BIGNUM_INT_BITS;
+		clock_t start, tfresh, tcached;
+
+		bench_numbers(mod, num, 16, words, &seed);
+		for (i = 0; i < 16; i++)
+			mc[i] = monty_new(mod[i]);
+
+		reps = 65536 / words;
+		start = clock();
+		for (j = 0; j < reps; j++)
+			for (i = 0; i < 16; i++) {
+				r = modpow(num[i], e, mod[i]);
+				freebn(r);
+			}
+		tfresh = clock() - start;
+		start = clock();
+		for (j = 0; j < reps; j++)
+			for (i = 0; i < 16; i++) {
+				r = monty_modpow(mc[i], num[i], e);
+				freebn(r);
+			}
+		tcached = clock() - start;
+
+		printf("%d bits: modpow %.1f us, cached context %.1f us\n",
+			sizes[s], 1e6 * tfresh / CLOCKS_PER_SEC / (16 * reps),
+			1e6 * tcached / CLOCKS_PER_SEC / (16 * reps));
+
+		for (i = 0; i < 16; i++) {
+			monty_free(mc[i]);
+			freebn(mod[i]);
+			freebn(num[i]);
+		}
+	}
+	freebn(e);
+}
+
+/*
+* 'testbn --threads' has several threads sign at once with one shared
+* set of contexts, as callers of rsa2_sign and dss_sign on one key
+* may: the two halves of an RSA-style CRT exponentiation, with their
+* recombining multiplication, and a DSA-style fixed-base one with a
+* comb. Every result is checked against the answer worked out on one
+* thread beforehand. (The moduli aren't prime, but that makes no
+* difference to the arithmetic.)
+*/
+#define THREAD_TEST_THREADS 4
+#define THREAD_TEST_MSGS 32
+#define THREAD_TEST_ROUNDS 4
+
+struct thread_test {
+	MontyContext *mp, *mq;
+	MontyComb *comb;
+	Bignum d[2];		       /* exponents mod p and mod q */
+	Bignum msg[THREAD_TEST_MSGS];
+	Bignum sp[THREAD_TEST_MSGS], sq[THREAD_TEST_MSGS];
+	Bignum h[THREAD_TEST_MSGS], g[THREAD_TEST_MSGS];
+	int fails[THREAD_TEST_THREADS];
+};
+
+static void thread_test_sign(struct thread_test *tt, int i, Bignum *out)
+{
+	out[0] = monty_modpow_secret(tt->mp, tt->msg[i], tt->d[0]);
+	out[1] = monty_modpow_secret(tt->mq, tt->msg[i], tt->d[1]);
+	out[2] = monty_modmul(tt->mp, out[0], out[1]);
+	out[3] = monty_comb_modpow(tt->comb, tt->msg[i]);
+}
+
+static void thread_test_run(struct thread_test *tt, int t)
+{
+	Bignum out[4];
+	int r, j, i, k;
+
+	for (r = 0; r < THREAD_TEST_ROUNDS; r++)
+		for (j = 0; j < THREAD_TEST_MSGS; j++) {
+			/* Each thread starts at a different message. */
+			i = (j + t * THREAD_TEST_MSGS / THREAD_TEST_THREADS) %
+				THREAD_TEST_MSGS;
+			thread_test_sign(tt, i, out);
+			if (bignum_cmp(out[0], tt->sp[i]) ||
+				bignum_cmp(out[1], tt->sq[i]) ||
+				bignum_cmp(out[2], tt->h[i]) ||
+				bignum_cmp(out[3], tt->g[i]))
+				tt->fails[t]++;
+			for (k = 0; k < 4; k++)
+				freebn(out[k]);
+		}
+	bn_arena_cleanup();
+}
+
+static int thread_test(int ifma)
+{
+	struct thread_test tt;
+	std::thread th[THREAD_TEST_THREADS];
+	unsigned long seed = 1;
+	int words = 1024 / BIGNUM_INT_BITS, fails = 0, i;
+	Bignum mod[2], gen[THREAD_TEST_MSGS], out[4];
+
+	bench_numbers(mod, tt.d, 2, words, &seed);
+	bench_numbers(gen, tt.msg, THREAD_TEST_MSGS, words / 2, &seed);
+	for (i = 1; i < THREAD_TEST_MSGS; i++)
+		freebn(gen[i]);
+	bignum_set_ifma(ifma);
+	tt.mp = monty_new(mod[0]);
+	tt.mq = monty_new(mod[1]);
+	tt.comb = monty_comb_new(tt.mp, gen[0], words / 2 * BIGNUM_INT_BITS);
+	bignum_set_ifma(1);
+
+	for (i = 0; i < THREAD_TEST_MSGS; i++) {
+		thread_test_sign(&tt, i, out);
+		tt.sp[i] = out[0];
+		tt.sq[i] = out[1];
+		tt.h[i] = out[2];
+		tt.g[i] = out[3];
+	}
+
+	for (i = 0; i < THREAD_TEST_THREADS; i++) {
+		tt.fails[i] = 0;
+		th[i] = std::thread(thread_test_run, &tt, i);
+	}
+	for (i = 0; i < THREAD_TEST_THREADS; i++) {
+		th[i].join();
+		fails += tt.fails[i];
+	}
+
+	for (i = 0; i < THREAD_TEST_MSGS; i++) {
+		freebn(tt.msg[i]);
+		freebn(tt.sp[i]);
+		freebn(tt.sq[i]);
+		freebn(tt.h[i]);
+		freebn(tt.g[i]);
+	}
+	monty_comb_free(tt.comb);
+	monty_free(tt.mp);
+	monty_free(tt.mq);
+	freebn(mod[0]);
+	freebn(mod[1]);
+	freebn(tt.d[0]);
+	freebn(tt.d[1]);
+	freebn(gen[0]);
+	return fails;
+}
+
+/*
+* Check bignum_to_bytes against bignum_byte, for every start position
+* up to a couple of words in and lengths running past the top.
+*/
+static int check_to_bytes(Bignum b)
+{
+	int len = (bignum_bitcount(b) + 7) / 8 + BIGNUM_INT_BYTES + 1;
+	unsigned char *data = snewn(len + 1, unsigned char);
+	int lo, n, i, ok = 1;
+
+	for (lo = 0; lo <= 2 * BIGNUM_INT_BYTES; lo++)
+		for (n = 0; n <= len; n += (n < 2 * BIGNUM_INT_BYTES ? 1 : 7)) {
+			data[n] = 0xAA;
+			bignum_to_bytes(b, lo, data, n);
+			if (data[n] != 0xAA)
+				ok = 0;
+			for (i = 0; i < n; i++)
+				if (data[i] != bignum_byte(b, lo + n - 1 - i))
+					ok = 0;
+		}
+	sfree(data);
+	return ok;
+}
+
 int main(int argc, char **argv)
 {
 	char *buf;
 	int line = 0;
 	int passes = 0, fails = 0;
 
+	if (argc > 1 && !strcmp(argv[1], "--bench-modinv")) {
+		bench_modinv();
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--bench-verify")) {
+		bench_verify();
+		return 0;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--threads")) {
+		fails = thread_test(0) + thread_test(1);
+		printf("threaded signatures: %d failed\n", fails);
+		return fails != 0;
+	}
+
+	/*
+	* An optional argument sets the Karatsuba threshold, so that the
+	* Karatsuba code can be exercised by small test cases too.
+	*/
+	if (argc > 1)
+		bignum_set_karatsuba_threshold(atoi(argv[1]));
+
 	while ((buf = fgetline(stdin)) != NULL) {
 		int maxlen = strlen(buf);
 		unsigned char *data = snewn(maxlen, unsigned char);
@@ -1845,6 +3770,34 @@ int main(int argc, char **argv)
 				sfree(cs);
 				sfree(ps);
 			}
+
+			if (check_to_bytes(p)) {
+				passes++;
+			}
+			else {
+				printf("%d: fail: bignum_to_bytes of product\n", line);
+				fails++;
+			}
+			freebn(c);
+			freebn(p);
+
+			/*
+			* Also check internal_sqr, which bigmul uses when both
+			* its arguments are the same Bignum, against the general
+			* multiplication.
+			*/
+			c = copybn(a);
+			p = bigmul(a, a);
+			freebn(b);
+			b = bigmul(a, c);
+			if (bignum_cmp(b, p) == 0) {
+				passes++;
+			}
+			else {
+				printf("%d: fail: squaring disagrees with multiplication\n",
+					line);
+				fails++;
+			}
 			freebn(a);
 			freebn(b);
 			freebn(c);
@@ -1924,6 +3877,91 @@ int main(int argc, char **argv)
 				sfree(ds);
 				sfree(ps);
 			}
+
+			/*
+			* For an odd modulus, check the constant-time and
+			* fixed-base exponentiations give the same answer, and
+			* that all of them do with the IFMA code turned off too
+			* (modpow above will have used it, if it can). Also
+			* check the dual exponentiation, using the expected
+			* answer e: base^expt * base^expt should be e^2, and
+			* e^3 * base^expt should be e^4.
+			*/
+			if (modulus[1] & 1) {
+				Bignum three = bignum_from_long(3);
+				Bignum e2 = modmul(expected, expected, modulus);
+				Bignum e4 = modmul(e2, e2, modulus);
+				int ifma;
+
+				for (ifma = 1; ifma >= 0; ifma--) {
+					MontyContext *mc;
+					MontyComb *comb;
+					Bignum secret, pub, fixed, dual2, dual4;
+
+					bignum_set_ifma(ifma);
+					mc = monty_new(modulus);
+					secret = monty_modpow_secret(mc, base, expt);
+					pub = monty_modpow(mc, base, expt);
+					comb = monty_comb_new(mc, base, bignum_bitcount(expt));
+					fixed = monty_comb_modpow(comb, expt);
+
+					if (bignum_cmp(expected, secret) == 0 &&
+						bignum_cmp(expected, pub) == 0 &&
+						bignum_cmp(expected, fixed) == 0) {
+						passes++;
+					}
+					else {
+						printf("%d: fail: monty_%s disagrees%s\n", line,
+							bignum_cmp(expected, secret) ? "modpow_secret" :
+							bignum_cmp(expected, pub) ? "modpow" :
+							"comb_modpow", ifma ? "" : " without IFMA");
+						fails++;
+					}
+					dual2 = monty_dual_modpow(mc, base, expt, base, expt);
+					dual4 = monty_dual_modpow(mc, expected, three, base, expt);
+					if (bignum_cmp(e2, dual2) == 0 &&
+						bignum_cmp(e4, dual4) == 0) {
+						passes++;
+					}
+					else {
+						printf("%d: fail: monty_dual_modpow disagrees%s\n",
+							line, ifma ? "" : " without IFMA");
+						fails++;
+					}
+					freebn(secret);
+					freebn(pub);
+					freebn(fixed);
+					freebn(dual2);
+					freebn(dual4);
+					monty_comb_free(comb);
+					monty_free(mc);
+				}
+				bignum_set_ifma(1);
+				freebn(three);
+				freebn(e2);
+				freebn(e4);
+
+				/*
+				* And that the binary modinv agrees with Euclid.
+				*/
+				if (bignum_cmp(base, Zero) != 0) {
+					Bignum inv = modinv(base, modulus);
+					Bignum ref = modinv_euclid(base, modulus);
+
+					if (inv ? (ref && bignum_cmp(inv, ref) == 0) : !ref) {
+						passes++;
+					}
+					else {
+						printf("%d: fail: modinv disagrees with Euclid\n", line);
+						fails++;
+					}
+					if (inv)
+						freebn(inv);
+					if (ref)
+						freebn(ref);
+				}
+			}
+
 			freebn(base);
 			freebn(expt);
 			freebn(modulus);
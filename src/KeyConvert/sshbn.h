@@ -10,6 +10,29 @@
 */
 
 /*
+* Each section below defines BignumInt, its size and masks, and the
+* primitive operations the bignum code is built on:
+*
+*  - BignumADC(ret, retc, a, b, c) sets ret to the low word of
+*    a + b + c, where c is a BignumCarry (0 or 1), and retc to the
+*    carry out of the top.
+*
+*  - BignumMUL(rh, rl, a, b) sets rh:rl to the double-width product
+*    of a and b. BignumMULADD and BignumMULADD2 add one or two more
+*    BignumInts into the product, which can never overflow it.
+*
+*  - BignumMULACC(acc2, acc1, acc0, a, b) adds the double-width
+*    product of a and b into the three-word accumulator
+*    acc2:acc1:acc0, as used by column-wise (Comba) multiplication.
+*
+*  - DIVMOD_WORD(q, r, hi, lo, w) divides hi:lo by w. Sections that
+*    have no convenient double-width division leave it undefined, and
+*    sshbn.cpp supplies a portable version.
+*
+* Sections with a double-width integer type BignumDblInt only need to
+* define that; the macros are then defined in terms of it at the end
+* of this file. Sections without one define the macros themselves.
+*
 * Usage notes:
 *  * Do not call the DIVMOD_WORD macro with expressions such as array
 *    subscripts, as some implementations object to this (see below).
@@ -23,30 +46,88 @@
 *    The C variant won't give the right answer, either.
 */
 
+#ifndef PUTTY_SSHBN_H
+#define PUTTY_SSHBN_H
+
 #if defined __SIZEOF_INT128__
 /* gcc and clang both provide a __uint128_t type on 64-bit targets
 * (and, when they do, indicate its presence by the above macro),
 * using the same 'two machine registers' kind of code generation that
 * 32-bit targets use for 64-bit ints. If we have one of these, we can
 * use a 64-bit BignumInt and a 128-bit BignumDblInt. */
-typedef unsigned __int64 BignumInt;
+typedef unsigned long long BignumInt;
 typedef unsigned __int128 BignumDblInt;
 #define BIGNUM_INT_MASK  0xFFFFFFFFFFFFFFFFULL
 #define BIGNUM_TOP_BIT   0x8000000000000000ULL
 #define BIGNUM_INT_BITS  64
-#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
 #define DIVMOD_WORD(q, r, hi, lo, w) do { \
     BignumDblInt n = (((BignumDblInt)hi) << BIGNUM_INT_BITS) | lo; \
     q = n / w; \
     r = n % w; \
 } while (0)
+#elif defined _MSC_VER && defined _M_AMD64
+/*
+* 64-bit Visual Studio has no 128-bit integer type and no inline
+* assembler, but it does have compiler intrinsics for the x86-64 MUL
+* and ADC instructions, so we can still use a 64-bit BignumInt. The
+* intrinsics are given temporaries for their outputs, because they
+* have been seen to generate wrong code when those alias the inputs.
+*/
+#include <intrin.h>
+typedef unsigned __int64 BignumInt;
+typedef unsigned char BignumCarry;    /* the type _addcarry_u64 uses */
+#define BIGNUM_INT_MASK  0xFFFFFFFFFFFFFFFFULL
+#define BIGNUM_TOP_BIT   0x8000000000000000ULL
+#define BIGNUM_INT_BITS  64
+#define BignumADC(ret, retc, a, b, c) do { \
+    BignumInt ADC_tmp; \
+    (retc) = _addcarry_u64(c, a, b, &ADC_tmp); \
+    (ret) = ADC_tmp; \
+} while (0)
+#define BignumMUL(rh, rl, a, b) do { \
+    BignumInt MUL_hi; \
+    (rl) = _umul128(a, b, &MUL_hi); \
+    (rh) = MUL_hi; \
+} while (0)
+#define BignumMULADD(rh, rl, a, b, addend) do { \
+    BignumInt MULADD_lo, MULADD_hi; \
+    MULADD_lo = _umul128(a, b, &MULADD_hi); \
+    MULADD_hi += _addcarry_u64(0, MULADD_lo, (addend), &MULADD_lo); \
+    (rl) = MULADD_lo; \
+    (rh) = MULADD_hi; \
+} while (0)
+#define BignumMULADD2(rh, rl, a, b, addend1, addend2) do { \
+    BignumInt MULADD_lo, MULADD_hi; \
+    MULADD_lo = _umul128(a, b, &MULADD_hi); \
+    MULADD_hi += _addcarry_u64(0, MULADD_lo, (addend1), &MULADD_lo); \
+    MULADD_hi += _addcarry_u64(0, MULADD_lo, (addend2), &MULADD_lo); \
+    (rl) = MULADD_lo; \
+    (rh) = MULADD_hi; \
+} while (0)
+#define BignumMULACC(acc2, acc1, acc0, a, b) do { \
+    BignumInt MULACC_lo, MULACC_hi; \
+    BignumCarry MULACC_c; \
+    MULACC_lo = _umul128(a, b, &MULACC_hi); \
+    MULACC_c = _addcarry_u64(0, (acc0), MULACC_lo, &MULACC_lo); \
+    MULACC_c = _addcarry_u64(MULACC_c, (acc1), MULACC_hi, &MULACC_hi); \
+    (acc0) = MULACC_lo; \
+    (acc1) = MULACC_hi; \
+    (acc2) += MULACC_c; \
+} while (0)
+#if _MSC_VER >= 1920
+/* _udiv128 arrived in Visual Studio 2019. */
+#define DIVMOD_WORD(q, r, hi, lo, w) do { \
+    BignumInt DIVMOD_r; \
+    (q) = _udiv128(hi, lo, w, &DIVMOD_r); \
+    (r) = DIVMOD_r; \
+} while (0)
+#endif
 #elif defined __GNUC__ && defined __i386__
 typedef unsigned long BignumInt;
 typedef unsigned long long BignumDblInt;
 #define BIGNUM_INT_MASK  0xFFFFFFFFUL
 #define BIGNUM_TOP_BIT   0x80000000UL
 #define BIGNUM_INT_BITS  32
-#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
 #define DIVMOD_WORD(q, r, hi, lo, w) \
     __asm__("div %2" : \
 	    "=d" (r), "=a" (q) : \
@@ -57,7 +138,6 @@ typedef unsigned __int64 BignumDblInt;
 #define BIGNUM_INT_MASK  0xFFFFFFFFUL
 #define BIGNUM_TOP_BIT   0x80000000UL
 #define BIGNUM_INT_BITS  32
-#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
 /* Note: MASM interprets array subscripts in the macro arguments as
 * assembler syntax, which gives the wrong answer. Don't supply them.
 * <http://msdn2.microsoft.com/en-us/library/bf1dw62z.aspx> */
@@ -75,7 +155,6 @@ typedef unsigned long BignumDblInt;
 #define BIGNUM_INT_MASK  0xFFFFFFFFU
 #define BIGNUM_TOP_BIT   0x80000000U
 #define BIGNUM_INT_BITS  32
-#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
 #define DIVMOD_WORD(q, r, hi, lo, w) do { \
     BignumDblInt n = (((BignumDblInt)hi) << BIGNUM_INT_BITS) | lo; \
     q = n / w; \
@@ -88,7 +167,6 @@ typedef unsigned long long BignumDblInt;
 #define BIGNUM_INT_MASK  0xFFFFFFFFUL
 #define BIGNUM_TOP_BIT   0x80000000UL
 #define BIGNUM_INT_BITS  32
-#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
 #define DIVMOD_WORD(q, r, hi, lo, w) do { \
     BignumDblInt n = (((BignumDblInt)hi) << BIGNUM_INT_BITS) | lo; \
     q = n / w; \
@@ -101,7 +179,6 @@ typedef unsigned long BignumDblInt;
 #define BIGNUM_INT_MASK  0xFFFFU
 #define BIGNUM_TOP_BIT   0x8000U
 #define BIGNUM_INT_BITS  16
-#define MUL_WORD(w1, w2) ((BignumDblInt)w1 * w2)
 #define DIVMOD_WORD(q, r, hi, lo, w) do { \
     BignumDblInt n = (((BignumDblInt)hi) << BIGNUM_INT_BITS) | lo; \
     q = n / w; \
@@ -110,3 +187,63 @@ typedef unsigned long BignumDblInt;
 #endif
 
 #define BIGNUM_INT_BYTES (BIGNUM_INT_BITS / 8)
+
+#ifndef BignumADC
+typedef BignumInt BignumCarry;
+#define BignumADC(ret, retc, a, b, c) do { \
+    BignumDblInt ADC_tmp = (BignumDblInt)(a) + (b) + (c); \
+    (ret) = (BignumInt)ADC_tmp; \
+    (retc) = (BignumCarry)(ADC_tmp >> BIGNUM_INT_BITS); \
+} while (0)
+#define BignumMUL(rh, rl, a, b) do { \
+    BignumDblInt MUL_tmp = (BignumDblInt)(a) * (b); \
+    (rh) = (BignumInt)(MUL_tmp >> BIGNUM_INT_BITS); \
+    (rl) = (BignumInt)MUL_tmp; \
+} while (0)
+#define BignumMULADD(rh, rl, a, b, addend) do { \
+    BignumDblInt MUL_tmp = (BignumDblInt)(a) * (b) + (addend); \
+    (rh) = (BignumInt)(MUL_tmp >> BIGNUM_INT_BITS); \
+    (rl) = (BignumInt)MUL_tmp; \
+} while (0)
+#define BignumMULADD2(rh, rl, a, b, addend1, addend2) do { \
+    BignumDblInt MUL_tmp = ((BignumDblInt)(a) * (b) + (addend1)) + (addend2); \
+    (rh) = (BignumInt)(MUL_tmp >> BIGNUM_INT_BITS); \
+    (rl) = (BignumInt)MUL_tmp; \
+} while (0)
+#endif
+
+#ifndef BignumMULACC
+/* The carry out of the top of acc1:acc0 is caught by the comparison
+* when BignumDblInt is exactly twice the width of BignumInt, and by
+* the double shift when it is wider. */
+#define BignumMULACC(acc2, acc1, acc0, a, b) do { \
+    BignumDblInt MULACC_t = (BignumDblInt)(a) * (b); \
+    BignumDblInt MULACC_acc = ((((BignumDblInt)(acc1)) << BIGNUM_INT_BITS) | \
+                               (acc0)) + MULACC_t; \
+    (acc2) += (BignumInt)(MULACC_acc < MULACC_t) + \
+        (BignumInt)((MULACC_acc >> BIGNUM_INT_BITS) >> BIGNUM_INT_BITS); \
+    (acc1) = (BignumInt)(MULACC_acc >> BIGNUM_INT_BITS); \
+    (acc0) = (BignumInt)MULACC_acc; \
+} while (0)
+#endif
+
+/*
+* On x86-64, sshbnifma.cpp provides Montgomery multiplication using
+* AVX-512 IFMA, which sshbn.cpp uses when ifma_available() says the
+* CPU has it. Define BIGNUM_NO_IFMA to leave it out.
+*/
+#if BIGNUM_INT_BITS == 64 && (defined __x86_64__ || defined _M_AMD64) && \
+    !defined BIGNUM_NO_IFMA
+#define BIGNUM_IFMA
+#define IFMA_MAX_LIMBS 80       /* enough for a 4096-bit modulus */
+int ifma_available(void);
+int ifma_limbs(int bits);
+void ifma_from_words(BignumInt *dst, const BignumInt *src, int len,
+                     int nlimbs);
+void ifma_to_words(BignumInt *dst, const BignumInt *src, int len,
+                   int nlimbs);
+void ifma_monty_mul(BignumInt *r, const BignumInt *a, const BignumInt *b,
+                    const BignumInt *n, BignumInt k0, int nlimbs);
+#endif
+
+#endif
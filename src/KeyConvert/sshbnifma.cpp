@@ -0,0 +1,199 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* Montgomery multiplication using the AVX-512 IFMA instructions
+* (VPMADD52LUQ and VPMADD52HUQ), which multiply eight pairs of 52-bit
+* numbers at once and add the low or high 52 bits of each product into
+* a 64-bit lane. sshbn.cpp uses this, when the CPU supports it, for the
+* multiplications and squarings inside modular exponentiation.
+*
+* Numbers here are little-endian arrays of 52-bit limbs, each held in
+* the bottom of a 64-bit BignumInt, padded to a multiple of eight
+* limbs so that they fill whole 512-bit vectors.
+*/
+
+#include <string.h>
+
+#include "misc.h"
+#include "sshbn.h"
+#include "ssh.h"
+
+#ifdef BIGNUM_IFMA
+
+#include <immintrin.h>
+
+#if defined __GNUC__ || defined __clang__
+#define IFMA_TARGET __attribute__((target("avx512f,avx512ifma")))
+#else
+#define IFMA_TARGET
+#endif
+
+#define LIMB_BITS 52
+#define LIMB_MASK ((((BignumInt)1) << LIMB_BITS) - 1)
+
+/*
+* Check whether the CPU has AVX-512F and AVX-512 IFMA, and
+* whether the OS saves the ZMM registers across context switches.
+*/
+int ifma_available(void)
+{
+	unsigned int b7;
+	unsigned long long xcr0;
+
+	if (!cpu_xsave_features(&b7, &xcr0))
+		return 0;
+	/* XMM, YMM, opmask, and both halves of the ZMM state */
+	if ((xcr0 & 0xE6) != 0xE6)
+		return 0;
+	/* AVX512F is CPUID.7.0:EBX bit 16, AVX512IFMA bit 21 */
+	return (b7 & (1U << 16)) && (b7 & (1U << 21));
+}
+
+/*
+* The number of limbs we use for a modulus of the given number of bits.
+* We need at least one spare bit above the modulus (so that values up
+* to twice the modulus fit, see below), rounded up to whole vectors.
+*/
+int ifma_limbs(int bits)
+{
+	return ((bits + 1 + LIMB_BITS - 1) / LIMB_BITS + 7) & ~7;
+}
+
+/*
+* Convert between the len-word big-endian arrays used in sshbn.cpp
+* and nlimbs-limb arrays. Every bit of src must fit in dst.
+*/
+void ifma_from_words(BignumInt *dst, const BignumInt *src, int len, int nlimbs)
+{
+	int i, bit, word, shift;
+	BignumInt v;
+
+	for (i = 0; i < nlimbs; i++) {
+		bit = i * LIMB_BITS;
+		word = bit / BIGNUM_INT_BITS;
+		shift = bit % BIGNUM_INT_BITS;
+		v = 0;
+		if (word < len) {
+			v = src[len - 1 - word] >> shift;
+			if (shift > BIGNUM_INT_BITS - LIMB_BITS && word + 1 < len)
+				v |= src[len - 2 - word] << (BIGNUM_INT_BITS - shift);
+		}
+		dst[i] = v & LIMB_MASK;
+	}
+}
+
+void ifma_to_words(BignumInt *dst, const BignumInt *src, int len, int nlimbs)
+{
+	int i, bit, limb, shift;
+	BignumInt v;
+
+	for (i = 0; i < len; i++) {
+		bit = i * BIGNUM_INT_BITS;
+		v = 0;
+		/* A word spans at most three limbs. */
+		for (limb = bit / LIMB_BITS;
+			limb < nlimbs && limb * LIMB_BITS < bit + BIGNUM_INT_BITS; limb++) {
+			shift = limb * LIMB_BITS - bit;
+			if (shift >= 0)
+				v |= src[limb] << shift;
+			else
+				v |= src[limb] >> -shift;
+		}
+		dst[len - 1 - i] = v;
+	}
+}
+
+/*
+* Set r = a * b * 2^(-52*nlimbs) mod n. a and b must be less than n,
+* and the result is too. k0 is -n^{-1} mod 2^52. r may be the same
+* array as a or b.
+*
+* This is the usual word-by-word Montgomery multiplication, with each
+* row done eight limbs at a time: for each limb b_i we add a * b_i and
+* then a multiple m * n chosen so the bottom limb becomes zero, and
+* shift down a limb. The low halves of the products go in before the
+* shift and the high halves, which belong one limb further up, after
+* it. The lanes aren't normalised back to 52 bits until the end; each
+* row adds less than 2^54 to a lane, so with at most IFMA_MAX_LIMBS
+* rows they can't overflow.
+*
+* The result is less than 2n before the final subtraction, and the
+* subtraction is done with a mask, so the time taken doesn't depend
+* on the inputs.
+*/
+IFMA_TARGET
+void ifma_monty_mul(BignumInt *r, const BignumInt *a, const BignumInt *b,
+	const BignumInt *n, BignumInt k0, int nlimbs)
+{
+	__m512i acc[IFMA_MAX_LIMBS / 8], av[IFMA_MAX_LIMBS / 8];
+	__m512i nv[IFMA_MAX_LIMBS / 8];
+	BignumInt t[IFMA_MAX_LIMBS], d[IFMA_MAX_LIMBS];
+	BignumInt carry, borrow, m, mask;
+	int nvec = nlimbs / 8, i, j;
+
+	for (j = 0; j < nvec; j++) {
+		acc[j] = _mm512_setzero_si512();
+		av[j] = _mm512_loadu_si512((const void *)(a + 8 * j));
+		nv[j] = _mm512_loadu_si512((const void *)(n + 8 * j));
+	}
+
+	for (i = 0; i < nlimbs; i++) {
+		__m512i bi = _mm512_set1_epi64((long long)b[i]);
+		__m512i mv;
+		BignumInt lane0;
+
+		for (j = 0; j < nvec; j++)
+			acc[j] = _mm512_madd52lo_epu64(acc[j], av[j], bi);
+
+		lane0 = (BignumInt)_mm_cvtsi128_si64(_mm512_castsi512_si128(acc[0]));
+		m = (lane0 * k0) & LIMB_MASK;
+		mv = _mm512_set1_epi64((long long)m);
+
+		for (j = 0; j < nvec; j++)
+			acc[j] = _mm512_madd52lo_epu64(acc[j], nv[j], mv);
+
+		/* The bottom limb is now a multiple of 2^52: shift it out,
+		* carrying what's above those 52 bits into the next limb. */
+		lane0 = (BignumInt)_mm_cvtsi128_si64(_mm512_castsi512_si128(acc[0]));
+		carry = lane0 >> LIMB_BITS;
+		for (j = 0; j < nvec - 1; j++)
+			acc[j] = _mm512_alignr_epi64(acc[j + 1], acc[j], 1);
+		acc[nvec - 1] = _mm512_alignr_epi64(_mm512_setzero_si512(),
+			acc[nvec - 1], 1);
+		acc[0] = _mm512_mask_add_epi64(acc[0], 1, acc[0],
+			_mm512_set1_epi64((long long)carry));
+
+		for (j = 0; j < nvec; j++) {
+			acc[j] = _mm512_madd52hi_epu64(acc[j], av[j], bi);
+			acc[j] = _mm512_madd52hi_epu64(acc[j], nv[j], mv);
+		}
+	}
+
+	for (j = 0; j < nvec; j++)
+		_mm512_storeu_si512((void *)(t + 8 * j), acc[j]);
+
+	/* Normalise to 52-bit limbs. */
+	carry = 0;
+	for (i = 0; i < nlimbs; i++) {
+		t[i] += carry;
+		carry = t[i] >> LIMB_BITS;
+		t[i] &= LIMB_MASK;
+	}
+
+	/* Subtract n if the result is at least n. */
+	borrow = 0;
+	for (i = 0; i < nlimbs; i++) {
+		d[i] = t[i] - n[i] - borrow;
+		borrow = d[i] >> (BIGNUM_INT_BITS - 1);
+		d[i] &= LIMB_MASK;
+	}
+	mask = borrow - 1;                 /* all ones if no borrow */
+	for (i = 0; i < nlimbs; i++)
+		r[i] = (d[i] & mask) | (t[i] & ~mask);
+
+	smemclr(t, sizeof(t));
+	smemclr(d, sizeof(d));
+}
+
+#endif /* BIGNUM_IFMA */
@@ -0,0 +1,104 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* The x86-64 CPU feature checks shared by the SHA, AES and bignum
+* vector code. CPUID and XCR0 are read the first time anyone asks,
+* and the answers kept for the life of the process.
+*/
+
+#include "ssh.h"
+
+#if defined __x86_64__ || defined _M_AMD64
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+struct CpuFeatures {
+	unsigned int ecx1;		       /* CPUID.1:ECX */
+	unsigned int ebx7;		       /* CPUID.7.0:EBX */
+	unsigned long long xcr0;	       /* 0 if the OS hasn't enabled XSAVE */
+};
+
+static struct CpuFeatures cpu_read_features(void)
+{
+	struct CpuFeatures f = { 0, 0, 0 };
+
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] >= 7) {
+		__cpuidex(regs, 7, 0);
+		f.ebx7 = regs[1];
+	}
+	__cpuid(regs, 1);
+	f.ecx1 = regs[2];
+#else
+	unsigned int a, b, c, d;
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, a, b, c, d);
+		f.ebx7 = b;
+	}
+	if (__get_cpuid(1, &a, &b, &c, &d))
+		f.ecx1 = c;
+#endif
+
+	if (f.ecx1 & (1U << 27)) {	       /* OSXSAVE */
+#ifdef _MSC_VER
+		f.xcr0 = _xgetbv(0);
+#else
+		unsigned int lo, hi;
+		__asm__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+		f.xcr0 = ((unsigned long long)hi << 32) | lo;
+#endif
+	}
+	return f;
+}
+
+/*
+* The features, read once. A function-local static is initialised
+* exactly once even when several threads get here together.
+*/
+static const struct CpuFeatures &cpu_features(void)
+{
+	static const struct CpuFeatures features = cpu_read_features();
+	return features;
+}
+
+void cpu_cpuid(unsigned int *ecx1, unsigned int *ebx7)
+{
+	const struct CpuFeatures &f = cpu_features();
+
+	*ecx1 = f.ecx1;
+	*ebx7 = f.ebx7;
+}
+
+int cpu_xsave_features(unsigned int *ebx7, unsigned long long *xcr0)
+{
+	const struct CpuFeatures &f = cpu_features();
+
+	if (!(f.ecx1 & (1U << 27))) {	       /* OSXSAVE */
+		*ebx7 = 0;
+		*xcr0 = 0;
+		return 0;
+	}
+	*ebx7 = f.ebx7;
+	*xcr0 = f.xcr0;
+	return 1;
+}
+
+int cpu_has_avx2(void)
+{
+	unsigned int b7;
+	unsigned long long xcr0;
+
+	if (!cpu_xsave_features(&b7, &xcr0))
+		return 0;
+	/* XMM and YMM state, and AVX2, which is CPUID.7.0:EBX bit 5 */
+	return (xcr0 & 0x06) == 0x06 && (b7 & (1U << 5)) != 0;
+}
+
+#endif
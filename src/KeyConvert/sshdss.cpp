@@ -14,30 +14,34 @@
 
 static void sha_mpint(SHA_State * s, Bignum b)
 {
-    unsigned char lenbuf[4];
-    int len;
+    unsigned char buf[64];
+    int len, n;
     len = (bignum_bitcount(b) + 8) / 8;
-    PUT_32BIT(lenbuf, len);
-    SHA_Bytes(s, lenbuf, 4);
-    while (len-- > 0) {
-        lenbuf[0] = bignum_byte(b, len);
-        SHA_Bytes(s, lenbuf, 1);
+    PUT_32BIT(buf, len);
+    SHA_Bytes(s, buf, 4);
+    while (len > 0) {
+        n = len < (int)sizeof(buf) ? len : (int)sizeof(buf);
+        len -= n;
+        bignum_to_bytes(b, len, buf, n);
+        SHA_Bytes(s, buf, n);
     }
-    smemclr(lenbuf, sizeof(lenbuf));
+    smemclr(buf, sizeof(buf));
 }
 
 static void sha512_mpint(SHA512_State * s, Bignum b)
 {
-    unsigned char lenbuf[4];
-    int len;
+    unsigned char buf[128];
+    int len, n;
     len = (bignum_bitcount(b) + 8) / 8;
-    PUT_32BIT(lenbuf, len);
-    SHA512_Bytes(s, lenbuf, 4);
-    while (len-- > 0) {
-        lenbuf[0] = bignum_byte(b, len);
-        SHA512_Bytes(s, lenbuf, 1);
+    PUT_32BIT(buf, len);
+    SHA512_Bytes(s, buf, 4);
+    while (len > 0) {
+        n = len < (int)sizeof(buf) ? len : (int)sizeof(buf);
+        len -= n;
+        bignum_to_bytes(b, len, buf, n);
+        SHA512_Bytes(s, buf, n);
     }
-    smemclr(lenbuf, sizeof(lenbuf));
+    smemclr(buf, sizeof(buf));
 }
 
 static void getstring(char **data, int *datalen, char **p, int *length)
@@ -115,6 +119,9 @@ static void *dss_newkey(char *data, int len)
     dss->g = getmp(&data, &len);
     dss->y = getmp(&data, &len);
     dss->x = NULL;
+    dss->monty_p = NULL;
+    dss->comb_g = NULL;
+    dss->lock = ssh_lock_new();
 
     if (!dss->p || !dss->q || !dss->g || !dss->y ||
         !bignum_cmp(dss->q, Zero) || !bignum_cmp(dss->p, Zero)) {
@@ -139,9 +146,66 @@ static void dss_freekey(void *key)
         freebn(dss->y);
     if (dss->x)
         freebn(dss->x);
+    monty_comb_free(dss->comb_g);
+    monty_free(dss->monty_p);
+    ssh_lock_free(dss->lock);
     sfree(dss);
 }
 
+/*
+* Arithmetic mod p, using a Montgomery context cached on the key so
+* that it is only set up once however many signatures are made or
+* checked. If p is even (which no valid key has, but we may be asked
+* to verify one) there is no such context, and we fall back to the
+* plain routines. The context is set up under the key's lock, since
+* several threads may be using the key at once; once made, it doesn't
+* change.
+*/
+static MontyContext *dss_monty(struct dss_key *dss)
+{
+    MontyContext *mc;
+
+    ssh_lock(dss->lock);
+    if (!dss->monty_p)
+        dss->monty_p = monty_new(dss->p);
+    mc = dss->monty_p;
+    ssh_unlock(dss->lock);
+    return mc;
+}
+
+/*
+* g^u1 * y^u2 mod p, for the public u1 and u2 of a signature check,
+* in one pass (see monty_dual_modpow).
+*/
+static Bignum dss_verify_pow(struct dss_key *dss, Bignum u1, Bignum u2)
+{
+    MontyContext *mc = dss_monty(dss);
+    if (!mc)
+        return dual_modpow(dss->g, u1, dss->y, u2, dss->p);
+    return monty_dual_modpow(mc, dss->g, u1, dss->y, u2);
+}
+
+/*
+* g^exp mod p, for a secret exp (x, or a signing nonce), both less
+* than q. g is the same every time, so this uses a comb table for it
+* (see monty_comb_new), made the first time, under the key's lock,
+* and kept on the key.
+*/
+static Bignum dss_gpow(struct dss_key *dss, Bignum exp)
+{
+    MontyContext *mc = dss_monty(dss);
+    MontyComb *comb;
+
+    if (!mc)
+        return modpow(dss->g, exp, dss->p);
+    ssh_lock(dss->lock);
+    if (!dss->comb_g)
+        dss->comb_g = monty_comb_new(mc, dss->g, bignum_bitcount(dss->q));
+    comb = dss->comb_g;
+    ssh_unlock(dss->lock);
+    return monty_comb_modpow(comb, exp);
+}
+
 static char *dss_fmtkey(void *key)
 {
     struct dss_key *dss = (struct dss_key *) key;
@@ -236,7 +300,7 @@ static int dss_verifysig(void *key, char *sig, int siglen,
     char *p;
     int slen;
     char hash[20];
-    Bignum r, s, w, gu1p, yu2p, gu1yu2p, u1, u2, sha, v;
+    Bignum r, s, w, gu1yu2p, u1, u2, sha, v;
     int ret;
 
     if (!dss->p)
@@ -312,9 +376,7 @@ static int dss_verifysig(void *key, char *sig, int siglen,
     /*
     * Step 4. v <- (g^u1 * y^u2 mod p) mod q.
     */
-    gu1p = modpow(dss->g, u1, dss->p);
-    yu2p = modpow(dss->y, u2, dss->p);
-    gu1yu2p = modmul(gu1p, yu2p, dss->p);
+    gu1yu2p = dss_verify_pow(dss, u1, u2);
     v = modmul(gu1yu2p, One, dss->q);
 
     /*
@@ -327,8 +389,6 @@ static int dss_verifysig(void *key, char *sig, int siglen,
     freebn(sha);
     freebn(u1);
     freebn(u2);
-    freebn(gu1p);
-    freebn(yu2p);
     freebn(gu1yu2p);
     freebn(v);
     freebn(r);
@@ -341,7 +401,6 @@ static unsigned char *dss_public_blob(void *key, int *len)
 {
     struct dss_key *dss = (struct dss_key *) key;
     int plen, qlen, glen, ylen, bloblen;
-    int i;
     unsigned char *blob, *p;
 
     plen = (bignum_bitcount(dss->p) + 8) / 8;
@@ -362,20 +421,20 @@ static unsigned char *dss_public_blob(void *key, int *len)
     p += 7;
     PUT_32BIT(p, plen);
     p += 4;
-    for (i = plen; i--;)
-        *p++ = bignum_byte(dss->p, i);
+    bignum_to_bytes(dss->p, 0, p, plen);
+    p += plen;
     PUT_32BIT(p, qlen);
     p += 4;
-    for (i = qlen; i--;)
-        *p++ = bignum_byte(dss->q, i);
+    bignum_to_bytes(dss->q, 0, p, qlen);
+    p += qlen;
     PUT_32BIT(p, glen);
     p += 4;
-    for (i = glen; i--;)
-        *p++ = bignum_byte(dss->g, i);
+    bignum_to_bytes(dss->g, 0, p, glen);
+    p += glen;
     PUT_32BIT(p, ylen);
     p += 4;
-    for (i = ylen; i--;)
-        *p++ = bignum_byte(dss->y, i);
+    bignum_to_bytes(dss->y, 0, p, ylen);
+    p += ylen;
     assert(p == blob + bloblen);
     *len = bloblen;
     return blob;
@@ -385,7 +444,6 @@ static unsigned char *dss_private_blob(void *key, int *len)
 {
     struct dss_key *dss = (struct dss_key *) key;
     int xlen, bloblen;
-    int i;
     unsigned char *blob, *p;
 
     xlen = (bignum_bitcount(dss->x) + 8) / 8;
@@ -398,8 +456,8 @@ static unsigned char *dss_private_blob(void *key, int *len)
     p = blob;
     PUT_32BIT(p, xlen);
     p += 4;
-    for (i = xlen; i--;)
-        *p++ = bignum_byte(dss->x, i);
+    bignum_to_bytes(dss->x, 0, p, xlen);
+    p += xlen;
     assert(p == blob + bloblen);
     *len = bloblen;
     return blob;
@@ -445,7 +503,7 @@ static void *dss_createkey(unsigned char *pub_blob, int pub_len,
     /*
     * Now ensure g^x mod p really is y.
     */
-    ytest = modpow(dss->g, dss->x, dss->p);
+    ytest = dss_gpow(dss, dss->x);
     if (0 != bignum_cmp(ytest, dss->y)) {
         dss_freekey(dss);
         freebn(ytest);
@@ -468,6 +526,9 @@ static void *dss_openssh_createkey(unsigned char **blob, int *len)
     dss->g = getmp(b, len);
     dss->y = getmp(b, len);
     dss->x = getmp(b, len);
+    dss->monty_p = NULL;
+    dss->comb_g = NULL;
+    dss->lock = ssh_lock_new();
 
     if (!dss->p || !dss->q || !dss->g || !dss->y || !dss->x ||
         !bignum_cmp(dss->q, Zero) || !bignum_cmp(dss->p, Zero)) {
@@ -496,8 +557,9 @@ static int dss_openssh_fmtkey(void *key, unsigned char *blob, int len)
 
     bloblen = 0;
 #define ENC(x) \
-    PUT_32BIT(blob+bloblen, ssh2_bignum_length((x))-4); bloblen += 4; \
-    for (i = ssh2_bignum_length((x))-4; i-- ;) blob[bloblen++]=bignum_byte((x),i);
+    i = ssh2_bignum_length((x))-4; \
+    PUT_32BIT(blob+bloblen, i); bloblen += 4; \
+    bignum_to_bytes((x), 0, blob+bloblen, i); bloblen += i;
     ENC(dss->p);
     ENC(dss->q);
     ENC(dss->g);
@@ -521,7 +583,25 @@ static int dss_pubkey_bits(void *blob, int len)
     return ret;
 }
 
-static unsigned char *dss_sign(void *key, char *data, int datalen, int *siglen)
+/*
+* Hash some identifying text plus x, for the first stage of making
+* k in dss_sign_with. This only depends on the key, so several
+* signatures can share it.
+*/
+static void dss_x_digest(struct dss_key *dss, unsigned char *digest512)
+{
+    SHA512_State ss;
+
+    SHA512_Init(&ss);
+    SHA512_Bytes(&ss, "DSA deterministic k generator", 30);
+    sha512_mpint(&ss, dss->x);
+    SHA512_Final(&ss, digest512);
+    smemclr(&ss, sizeof(ss));
+}
+
+static unsigned char *dss_sign_with(struct dss_key *dss,
+                                    const unsigned char *xdigest,
+                                    char *data, int datalen, int *siglen)
 {
     /*
     * The basic DSS signing algorithm is:
@@ -594,28 +674,19 @@ static unsigned char *dss_sign(void *key, char *data, int datalen, int *siglen)
     * Computer Security Group for helping to argue out all the
     * fine details.
     */
-    struct dss_key *dss = (struct dss_key *) key;
     SHA512_State ss;
     unsigned char digest[20], digest512[64];
     Bignum proto_k, k, gkp, hash, kinv, hxr, r, s;
     unsigned char *bytes;
-    int nbytes, i;
+    int nbytes;
 
     SHA_Simple(data, datalen, digest);
 
     /*
-    * Hash some identifying text plus x.
+    * Hash the digest of x (from dss_x_digest) plus the message hash.
     */
     SHA512_Init(&ss);
-    SHA512_Bytes(&ss, "DSA deterministic k generator", 30);
-    sha512_mpint(&ss, dss->x);
-    SHA512_Final(&ss, digest512);
-
-    /*
-    * Now hash that digest plus the message hash.
-    */
-    SHA512_Init(&ss);
-    SHA512_Bytes(&ss, digest512, sizeof(digest512));
+    SHA512_Bytes(&ss, xdigest, 64);
     SHA512_Bytes(&ss, digest, sizeof(digest));
 
     while (1) {
@@ -649,7 +720,7 @@ static unsigned char *dss_sign(void *key, char *data, int datalen, int *siglen)
     /*
     * Now we have k, so just go ahead and compute the signature.
     */
-    gkp = modpow(dss->g, k, dss->p);   /* g^k mod p */
+    gkp = dss_gpow(dss, k);                    /* g^k mod p */
     r = bigmod(gkp, dss->q);	       /* r = (g^k mod p) mod q */
     freebn(gkp);
 
@@ -674,10 +745,8 @@ static unsigned char *dss_sign(void *key, char *data, int datalen, int *siglen)
     PUT_32BIT(bytes, 7);
     memcpy(bytes + 4, "ssh-dss", 7);
     PUT_32BIT(bytes + 4 + 7, 40);
-    for (i = 0; i < 20; i++) {
-        bytes[4 + 7 + 4 + i] = bignum_byte(r, 19 - i);
-        bytes[4 + 7 + 4 + 20 + i] = bignum_byte(s, 19 - i);
-    }
+    bignum_to_bytes(r, 0, bytes + 4 + 7 + 4, 20);
+    bignum_to_bytes(s, 0, bytes + 4 + 7 + 4 + 20, 20);
     freebn(r);
     freebn(s);
 
@@ -685,6 +754,35 @@ static unsigned char *dss_sign(void *key, char *data, int datalen, int *siglen)
     return bytes;
 }
 
+static unsigned char *dss_sign(void *key, char *data, int datalen, int *siglen)
+{
+    struct dss_key *dss = (struct dss_key *) key;
+    unsigned char xdigest[64], *sig;
+
+    dss_x_digest(dss, xdigest);
+    sig = dss_sign_with(dss, xdigest, data, datalen, siglen);
+    smemclr(xdigest, sizeof(xdigest));
+    return sig;
+}
+
+/*
+* Signing several messages with one key: the hash of x that goes
+* into each k is only computed once.
+*/
+static void dss_sign_batch(void *key, int nmsgs, char **data, int *datalens,
+                           unsigned char **sigs, int *siglens)
+{
+    struct dss_key *dss = (struct dss_key *) key;
+    unsigned char xdigest[64];
+    int i;
+
+    dss_x_digest(dss, xdigest);
+    for (i = 0; i < nmsgs; i++)
+        sigs[i] = dss_sign_with(dss, xdigest, data[i], datalens[i],
+                                &siglens[i]);
+    smemclr(xdigest, sizeof(xdigest));
+}
+
 const struct ssh_signkey ssh_dss = {
     dss_newkey,
     dss_freekey,
@@ -698,6 +796,7 @@ const struct ssh_signkey ssh_dss = {
     dss_fingerprint,
     dss_verifysig,
     dss_sign,
+    dss_sign_batch,
     "ssh-dss",
     "dss"
 };
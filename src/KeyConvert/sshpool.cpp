@@ -0,0 +1,164 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* A pool of one worker thread, so that two independent pieces of work
+* (such as the two halves of an RSA private key operation) can run at
+* the same time as each other: one on the worker, one on the caller.
+*
+* The pool is off until ssh_pool_start() is called; until then, and
+* whenever the worker is already busy for another caller, the work is
+* simply done one piece after the other on the calling thread.
+*/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+
+#include "misc.h"
+#include "ssh.h"
+
+struct SshPool {
+	std::mutex lock;
+	std::condition_variable wake;      /* worker: a job or quit is waiting */
+	std::condition_variable done;      /* caller: the job has finished */
+	std::thread thread;
+	void(*fn)(void *);		       /* the job, or NULL */
+	void *ctx;
+	bool busy;			       /* a caller has a job in the pool */
+	bool quit;
+};
+
+static SshPool *pool;
+
+static void pool_worker(SshPool *p)
+{
+	std::unique_lock<std::mutex> g(p->lock);
+
+	while (1) {
+		p->wake.wait(g, [p] { return p->fn != NULL || p->quit; });
+		if (p->fn) {
+			void(*fn)(void *) = p->fn;
+			void *ctx = p->ctx;
+
+			g.unlock();
+			fn(ctx);
+			g.lock();
+			p->fn = NULL;
+			p->done.notify_one();
+		}
+		else {
+			break;
+		}
+	}
+	g.unlock();
+
+	bn_arena_cleanup();
+}
+
+/*
+* Start the worker thread. Returns 0 if it couldn't be started, in
+* which case everything still works, on one thread. Neither this nor
+* ssh_pool_stop may be called while another thread is using the pool.
+*/
+int ssh_pool_start(void)
+{
+	SshPool *p;
+
+	if (pool)
+		return 1;
+
+	p = new SshPool;
+	p->fn = NULL;
+	p->ctx = NULL;
+	p->busy = false;
+	p->quit = false;
+	try {
+		p->thread = std::thread(pool_worker, p);
+	}
+	catch (const std::system_error &) {
+		delete p;
+		return 0;
+	}
+	pool = p;
+	return 1;
+}
+
+void ssh_pool_stop(void)
+{
+	SshPool *p = pool;
+
+	if (!p)
+		return;
+	pool = NULL;
+	{
+		std::lock_guard<std::mutex> g(p->lock);
+		p->quit = true;
+	}
+	p->wake.notify_one();
+	p->thread.join();
+	delete p;
+}
+
+/*
+* Call fa(ca) and fb(cb), on two threads if the worker is free, and
+* return when both have finished. fb always runs on the calling thread.
+*/
+void ssh_pool_run2(void(*fa)(void *), void *ca, void(*fb)(void *), void *cb)
+{
+	SshPool *p = pool;
+	bool queued = false;
+
+	if (p) {
+		std::lock_guard<std::mutex> g(p->lock);
+		if (!p->busy) {
+			p->busy = true;
+			p->fn = fa;
+			p->ctx = ca;
+			queued = true;
+		}
+	}
+
+	if (queued)
+		p->wake.notify_one();
+	else
+		fa(ca);
+
+	fb(cb);
+
+	if (queued) {
+		std::unique_lock<std::mutex> g(p->lock);
+		p->done.wait(g, [p] { return p->fn == NULL; });
+		p->busy = false;
+	}
+}
+
+/*
+* Locks, for state kept on a key that more than one thread may use
+* at once (see struct RSAKey). They live here for the same reason as
+* the pool: <mutex> isn't available to managed code.
+*/
+struct SshLock {
+	std::mutex m;
+};
+
+SshLock *ssh_lock_new(void)
+{
+	return new SshLock;
+}
+
+void ssh_lock_free(SshLock *l)
+{
+	delete l;
+}
+
+void ssh_lock(SshLock *l)
+{
+	l->m.lock();
+}
+
+void ssh_unlock(SshLock *l)
+{
+	l->m.unlock();
+}
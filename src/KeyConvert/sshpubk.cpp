@@ -34,32 +34,125 @@ void base64_encode(FILE * fp, unsigned char *data, int datalen, int cpl)
 	fputc('\n', fp);
 }
 
-//1010
-int ssh2_save_userkey(const Filename *filename, struct ssh2_userkey *key,
-	char *passphrase)
+/*
+* As base64_encode, but into a buffer, which must have room for
+* 4*((datalen+2)/3) characters plus one newline per output line.
+* Returns the number of characters written; no terminating NUL.
+*/
+int base64_encode_buf(char *out, unsigned char *data, int datalen, int cpl)
 {
-	FILE *fp;
+	char *p = out;
+	int linelen = 0;
+	char atom[4];
+	int n, i;
+
+	while (datalen > 0) {
+		n = (datalen < 3 ? datalen : 3);
+		base64_encode_atom(data, n, atom);
+		data += n;
+		datalen -= n;
+		for (i = 0; i < 4; i++) {
+			if (linelen >= cpl) {
+				linelen = 0;
+				*p++ = '\n';
+			}
+			*p++ = atom[i];
+			linelen++;
+		}
+	}
+	*p++ = '\n';
+	return p - out;
+}
+
+//1010
+/*
+* The parts of one key's PuTTY-User-Key-File-2 that are worked out
+* before its text is produced.
+*/
+struct ppk_parts {
 	unsigned char *pub_blob, *priv_blob, *priv_blob_encrypted;
 	int pub_blob_len, priv_blob_len, priv_encrypted_len;
-	int passlen;
-	int cipherblk;
-	int i;
-	char *cipherstr;
+	unsigned char *macdata;
+	int maclen;
 	unsigned char priv_mac[20];
+};
+
+/*
+* Write out the text of the file, once the private blob is encrypted
+* and the MAC is known.
+*/
+static char *ppk_text(struct ssh2_userkey *key, char *cipherstr,
+	struct ppk_parts *pp, int *len)
+{
+	char *text, *q;
+	int textsize;
+	int i;
 
 	/*
-	* Fetch the key component blobs.
+	* Work out how much text we will produce: the fixed header text,
+	* the variable fields, and the two base64 sections with their
+	* line breaks. The constant covers the field names (about 100
+	* characters), the two line counts and the 40-digit MAC.
 	*/
-	pub_blob = key->alg->public_blob(key->data, &pub_blob_len);
-	priv_blob = key->alg->private_blob(key->data, &priv_blob_len);
-	if (!pub_blob || !priv_blob) {
-		sfree(pub_blob);
-		sfree(priv_blob);
-		return 0;
-	}
+	textsize = (256 + strlen(key->alg->name) + strlen(cipherstr) +
+		strlen(key->comment) +
+		4 * ((pp->pub_blob_len + 2) / 3) + base64_lines(pp->pub_blob_len) +
+		4 * ((pp->priv_encrypted_len + 2) / 3) +
+		base64_lines(pp->priv_encrypted_len));
+	text = snewn(textsize, char);
+
+	q = text;
+	q += sprintf(q, "PuTTY-User-Key-File-2: %s\n", key->alg->name);
+	q += sprintf(q, "Encryption: %s\n", cipherstr);
+	q += sprintf(q, "Comment: %s\n", key->comment);
+	q += sprintf(q, "Public-Lines: %d\n", base64_lines(pp->pub_blob_len));
+	q += base64_encode_buf(q, pp->pub_blob, pp->pub_blob_len, 64);
+	q += sprintf(q, "Private-Lines: %d\n",
+		base64_lines(pp->priv_encrypted_len));
+	q += base64_encode_buf(q, pp->priv_blob_encrypted,
+		pp->priv_encrypted_len, 64);
+	q += sprintf(q, "Private-MAC: ");
+	for (i = 0; i < 20; i++)
+		q += sprintf(q, "%02x", pp->priv_mac[i]);
+	q += sprintf(q, "\n");
+	assert(q - text < textsize);
+
+	*len = q - text;
+	return text;
+}
+
+/*
+* Produce the text of a PuTTY-User-Key-File-2 for each of n keys, all
+* with the same passphrase. texts[i] is set to a NUL-terminated
+* dynamically allocated string, whose length (not counting the NUL) is
+* stored in lens[i], or to NULL if keys[i] couldn't be saved. Returns
+* the number of keys saved. The caller should smemclr each text before
+* freeing it, since it holds the private key.
+*
+* The keys go through each stage together, so that the SHA-1 padding
+* hashes and MACs can be worked out for all of them at once by
+* SHA_Simple_multi and hmacsha1_do_hmac_multi.
+*/
+int ssh2_save_userkeys_mem(int n, struct ssh2_userkey **keys,
+	char *passphrase, char **texts, int *lens)
+{
+	struct ppk_parts *parts, *pp;
+	const void **hashin;
+	unsigned char **hashout;
+	int *hashlen;
+	int passlen;
+	int cipherblk;
+	int i, ngood, nsaved;
+	char *cipherstr;
+
+	parts = snewn(n, struct ppk_parts);
+	memset(parts, 0, n * sizeof(struct ppk_parts));
+	hashin = snewn(n, const void *);
+	hashout = snewn(n, unsigned char *);
+	hashlen = snewn(n, int);
 
 	/*
-	* Determine encryption details, and encrypt the private blob.
+	* Determine encryption details.
 	*/
 	if (passphrase) {
 		cipherstr = "aes256-cbc";
@@ -69,52 +162,102 @@ int ssh2_save_userkey(const Filename *filename, struct ssh2_userkey *key,
 		cipherstr = "none";
 		cipherblk = 1;
 	}
-	priv_encrypted_len = priv_blob_len + cipherblk - 1;
-	priv_encrypted_len -= priv_encrypted_len % cipherblk;
-	priv_blob_encrypted = snewn(priv_encrypted_len, unsigned char);
-	memset(priv_blob_encrypted, 0, priv_encrypted_len);
-	memcpy(priv_blob_encrypted, priv_blob, priv_blob_len);
+
+	/*
+	* Fetch the key component blobs, and make room for the encrypted
+	* private blob.
+	*/
+	ngood = 0;
+	for (i = 0; i < n; i++) {
+		pp = &parts[i];
+		texts[i] = NULL;
+		lens[i] = 0;
+		pp->pub_blob = keys[i]->alg->public_blob(keys[i]->data,
+			&pp->pub_blob_len);
+		pp->priv_blob = keys[i]->alg->private_blob(keys[i]->data,
+			&pp->priv_blob_len);
+		if (!pp->pub_blob || !pp->priv_blob) {
+			sfree(pp->pub_blob);
+			sfree(pp->priv_blob);
+			pp->pub_blob = pp->priv_blob = NULL;
+			continue;
+		}
+
+		pp->priv_encrypted_len = pp->priv_blob_len + cipherblk - 1;
+		pp->priv_encrypted_len -= pp->priv_encrypted_len % cipherblk;
+		pp->priv_blob_encrypted = snewn(pp->priv_encrypted_len,
+			unsigned char);
+		memset(pp->priv_blob_encrypted, 0, pp->priv_encrypted_len);
+		memcpy(pp->priv_blob_encrypted, pp->priv_blob, pp->priv_blob_len);
+
+		hashin[ngood] = pp->priv_blob;
+		hashlen[ngood] = pp->priv_blob_len;
+		hashout[ngood] = pp->priv_mac;
+		ngood++;
+	}
+
 	/* Create padding based on the SHA hash of the unpadded blob. This prevents
 	* too easy a known-plaintext attack on the last block. */
-	SHA_Simple(priv_blob, priv_blob_len, priv_mac);
-	assert(priv_encrypted_len - priv_blob_len < 20);
-	memcpy(priv_blob_encrypted + priv_blob_len, priv_mac,
-		priv_encrypted_len - priv_blob_len);
+	SHA_Simple_multi(ngood, hashin, hashlen, hashout);
+	for (i = 0; i < n; i++) {
+		pp = &parts[i];
+		if (!pp->priv_blob)
+			continue;
+		assert(pp->priv_encrypted_len - pp->priv_blob_len < 20);
+		memcpy(pp->priv_blob_encrypted + pp->priv_blob_len, pp->priv_mac,
+			pp->priv_encrypted_len - pp->priv_blob_len);
+	}
 
-	/* Now create the MAC. */
+	/* Now create the MACs. */
 	{
-		unsigned char *macdata;
-		int maclen;
 		unsigned char *p;
-		int namelen = strlen(key->alg->name);
 		int enclen = strlen(cipherstr);
-		int commlen = strlen(key->comment);
 		SHA_State s;
+		void *ctx;
 		unsigned char mackey[20];
 		char header[] = "putty-private-key-file-mac-key";
 
-		maclen = (4 + namelen +
-			4 + enclen +
-			4 + commlen +
-			4 + pub_blob_len +
-			4 + priv_encrypted_len);
-		macdata = snewn(maclen, unsigned char);
-		p = macdata;
+		ngood = 0;
+		for (i = 0; i < n; i++) {
+			int namelen, commlen;
+
+			pp = &parts[i];
+			if (!pp->priv_blob)
+				continue;
+
+			namelen = strlen(keys[i]->alg->name);
+			commlen = strlen(keys[i]->comment);
+			pp->maclen = (4 + namelen +
+				4 + enclen +
+				4 + commlen +
+				4 + pp->pub_blob_len +
+				4 + pp->priv_encrypted_len);
+			pp->macdata = snewn(pp->maclen, unsigned char);
+			p = pp->macdata;
 #define DO_STR(s,len) PUT_32BIT(p,(len));memcpy(p+4,(s),(len));p+=4+(len)
-		DO_STR(key->alg->name, namelen);
-		DO_STR(cipherstr, enclen);
-		DO_STR(key->comment, commlen);
-		DO_STR(pub_blob, pub_blob_len);
-		DO_STR(priv_blob_encrypted, priv_encrypted_len);
+			DO_STR(keys[i]->alg->name, namelen);
+			DO_STR(cipherstr, enclen);
+			DO_STR(keys[i]->comment, commlen);
+			DO_STR(pp->pub_blob, pp->pub_blob_len);
+			DO_STR(pp->priv_blob_encrypted, pp->priv_encrypted_len);
+
+			hashin[ngood] = pp->macdata;
+			hashlen[ngood] = pp->maclen;
+			hashout[ngood] = pp->priv_mac;
+			ngood++;
+		}
 
 		SHA_Init(&s);
 		SHA_Bytes(&s, header, sizeof(header) - 1);
 		if (passphrase)
 			SHA_Bytes(&s, passphrase, strlen(passphrase));
 		SHA_Final(&s, mackey);
-		hmac_sha1_simple(mackey, 20, macdata, maclen, priv_mac);
-		smemclr(macdata, maclen);
-		sfree(macdata);
+		ctx = hmacsha1_make_context();
+		hmacsha1_key(ctx, mackey, 20);
+		hmacsha1_do_hmac_multi(ctx, ngood,
+			(unsigned char const *const *)hashin, hashlen, hashout);
+		hmacsha1_free_context(ctx);
+
 		smemclr(mackey, sizeof(mackey));
 		smemclr(&s, sizeof(s));
 	}
@@ -133,41 +276,115 @@ int ssh2_save_userkey(const Filename *filename, struct ssh2_userkey *key,
 		SHA_Bytes(&s, "\0\0\0\1", 4);
 		SHA_Bytes(&s, passphrase, passlen);
 		SHA_Final(&s, key + 20);
-		aes256_encrypt_pubkey(key, priv_blob_encrypted,
-			priv_encrypted_len);
+		for (i = 0; i < n; i++) {
+			pp = &parts[i];
+			if (pp->priv_blob)
+				aes256_encrypt_pubkey(key, pp->priv_blob_encrypted,
+					pp->priv_encrypted_len);
+		}
 
 		smemclr(key, sizeof(key));
 		smemclr(&s, sizeof(s));
 	}
 
+	nsaved = 0;
+	for (i = 0; i < n; i++) {
+		pp = &parts[i];
+		if (!pp->priv_blob)
+			continue;
+
+		texts[i] = ppk_text(keys[i], cipherstr, pp, &lens[i]);
+		nsaved++;
+
+		sfree(pp->pub_blob);
+		smemclr(pp->priv_blob, pp->priv_blob_len);
+		sfree(pp->priv_blob);
+		smemclr(pp->priv_blob_encrypted, pp->priv_encrypted_len);
+		sfree(pp->priv_blob_encrypted);
+		smemclr(pp->macdata, pp->maclen);
+		sfree(pp->macdata);
+	}
+
+	smemclr(parts, n * sizeof(struct ppk_parts));
+	sfree(parts);
+	sfree(hashin);
+	sfree(hashout);
+	sfree(hashlen);
+
+	return nsaved;
+}
+
+/*
+* Produce the text of a PuTTY-User-Key-File-2 for one key. Returns a
+* NUL-terminated dynamically allocated string, whose length (not
+* counting the NUL) is stored in *len, or NULL on failure. The caller
+* should smemclr it before freeing, since it holds the private key.
+*/
+char *ssh2_save_userkey_mem(struct ssh2_userkey *key, char *passphrase,
+	int *len)
+{
+	char *text;
+
+	ssh2_save_userkeys_mem(1, &key, passphrase, &text, len);
+	return text;
+}
+
+static int write_ppk_file(const Filename *filename, char *text, int len)
+{
+	FILE *fp;
+	int ret;
+
+	ret = 0;
 	fp = f_open(filename, "w", TRUE);
-	if (!fp) {
-		sfree(pub_blob);
-		smemclr(priv_blob, priv_blob_len);
-		sfree(priv_blob);
-		smemclr(priv_blob_encrypted, priv_blob_len);
-		sfree(priv_blob_encrypted);
+	if (fp) {
+		ret = (fwrite(text, 1, len, fp) == (size_t)len);
+		if (fclose(fp))
+			ret = 0;
+	}
+	return ret;
+}
+
+int ssh2_save_userkey(const Filename *filename, struct ssh2_userkey *key,
+	char *passphrase)
+{
+	char *text;
+	int len, ret;
+
+	text = ssh2_save_userkey_mem(key, passphrase, &len);
+	if (!text)
 		return 0;
+
+	ret = write_ppk_file(filename, text, len);
+
+	smemclr(text, len);
+	sfree(text);
+	return ret;
+}
+
+/*
+* Save n keys to the files filenames[i], as ssh2_save_userkey would,
+* but through ssh2_save_userkeys_mem so their hashing is done together.
+* results[i] is set to 1 if keys[i] was saved, 0 if not.
+*/
+void ssh2_save_userkeys(int n, const Filename *filenames,
+	struct ssh2_userkey **keys, char *passphrase, int *results)
+{
+	char **texts = snewn(n, char *);
+	int *lens = snewn(n, int);
+	int i;
+
+	ssh2_save_userkeys_mem(n, keys, passphrase, texts, lens);
+	for (i = 0; i < n; i++) {
+		results[i] = 0;
+		if (texts[i]) {
+			results[i] = write_ppk_file(&filenames[i], texts[i], lens[i]);
+			smemclr(texts[i], lens[i]);
+			sfree(texts[i]);
+		}
 	}
-	fprintf(fp, "PuTTY-User-Key-File-2: %s\n", key->alg->name);
-	fprintf(fp, "Encryption: %s\n", cipherstr);
-	fprintf(fp, "Comment: %s\n", key->comment);
-	fprintf(fp, "Public-Lines: %d\n", base64_lines(pub_blob_len));
-	base64_encode(fp, pub_blob, pub_blob_len, 64);
-	fprintf(fp, "Private-Lines: %d\n", base64_lines(priv_encrypted_len));
-	base64_encode(fp, priv_blob_encrypted, priv_encrypted_len, 64);
-	fprintf(fp, "Private-MAC: ");
-	for (i = 0; i < 20; i++)
-		fprintf(fp, "%02x", priv_mac[i]);
-	fprintf(fp, "\n");
-	fclose(fp);
-
-	sfree(pub_blob);
-	smemclr(priv_blob, priv_blob_len);
-	sfree(priv_blob);
-	smemclr(priv_blob_encrypted, priv_blob_len);
-	sfree(priv_blob_encrypted);
-	return 1;
+
+	sfree(texts);
+	sfree(lens);
 }
 
 
@@ -105,56 +105,129 @@ int makeprivate(unsigned char *data, int len, struct RSAKey *result)
 
 static void sha512_mpint(SHA512_State * s, Bignum b)
 {
-	unsigned char lenbuf[4];
-	int len;
+	unsigned char buf[128];
+	int len, n;
 	len = (bignum_bitcount(b) + 8) / 8;
-	PUT_32BIT(lenbuf, len);
-	SHA512_Bytes(s, lenbuf, 4);
-	while (len-- > 0) {
-		lenbuf[0] = bignum_byte(b, len);
-		SHA512_Bytes(s, lenbuf, 1);
+	PUT_32BIT(buf, len);
+	SHA512_Bytes(s, buf, 4);
+	while (len > 0) {
+		n = len < (int)sizeof(buf) ? len : (int)sizeof(buf);
+		len -= n;
+		bignum_to_bytes(b, len, buf, n);
+		SHA512_Bytes(s, buf, n);
+	}
+	smemclr(buf, sizeof(buf));
+}
+
+/*
+* Return the Montgomery context for a key's modulus, setting it up
+* the first time. It is kept with the key so that repeated operations
+* (including public ones, such as verifying signatures) only pay for
+* it once. Returns NULL if the modulus is even, which no real RSA key
+* has.
+*/
+static MontyContext *rsa_monty_public(struct RSAKey *key)
+{
+	MontyContext *mc;
+
+	ssh_lock(key->lock);
+	if (!key->monty_n)
+		key->monty_n = monty_new(key->modulus);
+	mc = key->monty_n;
+	ssh_unlock(key->lock);
+	return mc;
+}
+
+/*
+* Set up the Montgomery contexts for a private key's modulus and
+* primes, if that hasn't already been done. The caller must hold the
+* key's lock.
+*/
+static void rsa_monty_setup(struct RSAKey *key)
+{
+	if (!key->monty_n)
+		key->monty_n = monty_new(key->modulus);
+	if (!key->monty_p) {
+		key->monty_p = monty_new(key->p);
+		key->monty_q = monty_new(key->q);
 	}
-	smemclr(lenbuf, sizeof(lenbuf));
 }
 
 /*
-* Compute (base ^ exp) % mod, provided mod == p * q, with p,q
-* distinct primes, and iqmp is the multiplicative inverse of q mod p.
+* Compute (base ^ exp) % n for a private key with n == p * q, p and q
+* distinct odd primes, and iqmp the multiplicative inverse of q mod p.
 * Uses Chinese Remainder Theorem to speed computation up over the
 * obvious implementation of a single big modpow.
+*
+* The caller supplies exp already reduced mod phi(p) == p-1 and mod
+* phi(q) == q-1, as pexp and qexp; for a private key these are the
+* dmp1 and dmq1 stored in the RSAKey. They are treated as secret, so
+* the exponentiations run in constant time. The key's Montgomery
+* contexts must have been set up. The intermediate values all come
+* from a bignum arena.
+*
+* The two modpows are independent, so if the worker pool has been
+* started (see sshpool.cpp) the mod-p one runs on the worker thread
+* while this thread does the mod-q one. The caller can also have
+* some work of its own done on this thread meanwhile, by passing
+* extra (called with extractx before the mod-q modpow).
 */
-Bignum crt_modpow(Bignum base, Bignum exp, Bignum mod,
-	Bignum p, Bignum q, Bignum iqmp)
+struct crt_half {
+	MontyContext *mc;
+	Bignum base, exp, result;
+	void(*extra)(void *);
+	void *extractx;
+};
+
+static void crt_half_run(void *vctx)
 {
-	Bignum pm1, qm1, pexp, qexp, presult, qresult, diff, multiplier, ret0, ret;
+	struct crt_half *ch = (struct crt_half *)vctx;
 
-	/*
-	* Reduce the exponent mod phi(p) and phi(q), to save time when
-	* exponentiating mod p and mod q respectively. Of course, since p
-	* and q are prime, phi(p) == p-1 and similarly for q.
-	*/
-	pm1 = copybn(p);
-	decbn(pm1);
-	qm1 = copybn(q);
-	decbn(qm1);
-	pexp = bigmod(exp, pm1);
-	qexp = bigmod(exp, qm1);
+	if (ch->extra)
+		ch->extra(ch->extractx);
+	ch->result = monty_modpow_secret(ch->mc, ch->base, ch->exp);
+}
+
+static Bignum crt_modpow_with(Bignum base, Bignum pexp, Bignum qexp,
+	struct RSAKey *key, void(*extra)(void *), void *extractx)
+{
+	Bignum presult, qresult, diff, h, ret;
+	struct crt_half ph, qh;
+	int mark;
 
 	/*
-	* Do the two modpows.
+	* Do the two modpows. (Anything the worker thread allocates
+	* comes from the heap rather than an arena, but freebn copes
+	* with either. Our own scope isn't opened until afterwards, so
+	* that whatever extra makes outlives it.)
 	*/
-	presult = modpow(base, pexp, p);
-	qresult = modpow(base, qexp, q);
+	ph.mc = key->monty_p;
+	ph.base = base;
+	ph.exp = pexp;
+	ph.extra = NULL;
+	ph.extractx = NULL;
+	qh.mc = key->monty_q;
+	qh.base = base;
+	qh.exp = qexp;
+	qh.extra = extra;
+	qh.extractx = extractx;
+	ssh_pool_run2(crt_half_run, &ph, crt_half_run, &qh);
+	presult = ph.result;
+	qresult = qh.result;
+
+	mark = bn_arena_begin();
 
 	/*
 	* Recombine the results. We want a value which is congruent to
 	* qresult mod q, and to presult mod p.
 	*
-	* We know that iqmp * q is congruent to 1 * mod p (by definition
+	* We know that iqmp * q is congruent to 1 mod p (by definition
 	* of iqmp) and to 0 mod q (obviously). So we start with qresult
 	* (which is congruent to qresult mod both primes), and add on
-	* (presult-qresult) * (iqmp * q) which adjusts it to be congruent
-	* to presult mod p without affecting its value mod q.
+	* h * q, where h = (presult-qresult) * iqmp mod p, which adjusts
+	* it to be congruent to presult mod p without affecting its
+	* value mod q. Since h < p and qresult < q, the sum is already
+	* less than n and needs no final reduction.
 	*/
 	if (bignum_cmp(presult, qresult) < 0) {
 		/*
@@ -162,45 +235,57 @@ Bignum crt_modpow(Bignum base, Bignum exp, Bignum mod,
 		* p.
 		*/
 		Bignum tmp = presult;
-		presult = bigadd(presult, p);
+		presult = bigadd(presult, key->p);
 		freebn(tmp);
 	}
 	diff = bigsub(presult, qresult);
-	multiplier = bigmul(iqmp, q);
-	ret0 = bigmuladd(multiplier, diff, qresult);
-
-	/*
-	* Finally, reduce the result mod n.
-	*/
-	ret = bigmod(ret0, mod);
+	h = monty_modmul(key->monty_p, diff, key->iqmp);
+	ret = bigmuladd(h, key->q, qresult);
 
 	/*
 	* Free all the intermediate results before returning.
 	*/
-	freebn(pm1);
-	freebn(qm1);
-	freebn(pexp);
-	freebn(qexp);
 	freebn(presult);
 	freebn(qresult);
 	freebn(diff);
-	freebn(multiplier);
-	freebn(ret0);
+	freebn(h);
 
-	return ret;
+	return bn_arena_end(mark, ret);
+}
+
+Bignum crt_modpow(Bignum base, Bignum pexp, Bignum qexp,
+	struct RSAKey *key)
+{
+	return crt_modpow_with(base, pexp, qexp, key, NULL, NULL);
 }
 
 /*
-* This function is a wrapper on modpow(). It has the same effect as
-* modpow(), but employs RSA blinding to protect against timing
-* attacks and also uses the Chinese Remainder Theorem (implemented
-* above, in crt_modpow()) to speed up the main operation.
+* The blinding factor's inverse, worked out while the main
+* exponentiation runs. result is NULL if there is no inverse.
 */
-static Bignum rsa_privkey_op(Bignum input, struct RSAKey *key)
+struct blind_inverse {
+	Bignum random, modulus, result;
+};
+
+static void blind_inverse_run(void *vctx)
+{
+	struct blind_inverse *bi = (struct blind_inverse *)vctx;
+
+	bi->result = modinv(bi->random, bi->modulus);
+}
+
+/*
+* Invent the first blinding pair for a key, and use it to do the
+* exponentiation for the first private-key operation on input:
+* returns (input * r^e)^d == input^d * r mod n, and leaves r^e and
+* r^-1 in key->blind_fwd and key->blind_inv. Must be called in an
+* arena scope, with the key's lock held.
+*/
+static Bignum rsa_blinding_init(Bignum input, struct RSAKey *key)
 {
 	Bignum random, random_encrypted, random_inverse;
 	Bignum input_blinded, ret_blinded;
-	Bignum ret;
+	struct blind_inverse bi;
 
 	SHA512_State ss;
 	unsigned char digest512[64];
@@ -221,6 +306,11 @@ static Bignum rsa_privkey_op(Bignum input, struct RSAKey *key)
 	* To preserve determinism and avoid Pageant needing to share
 	* the random number pool, we actually generate this `random'
 	* number by hashing stuff with the private key.
+	*
+	* We also need random to have an inverse mod modulus. Finding
+	* it takes a while, so it's done alongside the main modpow
+	* below, and in the (very unlikely) case that there turns out
+	* not to be one we come back here and choose another number.
 	*/
 	while (1) {
 		int bits, byte, bitsleft, v;
@@ -281,45 +371,134 @@ static Bignum rsa_privkey_op(Bignum input, struct RSAKey *key)
 		}
 
 		/*
-		* Also, make sure it has an inverse mod modulus.
+		* RSA blinding relies on the fact that (xy)^d mod n is equal
+		* to (x^d mod n) * (y^d mod n) mod n. We invent a random pair
+		* y and y^d; then we multiply x by y, raise to the power d mod
+		* n as usual, and divide by y^d to recover x^d. Thus an
+		* attacker can't correlate the timing of the modpow with the
+		* input, because they don't know anything about the number
+		* that was input to the actual modpow.
+		*
+		* The clever bit is that we don't have to do a huge modpow to
+		* get y and y^d; we will use the number we just invented as
+		* _y^d_, and use the _public_ exponent to compute (y^d)^e = y
+		* from it, which is much faster to do.
 		*/
-		random_inverse = modinv(random, key->modulus);
-		if (!random_inverse) {
-			freebn(random);
-			continue;
-		}
-
-		break;
+		random_encrypted = monty_modpow(key->monty_n, random, key->exponent);
+		input_blinded = monty_modmul(key->monty_n, input, random_encrypted);
+		bi.random = random;
+		bi.modulus = key->modulus;
+		ret_blinded = crt_modpow_with(input_blinded, key->dmp1, key->dmq1,
+			key, blind_inverse_run, &bi);
+		random_inverse = bi.result;
+		if (random_inverse)
+			break;
+
+		freebn(ret_blinded);
+		freebn(input_blinded);
+		freebn(random_encrypted);
+		freebn(random);
 	}
 
 	/*
-	* RSA blinding relies on the fact that (xy)^d mod n is equal
-	* to (x^d mod n) * (y^d mod n) mod n. We invent a random pair
-	* y and y^d; then we multiply x by y, raise to the power d mod
-	* n as usual, and divide by y^d to recover x^d. Thus an
-	* attacker can't correlate the timing of the modpow with the
-	* input, because they don't know anything about the number
-	* that was input to the actual modpow.
-	*
-	* The clever bit is that we don't have to do a huge modpow to
-	* get y and y^d; we will use the number we just invented as
-	* _y^d_, and use the _public_ exponent to compute (y^d)^e = y
-	* from it, which is much faster to do.
+	* The pair goes with the key from now on, so must outlive the
+	* caller's arena scope. (bn_arena_keep copies them out if they
+	* are in the arena; if not, they already belong to us.)
 	*/
-	random_encrypted = crt_modpow(random, key->exponent,
-		key->modulus, key->p, key->q, key->iqmp);
-	input_blinded = modmul(input, random_encrypted, key->modulus);
-	ret_blinded = crt_modpow(input_blinded, key->private_exponent,
-		key->modulus, key->p, key->q, key->iqmp);
-	ret = modmul(ret_blinded, random_inverse, key->modulus);
+	key->blind_fwd = bn_arena_keep(random_encrypted);
+	key->blind_inv = bn_arena_keep(random_inverse);
 
-	freebn(ret_blinded);
 	freebn(input_blinded);
-	freebn(random_inverse);
-	freebn(random_encrypted);
 	freebn(random);
 
-	return ret;
+	return ret_blinded;
+}
+
+/*
+* Replace a heap Bignum b, modulo mc's modulus, with b^2.
+*/
+static void rsa_blinding_square(MontyContext *mc, Bignum *b)
+{
+	Bignum sq = monty_modmul(mc, *b, *b);
+
+	freebn(*b);
+	*b = bn_arena_keep(sq);
+}
+
+/*
+* This function is a wrapper on modpow(). It has the same effect as
+* modpow(), but employs RSA blinding to protect against timing
+* attacks and also uses the Chinese Remainder Theorem (implemented
+* above, in crt_modpow()) to speed up the main operation.
+*
+* Inventing a blinding pair costs a modinv and a modpow, so it is
+* only done the first time a key is used (see rsa_blinding_init).
+* After that each operation moves on to a new pair by squaring the
+* old one, as suggested by Kocher: if r^e and r^-1 are a pair, so
+* are (r^e)^2 and (r^-1)^2, and an attacker who doesn't know r still
+* can't predict r^2, r^4, .... That costs two modmuls.
+*
+* The deferred check, the contexts and the blinding pair are all
+* dealt with under the key's lock (see struct RSAKey). Once the pair
+* has moved on, the operation takes its own copy of r^-1 and lets go
+* of the lock, so that only the first operation on a key (which
+* invents the pair) holds other threads up for a whole modpow.
+*
+* Returns NULL if the key's check was deferred (see
+* rsa_set_check_level) and it fails now, or if the key was only
+* partly checked and the result turns out to be wrong. (A wrong
+* result must never be handed out: if it is right mod one prime and
+* not the other, as a bad dmp1 or iqmp makes it, a gcd with n gives
+* away that prime.)
+*/
+static Bignum rsa_privkey_op(Bignum input, struct RSAKey *key)
+{
+	Bignum input_blinded, ret_blinded, blind_inv;
+	Bignum ret;
+	int mark;
+
+	ssh_lock(key->lock);
+	if (key->unchecked) {
+		if (!rsa_verify(key)) {
+			ssh_unlock(key->lock);
+			return NULL;
+		}
+		key->unchecked = 0;
+	}
+
+	/* (The contexts are kept on the key, so set them up outside the
+	* arena scope.) */
+	rsa_monty_setup(key);
+	mark = bn_arena_begin();
+
+	if (!key->blind_fwd) {
+		ret_blinded = rsa_blinding_init(input, key);
+		blind_inv = copybn(key->blind_inv);
+		ssh_unlock(key->lock);
+	}
+	else {
+		rsa_blinding_square(key->monty_n, &key->blind_fwd);
+		rsa_blinding_square(key->monty_n, &key->blind_inv);
+		input_blinded = monty_modmul(key->monty_n, input, key->blind_fwd);
+		blind_inv = copybn(key->blind_inv);
+		ssh_unlock(key->lock);
+		ret_blinded = crt_modpow(input_blinded, key->dmp1, key->dmq1, key);
+		freebn(input_blinded);
+	}
+	ret = monty_modmul(key->monty_n, ret_blinded, blind_inv);
+	freebn(ret_blinded);
+	freebn(blind_inv);
+
+	if (key->checkops) {
+		Bignum check = monty_modpow(key->monty_n, ret, key->exponent);
+		if (bignum_cmp(check, input) != 0) {
+			freebn(ret);
+			ret = NULL;
+		}
+		freebn(check);
+	}
+
+	return bn_arena_end(mark, ret);
 }
 
 Bignum rsadecrypt(Bignum input, struct RSAKey *key)
@@ -405,15 +584,56 @@ void rsa_fingerprint(char *str, int len, struct RSAKey *key)
 	}
 }
 
+/*
+* Fill in one of the CRT exponents of a private key (d mod (p-1) or
+* d mod (q-1), given pm1 == p-1 or q-1 respectively), or check the
+* one the key was loaded with. Any x < p-1 with e * x congruent to 1
+* mod (p-1) gives the same results as d mod (p-1), so that is all we
+* need to check about a supplied one.
+*/
+static int rsa_crt_exponent(Bignum *dp, Bignum d, Bignum e, Bignum pm1)
+{
+	Bignum ex;
+	int cmp;
+
+	if (!*dp) {
+		*dp = bn_arena_keep(bigmod(d, pm1));
+		return 1;
+	}
+
+	if (bignum_cmp(*dp, pm1) >= 0)
+		return 0;
+	ex = modmul(e, *dp, pm1);
+	cmp = bignum_cmp(ex, One);
+	freebn(ex);
+	return cmp == 0;
+}
+
 /*
 * Verify that the public data in an RSA key matches the private
 * data. We also check the private data itself: we ensure that p >
-* q and that iqmp really is the inverse of q mod p.
+* q and that iqmp really is the inverse of q mod p. Finally we make
+* sure the key has valid CRT exponents dmp1 and dmq1, computing them
+* if it was not loaded with them, so that rsa_privkey_op need not
+* derive them afresh every time.
+*
+* If full is zero, only n == pq is checked, and the key is just put
+* into the form rsa_privkey_op needs (p > q, and CRT exponents); the
+* checks of iqmp, d and any supplied CRT exponents are skipped, and
+* the caller must set checkops so that rsa_privkey_op checks its
+* results instead.
 */
-int rsa_verify(struct RSAKey *key)
+static int rsa_verify_key(struct RSAKey *key, int full)
 {
 	Bignum n, ed, pm1, qm1;
-	int cmp;
+	int cmp, ok;
+
+	/* p and q must be odd, for one thing so that we can use
+	* Montgomery multiplication with them. (A zero-length one, from
+	* an empty INTEGER, has no word 1 to look at.) */
+	if (key->p[0] == 0 || key->q[0] == 0 ||
+		!(key->p[1] & 1) || !(key->q[1] & 1))
+		return 0;
 
 	/* n must equal pq. */
 	n = bigmul(key->p, key->q);
@@ -422,54 +642,130 @@ int rsa_verify(struct RSAKey *key)
 	if (cmp != 0)
 		return 0;
 
-	/* e * d must be congruent to 1, modulo (p-1) and modulo (q-1). */
-	pm1 = copybn(key->p);
-	decbn(pm1);
-	ed = modmul(key->exponent, key->private_exponent, pm1);
-	freebn(pm1);
-	cmp = bignum_cmp(ed, One);
-	freebn(ed);
-	if (cmp != 0)
-		return 0;
-
-	qm1 = copybn(key->q);
-	decbn(qm1);
-	ed = modmul(key->exponent, key->private_exponent, qm1);
-	freebn(qm1);
-	cmp = bignum_cmp(ed, One);
-	freebn(ed);
-	if (cmp != 0)
-		return 0;
-
 	/*
 	* Ensure p > q.
 	*
 	* I have seen key blobs in the wild which were generated with
 	* p < q, so instead of rejecting the key in this case we
 	* should instead flip them round into the canonical order of
-	* p > q. This also involves regenerating iqmp.
+	* p > q. This also involves regenerating iqmp, and swapping
+	* the CRT exponents if we have them.
 	*/
 	if (bignum_cmp(key->p, key->q) <= 0) {
 		Bignum tmp = key->p;
 		key->p = key->q;
 		key->q = tmp;
 
+		tmp = key->dmp1;
+		key->dmp1 = key->dmq1;
+		key->dmq1 = tmp;
+
 		freebn(key->iqmp);
-		key->iqmp = modinv(key->q, key->p);
+		key->iqmp = bn_arena_keep(modinv(key->q, key->p));
 		if (!key->iqmp)
 			return 0;
 	}
 
+	if (!full && key->dmp1 && key->dmq1)
+		return 1;
+
 	/*
 	* Ensure iqmp * q is congruent to 1, modulo p.
 	*/
-	n = modmul(key->iqmp, key->q, key->p);
-	cmp = bignum_cmp(n, One);
-	freebn(n);
-	if (cmp != 0)
-		return 0;
+	if (full) {
+		n = modmul(key->iqmp, key->q, key->p);
+		cmp = bignum_cmp(n, One);
+		freebn(n);
+		if (cmp != 0)
+			return 0;
+	}
+
+	/* e * d must be congruent to 1, modulo (p-1) and modulo (q-1). */
+	pm1 = copybn(key->p);
+	decbn(pm1);
+	qm1 = copybn(key->q);
+	decbn(qm1);
+
+	ok = 1;
+	if (full) {
+		ed = modmul(key->exponent, key->private_exponent, pm1);
+		if (bignum_cmp(ed, One) != 0)
+			ok = 0;
+		freebn(ed);
+		ed = modmul(key->exponent, key->private_exponent, qm1);
+		if (bignum_cmp(ed, One) != 0)
+			ok = 0;
+		freebn(ed);
+	}
 
-	return 1;
+	if (ok && (full || !key->dmp1))
+		ok = rsa_crt_exponent(&key->dmp1, key->private_exponent,
+			key->exponent, pm1);
+	if (ok && (full || !key->dmq1))
+		ok = rsa_crt_exponent(&key->dmq1, key->private_exponent,
+			key->exponent, qm1);
+
+	freebn(pm1);
+	freebn(qm1);
+	return ok;
+}
+
+/*
+* rsa_verify_key with all its intermediate values in a bignum arena.
+* (The new key fields it makes are copied out with bn_arena_keep.)
+*/
+int rsa_verify(struct RSAKey *key)
+{
+	int mark = bn_arena_begin();
+	int ok = rsa_verify_key(key, 1);
+
+	bn_arena_end(mark, NULL);
+	return ok;
+}
+
+static int rsa_check_level = RSA_CHECK_FULL;
+
+/*
+* Choose how thoroughly private keys are checked as they are loaded
+* (by rsa2_createkey and rsa2_openssh_createkey):
+*
+*  - RSA_CHECK_FULL (the default) does all of rsa_verify.
+*  - RSA_CHECK_CHEAP only checks n == pq, for keys from a source that
+*    is trusted to have got the rest right. Instead, the result of
+*    each private-key operation with the key is checked with the
+*    public exponent (a few per cent on top of the operation itself),
+*    so a key that is wrong in some other way fails then, rather than
+*    at load, and never makes a bad signature.
+*  - RSA_CHECK_DEFERRED puts rsa_verify off until the key's first
+*    private-key operation, which fails if the check does. Keys that
+*    are only being converted from one format to another are never
+*    checked.
+*/
+void rsa_set_check_level(int level)
+{
+	rsa_check_level = level;
+}
+
+/*
+* Check a newly loaded private key according to rsa_check_level.
+*/
+static int rsa_check_new_key(struct RSAKey *key)
+{
+	int mark, ok;
+
+	switch (rsa_check_level) {
+	case RSA_CHECK_DEFERRED:
+		key->unchecked = 1;
+		return 1;
+	case RSA_CHECK_CHEAP:
+		mark = bn_arena_begin();
+		ok = rsa_verify_key(key, 0);
+		bn_arena_end(mark, NULL);
+		key->checkops = 1;
+		return ok;
+	default:
+		return rsa_verify(key);
+	}
 }
 
 /* Public key blob as used by Pageant: exponent before modulus. */
@@ -529,6 +825,18 @@ void freersakey(struct RSAKey *key)
 		freebn(key->q);
 	if (key->iqmp)
 		freebn(key->iqmp);
+	if (key->dmp1)
+		freebn(key->dmp1);
+	if (key->dmq1)
+		freebn(key->dmq1);
+	monty_free(key->monty_n);
+	monty_free(key->monty_p);
+	monty_free(key->monty_q);
+	if (key->blind_fwd)
+		freebn(key->blind_fwd);
+	if (key->blind_inv)
+		freebn(key->blind_inv);
+	ssh_lock_free(key->lock);
 	if (key->comment)
 		sfree(key->comment);
 }
@@ -585,6 +893,12 @@ static void *rsa2_newkey(char *data, int len)
 	rsa->modulus = getmp(&data, &len);
 	rsa->private_exponent = NULL;
 	rsa->p = rsa->q = rsa->iqmp = NULL;
+	rsa->dmp1 = rsa->dmq1 = NULL;
+	rsa->monty_n = rsa->monty_p = rsa->monty_q = NULL;
+	rsa->blind_fwd = rsa->blind_inv = NULL;
+	rsa->unchecked = 0;
+	rsa->checkops = 0;
+	rsa->lock = ssh_lock_new();
 	rsa->comment = NULL;
 
 	if (!rsa->exponent || !rsa->modulus) {
@@ -618,7 +932,6 @@ static unsigned char *rsa2_public_blob(void *key, int *len)
 {
 	struct RSAKey *rsa = (struct RSAKey *) key;
 	int elen, mlen, bloblen;
-	int i;
 	unsigned char *blob, *p;
 
 	elen = (bignum_bitcount(rsa->exponent) + 8) / 8;
@@ -637,12 +950,12 @@ static unsigned char *rsa2_public_blob(void *key, int *len)
 	p += 7;
 	PUT_32BIT(p, elen);
 	p += 4;
-	for (i = elen; i--;)
-		*p++ = bignum_byte(rsa->exponent, i);
+	bignum_to_bytes(rsa->exponent, 0, p, elen);
+	p += elen;
 	PUT_32BIT(p, mlen);
 	p += 4;
-	for (i = mlen; i--;)
-		*p++ = bignum_byte(rsa->modulus, i);
+	bignum_to_bytes(rsa->modulus, 0, p, mlen);
+	p += mlen;
 	assert(p == blob + bloblen);
 	*len = bloblen;
 	return blob;
@@ -652,7 +965,6 @@ static unsigned char *rsa2_private_blob(void *key, int *len)
 {
 	struct RSAKey *rsa = (struct RSAKey *) key;
 	int dlen, plen, qlen, ulen, bloblen;
-	int i;
 	unsigned char *blob, *p;
 
 	dlen = (bignum_bitcount(rsa->private_exponent) + 8) / 8;
@@ -669,20 +981,20 @@ static unsigned char *rsa2_private_blob(void *key, int *len)
 	p = blob;
 	PUT_32BIT(p, dlen);
 	p += 4;
-	for (i = dlen; i--;)
-		*p++ = bignum_byte(rsa->private_exponent, i);
+	bignum_to_bytes(rsa->private_exponent, 0, p, dlen);
+	p += dlen;
 	PUT_32BIT(p, plen);
 	p += 4;
-	for (i = plen; i--;)
-		*p++ = bignum_byte(rsa->p, i);
+	bignum_to_bytes(rsa->p, 0, p, plen);
+	p += plen;
 	PUT_32BIT(p, qlen);
 	p += 4;
-	for (i = qlen; i--;)
-		*p++ = bignum_byte(rsa->q, i);
+	bignum_to_bytes(rsa->q, 0, p, qlen);
+	p += qlen;
 	PUT_32BIT(p, ulen);
 	p += 4;
-	for (i = ulen; i--;)
-		*p++ = bignum_byte(rsa->iqmp, i);
+	bignum_to_bytes(rsa->iqmp, 0, p, ulen);
+	p += ulen;
 	assert(p == blob + bloblen);
 	*len = bloblen;
 	return blob;
@@ -695,12 +1007,29 @@ static void *rsa2_createkey(unsigned char *pub_blob, int pub_len,
 	char *pb = (char *)priv_blob;
 
 	rsa = (RSAKey *) rsa2_newkey((char *)pub_blob, pub_len);
+	if (!rsa)
+		return NULL;
 	rsa->private_exponent = getmp(&pb, &priv_len);
 	rsa->p = getmp(&pb, &priv_len);
 	rsa->q = getmp(&pb, &priv_len);
 	rsa->iqmp = getmp(&pb, &priv_len);
 
-	if (!rsa_verify(rsa)) {
+	if (!rsa->private_exponent || !rsa->p || !rsa->q || !rsa->iqmp) {
+		rsa2_freekey(rsa);
+		return NULL;
+	}
+
+	/*
+	* The private blob may optionally carry on with the CRT
+	* exponents, as supplied by the OpenSSH import code. The
+	* private blobs we write ourselves never include them.
+	*/
+	if (priv_len > 0) {
+		rsa->dmp1 = getmp(&pb, &priv_len);
+		rsa->dmq1 = getmp(&pb, &priv_len);
+	}
+
+	if (!rsa_check_new_key(rsa)) {
 		rsa2_freekey(rsa);
 		return NULL;
 	}
@@ -722,6 +1051,12 @@ static void *rsa2_openssh_createkey(unsigned char **blob, int *len)
 	rsa->iqmp = getmp(b, len);
 	rsa->p = getmp(b, len);
 	rsa->q = getmp(b, len);
+	rsa->dmp1 = rsa->dmq1 = NULL;
+	rsa->monty_n = rsa->monty_p = rsa->monty_q = NULL;
+	rsa->blind_fwd = rsa->blind_inv = NULL;
+	rsa->unchecked = 0;
+	rsa->checkops = 0;
+	rsa->lock = ssh_lock_new();
 
 	if (!rsa->modulus || !rsa->exponent || !rsa->private_exponent ||
 		!rsa->iqmp || !rsa->p || !rsa->q) {
@@ -729,7 +1064,7 @@ static void *rsa2_openssh_createkey(unsigned char **blob, int *len)
 		return NULL;
 	}
 
-	if (!rsa_verify(rsa)) {
+	if (!rsa_check_new_key(rsa)) {
 		rsa2_freekey(rsa);
 		return NULL;
 	}
@@ -754,8 +1089,9 @@ static int rsa2_openssh_fmtkey(void *key, unsigned char *blob, int len)
 
 	bloblen = 0;
 #define ENC(x) \
-    PUT_32BIT(blob+bloblen, ssh2_bignum_length((x))-4); bloblen += 4; \
-    for (i = ssh2_bignum_length((x))-4; i-- ;) blob[bloblen++]=bignum_byte((x),i);
+    i = ssh2_bignum_length((x))-4; \
+    PUT_32BIT(blob+bloblen, i); bloblen += 4; \
+    bignum_to_bytes((x), 0, blob+bloblen, i); bloblen += i;
 	ENC(rsa->modulus);
 	ENC(rsa->exponent);
 	ENC(rsa->private_exponent);
@@ -850,6 +1186,7 @@ static int rsa2_verifysig(void *key, char *sig, int siglen,
 	char *data, int datalen)
 {
 	struct RSAKey *rsa = (struct RSAKey *) key;
+	MontyContext *mc;
 	Bignum in, out;
 	char *p;
 	int slen;
@@ -863,7 +1200,15 @@ static int rsa2_verifysig(void *key, char *sig, int siglen,
 	in = getmp(&sig, &siglen);
 	if (!in)
 		return 0;
-	out = modpow(in, rsa->exponent, rsa->modulus);
+	/*
+	* With the key's cached context, and the small public exponents
+	* RSA keys have, this is a handful of Montgomery multiplications.
+	*/
+	mc = rsa_monty_public(rsa);
+	if (mc)
+		out = monty_modpow(mc, in, rsa->exponent);
+	else
+		out = modpow(in, rsa->exponent, rsa->modulus);
 	freebn(in);
 
 	ret = 1;
@@ -896,22 +1241,29 @@ static int rsa2_verifysig(void *key, char *sig, int siglen,
 	return ret;
 }
 
-static unsigned char *rsa2_sign(void *key, char *data, int datalen,
-	int *siglen)
+/*
+* The number of bytes in the padded hash that rsa2_sign exponentiates.
+*/
+static int rsa2_sign_bytes(struct RSAKey *rsa)
+{
+	int nbytes = (bignum_bitcount(rsa->modulus) - 1) / 8;
+	assert(1 <= nbytes - 20 - ASN1_LEN);
+	return nbytes;
+}
+
+/*
+* Sign one message, using bytes (of length rsa2_sign_bytes) as
+* workspace for the padded hash.
+*/
+static unsigned char *rsa2_sign_with(struct RSAKey *rsa, char *data,
+	int datalen, int *siglen, unsigned char *bytes, int nbytes)
 {
-	struct RSAKey *rsa = (struct RSAKey *) key;
-	unsigned char *bytes;
-	int nbytes;
 	unsigned char hash[20];
 	Bignum in, out;
 	int i, j;
 
 	SHA_Simple(data, datalen, hash);
 
-	nbytes = (bignum_bitcount(rsa->modulus) - 1) / 8;
-	assert(1 <= nbytes - 20 - ASN1_LEN);
-	bytes = snewn(nbytes, unsigned char);
-
 	bytes[0] = 1;
 	for (i = 1; i < nbytes - 20 - ASN1_LEN; i++)
 		bytes[i] = 0xFF;
@@ -921,24 +1273,61 @@ static unsigned char *rsa2_sign(void *key, char *data, int datalen,
 		bytes[i] = hash[j];
 
 	in = bignum_from_bytes(bytes, nbytes);
-	sfree(bytes);
 
 	out = rsa_privkey_op(in, rsa);
 	freebn(in);
+	if (!out) {
+		*siglen = 0;
+		return NULL;
+	}
 
 	nbytes = (bignum_bitcount(out) + 7) / 8;
 	bytes = snewn(4 + 7 + 4 + nbytes, unsigned char);
 	PUT_32BIT(bytes, 7);
 	memcpy(bytes + 4, "ssh-rsa", 7);
 	PUT_32BIT(bytes + 4 + 7, nbytes);
-	for (i = 0; i < nbytes; i++)
-		bytes[4 + 7 + 4 + i] = bignum_byte(out, nbytes - 1 - i);
+	bignum_to_bytes(out, 0, bytes + 4 + 7 + 4, nbytes);
 	freebn(out);
 
 	*siglen = 4 + 7 + 4 + nbytes;
 	return bytes;
 }
 
+static unsigned char *rsa2_sign(void *key, char *data, int datalen,
+	int *siglen)
+{
+	struct RSAKey *rsa = (struct RSAKey *) key;
+	int nbytes = rsa2_sign_bytes(rsa);
+	unsigned char *bytes = snewn(nbytes, unsigned char);
+	unsigned char *sig;
+
+	sig = rsa2_sign_with(rsa, data, datalen, siglen, bytes, nbytes);
+	sfree(bytes);
+	return sig;
+}
+
+/*
+* Signing several messages with one key. The Montgomery contexts
+* and blinding pair are set up (at most) once, for the first
+* message, and each further message only costs the two blinding
+* modmuls and the CRT exponentiation itself; the workspace for the
+* padded hash is shared too. If the worker pool has been started,
+* each exponentiation's two halves run on two threads.
+*/
+static void rsa2_sign_batch(void *key, int nmsgs, char **data,
+	int *datalens, unsigned char **sigs, int *siglens)
+{
+	struct RSAKey *rsa = (struct RSAKey *) key;
+	int nbytes = rsa2_sign_bytes(rsa);
+	unsigned char *bytes = snewn(nbytes, unsigned char);
+	int i;
+
+	for (i = 0; i < nmsgs; i++)
+		sigs[i] = rsa2_sign_with(rsa, data[i], datalens[i], &siglens[i],
+			bytes, nbytes);
+	sfree(bytes);
+}
+
 const struct ssh_signkey ssh_rsa = {
 	rsa2_newkey,
 	rsa2_freekey,
@@ -952,6 +1341,7 @@ const struct ssh_signkey ssh_rsa = {
 	rsa2_fingerprint,
 	rsa2_verifysig,
 	rsa2_sign,
+	rsa2_sign_batch,
 	"ssh-rsa",
 	"rsa2"
 };
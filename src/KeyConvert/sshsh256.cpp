@@ -0,0 +1,429 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* SHA-256 algorithm as described at
+*
+*   http://csrc.nist.gov/cryptval/shs.html
+*
+* On x86-64 CPUs with the SHA extensions, the block function in
+* sshshasimd.cpp is used instead of the portable one here.
+*/
+
+#include "ssh.h"
+
+/* ----------------------------------------------------------------------
+* Core SHA256 algorithm: processes 16-word blocks into a message digest.
+*/
+
+#define ror(x,y) ( ((x) >> (y)) | ((x) << (32-(y))) )
+#define Ch(x,y,z) ( (z) ^ ((x) & ((y) ^ (z))) )
+#define Maj(x,y,z) ( ((x) & (y)) | ((z) & ((x) | (y))) )
+#define bigsigma0(x) ( ror(x,2) ^ ror(x,13) ^ ror(x,22) )
+#define bigsigma1(x) ( ror(x,6) ^ ror(x,11) ^ ror(x,25) )
+#define smallsigma0(x) ( ror(x,7) ^ ror(x,18) ^ ((x) >> 3) )
+#define smallsigma1(x) ( ror(x,17) ^ ror(x,19) ^ ((x) >> 10) )
+
+static const uint32 k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void SHA256_Core_Init(uint32 h[8])
+{
+	h[0] = 0x6a09e667;
+	h[1] = 0xbb67ae85;
+	h[2] = 0x3c6ef372;
+	h[3] = 0xa54ff53a;
+	h[4] = 0x510e527f;
+	h[5] = 0x9b05688c;
+	h[6] = 0x1f83d9ab;
+	h[7] = 0x5be0cd19;
+}
+
+static void SHA256_Block(uint32 * h, const unsigned char *block)
+{
+	uint32 w[64];
+	uint32 a, b, c, d, e, f, g, hh, t1, t2;
+	int t;
+
+	for (t = 0; t < 16; t++)
+		w[t] = GET_32BIT_MSB_FIRST(block + t * 4);
+
+	for (t = 16; t < 64; t++)
+		w[t] = smallsigma1(w[t - 2]) + w[t - 7] +
+			smallsigma0(w[t - 15]) + w[t - 16];
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+	for (t = 0; t < 64; t += 8) {
+#define ROUND(j,a,b,c,d,e,f,g,h) \
+	t1 = h + bigsigma1(e) + Ch(e, f, g) + k[j] + w[j]; \
+	t2 = bigsigma0(a) + Maj(a, b, c); \
+	d += t1; \
+	h = t1 + t2;
+
+		ROUND(t + 0, a, b, c, d, e, f, g, hh);
+		ROUND(t + 1, hh, a, b, c, d, e, f, g);
+		ROUND(t + 2, g, hh, a, b, c, d, e, f);
+		ROUND(t + 3, f, g, hh, a, b, c, d, e);
+		ROUND(t + 4, e, f, g, hh, a, b, c, d);
+		ROUND(t + 5, d, e, f, g, hh, a, b, c);
+		ROUND(t + 6, c, d, e, f, g, hh, a, b);
+		ROUND(t + 7, b, c, d, e, f, g, hh, a);
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+
+	smemclr(w, sizeof(w));
+}
+
+/*
+* Process nblocks whole 64-byte blocks, with the SHA extensions if the
+* CPU has them and sha_set_simd allows it.
+*/
+static void SHA256_Blocks(uint32 * h, const unsigned char *p, int nblocks)
+{
+#ifdef SHA_SIMD
+	if (sha_get_simd() >= SHA_SIMD_NI && sha_ni_available()) {
+		sha256_ni_blocks(h, p, nblocks, k);
+		return;
+	}
+#endif
+
+	for (; nblocks > 0; nblocks--, p += 64)
+		SHA256_Block(h, p);
+}
+
+/* ----------------------------------------------------------------------
+* Outer SHA256 algorithm: take an arbitrary length byte string,
+* convert it into 16-word blocks with the prescribed padding at
+* the end, and pass those blocks to the core SHA256 algorithm.
+*/
+
+void SHA256_Init(SHA256_State * s)
+{
+	SHA256_Core_Init(s->h);
+	s->blkused = 0;
+	s->lenhi = s->lenlo = 0;
+}
+
+void SHA256_Bytes(SHA256_State * s, const void *p, int len)
+{
+	const unsigned char *q = (const unsigned char *)p;
+	uint32 lenw = len;
+
+	/*
+	* Update the length field.
+	*/
+	s->lenlo += lenw;
+	s->lenhi += (s->lenlo < lenw);
+
+	if (s->blkused && s->blkused + len < 64) {
+		/*
+		* Trivial case: just add to the block.
+		*/
+		memcpy(s->block + s->blkused, q, len);
+		s->blkused += len;
+		return;
+	}
+
+	/*
+	* Complete and process the partial block, if there is one.
+	*/
+	if (s->blkused) {
+		memcpy(s->block + s->blkused, q, 64 - s->blkused);
+		q += 64 - s->blkused;
+		len -= 64 - s->blkused;
+		SHA256_Blocks(s->h, s->block, 1);
+		s->blkused = 0;
+	}
+
+	/*
+	* Whole blocks can be processed straight from the caller's
+	* buffer.
+	*/
+	if (len >= 64) {
+		SHA256_Blocks(s->h, q, len / 64);
+		q += len & ~63;
+		len &= 63;
+	}
+
+	memcpy(s->block, q, len);
+	s->blkused = len;
+}
+
+void SHA256_Final(SHA256_State * s, unsigned char *output)
+{
+	int i;
+	int pad;
+	unsigned char c[64];
+	uint32 lenhi, lenlo;
+
+	if (s->blkused >= 56)
+		pad = 56 + 64 - s->blkused;
+	else
+		pad = 56 - s->blkused;
+
+	lenhi = (s->lenhi << 3) | (s->lenlo >> (32 - 3));
+	lenlo = (s->lenlo << 3);
+
+	memset(c, 0, pad);
+	c[0] = 0x80;
+	SHA256_Bytes(s, &c, pad);
+
+	PUT_32BIT_MSB_FIRST(c, lenhi);
+	PUT_32BIT_MSB_FIRST(c + 4, lenlo);
+
+	SHA256_Bytes(s, &c, 8);
+
+	for (i = 0; i < 8; i++)
+		PUT_32BIT_MSB_FIRST(output + i * 4, s->h[i]);
+}
+
+void SHA256_Simple(const void *p, int len, unsigned char *output)
+{
+	SHA256_State s;
+
+	SHA256_Init(&s);
+	SHA256_Bytes(&s, p, len);
+	SHA256_Final(&s, output);
+	smemclr(&s, sizeof(s));
+}
+
+/*
+* Hash n separate messages, p[i] of len[i] bytes, into output[i].
+*/
+void SHA256_Simple_multi(int n, const void *const *p, const int *len,
+	unsigned char *const *output)
+{
+	int i;
+
+#ifdef SHA_SIMD
+	if (sha_use_multi(n)) {
+		uint32 init[8];
+
+		SHA256_Core_Init(init);
+		sha256_multi(n, init, 0, (const unsigned char *const *)p, len,
+			output, k);
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+		SHA256_Simple(p[i], len[i], output[i]);
+}
+
+/*
+* Thin abstraction for things where hashes are pluggable.
+*/
+
+static void *sha256_init(void)
+{
+	SHA256_State *s;
+
+	s = snew(SHA256_State);
+	SHA256_Init(s);
+	return s;
+}
+
+static void sha256_bytes(void *handle, void *p, int len)
+{
+	SHA256_State *s = (SHA256_State *)handle;
+
+	SHA256_Bytes(s, p, len);
+}
+
+static void sha256_final(void *handle, unsigned char *output)
+{
+	SHA256_State *s = (SHA256_State *)handle;
+
+	SHA256_Final(s, output);
+	smemclr(s, sizeof(*s));
+	sfree(s);
+}
+
+const struct ssh_hash ssh_sha256 = {
+	sha256_init, sha256_bytes, sha256_final, 32, "SHA-256"
+};
+
+/* ----------------------------------------------------------------------
+* HMAC-SHA256, laid out like HMAC-SHA1 in sshsha.cpp: the context keeps
+* the inner and outer states with the key blocks already absorbed,
+* plus a working copy for the current message.
+*/
+
+void *hmacsha256_make_context(void)
+{
+	return snewn(3, SHA256_State);
+}
+
+void hmacsha256_free_context(void *handle)
+{
+	smemclr(handle, 3 * sizeof(SHA256_State));
+	sfree(handle);
+}
+
+void hmacsha256_key(void *handle, void const *keyv, int len)
+{
+	SHA256_State *keys = (SHA256_State *)handle;
+	unsigned char foo[64];
+	unsigned char const *key = (unsigned char const *)keyv;
+	int i;
+
+	memset(foo, 0x36, 64);
+	for (i = 0; i < len && i < 64; i++)
+		foo[i] ^= key[i];
+	SHA256_Init(&keys[0]);
+	SHA256_Bytes(&keys[0], foo, 64);
+
+	memset(foo, 0x5C, 64);
+	for (i = 0; i < len && i < 64; i++)
+		foo[i] ^= key[i];
+	SHA256_Init(&keys[1]);
+	SHA256_Bytes(&keys[1], foo, 64);
+
+	smemclr(foo, 64);		       /* burn the evidence */
+}
+
+static void hmacsha256_key_32(void *handle, unsigned char *key)
+{
+	hmacsha256_key(handle, key, 32);
+}
+
+static void hmacsha256_start(void *handle)
+{
+	SHA256_State *keys = (SHA256_State *)handle;
+
+	keys[2] = keys[0];		      /* structure copy */
+}
+
+static void hmacsha256_bytes(void *handle, unsigned char const *blk, int len)
+{
+	SHA256_State *keys = (SHA256_State *)handle;
+
+	SHA256_Bytes(&keys[2], blk, len);
+}
+
+static void hmacsha256_genresult(void *handle, unsigned char *hmac)
+{
+	SHA256_State *keys = (SHA256_State *)handle;
+	SHA256_State s;
+	unsigned char intermediate[32];
+
+	s = keys[2];		       /* structure copy */
+	SHA256_Final(&s, intermediate);
+	s = keys[1];		       /* structure copy */
+	SHA256_Bytes(&s, intermediate, 32);
+	SHA256_Final(&s, hmac);
+	smemclr(intermediate, sizeof(intermediate));
+}
+
+static int hmacsha256_verresult(void *handle, unsigned char const *hmac)
+{
+	unsigned char correct[32];
+	hmacsha256_genresult(handle, correct);
+	return smemeq(correct, hmac, 32);
+}
+
+static void hmacsha256_do_hmac_internal(void *handle,
+	unsigned char const *blk, int len,
+	unsigned char const *blk2, int len2,
+	unsigned char *hmac)
+{
+	hmacsha256_start(handle);
+	hmacsha256_bytes(handle, blk, len);
+	if (blk2) hmacsha256_bytes(handle, blk2, len2);
+	hmacsha256_genresult(handle, hmac);
+}
+
+void hmacsha256_do_hmac(void *handle, unsigned char const *blk, int len,
+	unsigned char *hmac)
+{
+	hmacsha256_do_hmac_internal(handle, blk, len, NULL, 0, hmac);
+}
+
+/*
+* MAC n separate messages with the same key, as hmacsha1_do_hmac_multi
+* does.
+*/
+void hmacsha256_do_hmac_multi(void *handle, int n,
+	unsigned char const *const *blk, const int *len,
+	unsigned char *const *hmac)
+{
+	int i;
+
+#ifdef SHA_SIMD
+	if (sha_use_multi(n)) {
+		SHA256_State *keys = (SHA256_State *)handle;
+		unsigned char *inner = snewn(n * 32, unsigned char);
+		unsigned char **innerp = snewn(n, unsigned char *);
+		int *innerlen = snewn(n, int);
+
+		for (i = 0; i < n; i++) {
+			innerp[i] = inner + 32 * i;
+			innerlen[i] = 32;
+		}
+		sha256_multi(n, keys[0].h, 64, blk, len, innerp, k);
+		sha256_multi(n, keys[1].h, 64, innerp, innerlen, hmac, k);
+
+		smemclr(inner, n * 32);
+		sfree(inner);
+		sfree(innerp);
+		sfree(innerlen);
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+		hmacsha256_do_hmac(handle, blk[i], len[i], hmac[i]);
+}
+
+static void hmacsha256_do_hmac_ssh(void *handle, unsigned char const *blk,
+	int len, unsigned long seq, unsigned char *hmac)
+{
+	unsigned char seqbuf[4];
+
+	PUT_32BIT_MSB_FIRST(seqbuf, seq);
+	hmacsha256_do_hmac_internal(handle, seqbuf, 4, blk, len, hmac);
+}
+
+static void hmacsha256_generate(void *handle, unsigned char *blk, int len,
+	unsigned long seq)
+{
+	hmacsha256_do_hmac_ssh(handle, blk, len, seq, blk + len);
+}
+
+static int hmacsha256_verify(void *handle, unsigned char *blk, int len,
+	unsigned long seq)
+{
+	unsigned char correct[32];
+	hmacsha256_do_hmac_ssh(handle, blk, len, seq, correct);
+	return smemeq(correct, blk + len, 32);
+}
+
+const struct ssh_mac ssh_hmac_sha256 = {
+	hmacsha256_make_context, hmacsha256_free_context, hmacsha256_key_32,
+	hmacsha256_generate, hmacsha256_verify,
+	hmacsha256_start, hmacsha256_bytes, hmacsha256_genresult,
+	hmacsha256_verresult,
+	"hmac-sha2-256",
+	32,
+	"HMAC-SHA-256"
+};
@@ -11,138 +11,136 @@
 
 #define BLKSIZE 128
 
-/*
-* Arithmetic implementations. Note that AND, XOR and NOT can
-* overlap destination with one source, but the others can't.
-*/
-#define add(r,x,y) ( r.lo = y.lo + x.lo, \
-		     r.hi = y.hi + x.hi + ((uint32)r.lo < (uint32)y.lo) )
-#define rorB(r,x,y) ( r.lo = ((uint32)x.hi >> ((y)-32)) | ((uint32)x.lo << (64-(y))), \
-		      r.hi = ((uint32)x.lo >> ((y)-32)) | ((uint32)x.hi << (64-(y))) )
-#define rorL(r,x,y) ( r.lo = ((uint32)x.lo >> (y)) | ((uint32)x.hi << (32-(y))), \
-		      r.hi = ((uint32)x.hi >> (y)) | ((uint32)x.lo << (32-(y))) )
-#define shrB(r,x,y) ( r.lo = (uint32)x.hi >> ((y)-32), r.hi = 0 )
-#define shrL(r,x,y) ( r.lo = ((uint32)x.lo >> (y)) | ((uint32)x.hi << (32-(y))), \
-		      r.hi = (uint32)x.hi >> (y) )
-#define and(r,x,y) ( r.lo = x.lo & y.lo, r.hi = x.hi & y.hi )
-#define xor(r,x,y) ( r.lo = x.lo ^ y.lo, r.hi = x.hi ^ y.hi )
-#define not(r,x) ( r.lo = ~x.lo, r.hi = ~x.hi )
-#define INIT(h,l) { h, l }
-#define BUILD(r,h,l) ( r.hi = h, r.lo = l )
-#define EXTRACT(h,l,r) ( h = r.hi, l = r.lo )
+#define ror(x,y) ( ((x) >> (y)) | ((x) << (64-(y))) )
 
 /* ----------------------------------------------------------------------
 * Core SHA512 algorithm: processes 16-doubleword blocks into a
 * message digest.
 */
 
-#define Ch(r,t,x,y,z) ( not(t,x), and(r,t,z), and(t,x,y), xor(r,r,t) )
-#define Maj(r,t,x,y,z) ( and(r,x,y), and(t,x,z), xor(r,r,t), \
-			 and(t,y,z), xor(r,r,t) )
-#define bigsigma0(r,t,x) ( rorL(r,x,28), rorB(t,x,34), xor(r,r,t), \
-			   rorB(t,x,39), xor(r,r,t) )
-#define bigsigma1(r,t,x) ( rorL(r,x,14), rorL(t,x,18), xor(r,r,t), \
-			   rorB(t,x,41), xor(r,r,t) )
-#define smallsigma0(r,t,x) ( rorL(r,x,1), rorL(t,x,8), xor(r,r,t), \
-			     shrL(t,x,7), xor(r,r,t) )
-#define smallsigma1(r,t,x) ( rorL(r,x,19), rorB(t,x,61), xor(r,r,t), \
-			     shrL(t,x,6), xor(r,r,t) )
+#define Ch(x,y,z) ( (z) ^ ((x) & ((y) ^ (z))) )
+#define Maj(x,y,z) ( ((x) & (y)) | ((z) & ((x) | (y))) )
+#define bigsigma0(x) ( ror(x,28) ^ ror(x,34) ^ ror(x,39) )
+#define bigsigma1(x) ( ror(x,14) ^ ror(x,18) ^ ror(x,41) )
+#define smallsigma0(x) ( ror(x,1) ^ ror(x,8) ^ ((x) >> 7) )
+#define smallsigma1(x) ( ror(x,19) ^ ror(x,61) ^ ((x) >> 6) )
+
+#define GET_64BIT_MSB_FIRST(cp) \
+	( ((uint64)GET_32BIT_MSB_FIRST(cp) << 32) | \
+	  GET_32BIT_MSB_FIRST((cp) + 4) )
+
+static const uint64 k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+	0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+	0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+	0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+	0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+	0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+	0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+	0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+	0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+	0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+	0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+	0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+	0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+	0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#ifdef SHA512_AVX2
+/*
+* Whether to use the AVX2 message schedule, if the CPU has AVX2.
+*/
+static int avx2_enabled = 1;
+#endif
+
+void sha512_set_avx2(int enable)
+{
+#ifdef SHA512_AVX2
+	avx2_enabled = enable;
+#endif
+}
 
 static void SHA512_Core_Init(SHA512_State *s) {
 	static const uint64 iv[] = {
-		INIT(0x6a09e667, 0xf3bcc908),
-		INIT(0xbb67ae85, 0x84caa73b),
-		INIT(0x3c6ef372, 0xfe94f82b),
-		INIT(0xa54ff53a, 0x5f1d36f1),
-		INIT(0x510e527f, 0xade682d1),
-		INIT(0x9b05688c, 0x2b3e6c1f),
-		INIT(0x1f83d9ab, 0xfb41bd6b),
-		INIT(0x5be0cd19, 0x137e2179),
+		0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+		0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+		0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+		0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
 	};
 	int i;
 	for (i = 0; i < 8; i++)
 		s->h[i] = iv[i];
 }
 
-static void SHA512_Block(SHA512_State *s, uint64 *block) {
+/*
+* Expand a 128-byte block into the 80 words of the message schedule,
+* each with its round constant already added.
+*/
+static void SHA512_Schedule(uint64 *wk, const unsigned char *block) {
 	uint64 w[80];
-	uint64 a, b, c, d, e, f, g, h;
-	static const uint64 k[] = {
-		INIT(0x428a2f98, 0xd728ae22), INIT(0x71374491, 0x23ef65cd),
-		INIT(0xb5c0fbcf, 0xec4d3b2f), INIT(0xe9b5dba5, 0x8189dbbc),
-		INIT(0x3956c25b, 0xf348b538), INIT(0x59f111f1, 0xb605d019),
-		INIT(0x923f82a4, 0xaf194f9b), INIT(0xab1c5ed5, 0xda6d8118),
-		INIT(0xd807aa98, 0xa3030242), INIT(0x12835b01, 0x45706fbe),
-		INIT(0x243185be, 0x4ee4b28c), INIT(0x550c7dc3, 0xd5ffb4e2),
-		INIT(0x72be5d74, 0xf27b896f), INIT(0x80deb1fe, 0x3b1696b1),
-		INIT(0x9bdc06a7, 0x25c71235), INIT(0xc19bf174, 0xcf692694),
-		INIT(0xe49b69c1, 0x9ef14ad2), INIT(0xefbe4786, 0x384f25e3),
-		INIT(0x0fc19dc6, 0x8b8cd5b5), INIT(0x240ca1cc, 0x77ac9c65),
-		INIT(0x2de92c6f, 0x592b0275), INIT(0x4a7484aa, 0x6ea6e483),
-		INIT(0x5cb0a9dc, 0xbd41fbd4), INIT(0x76f988da, 0x831153b5),
-		INIT(0x983e5152, 0xee66dfab), INIT(0xa831c66d, 0x2db43210),
-		INIT(0xb00327c8, 0x98fb213f), INIT(0xbf597fc7, 0xbeef0ee4),
-		INIT(0xc6e00bf3, 0x3da88fc2), INIT(0xd5a79147, 0x930aa725),
-		INIT(0x06ca6351, 0xe003826f), INIT(0x14292967, 0x0a0e6e70),
-		INIT(0x27b70a85, 0x46d22ffc), INIT(0x2e1b2138, 0x5c26c926),
-		INIT(0x4d2c6dfc, 0x5ac42aed), INIT(0x53380d13, 0x9d95b3df),
-		INIT(0x650a7354, 0x8baf63de), INIT(0x766a0abb, 0x3c77b2a8),
-		INIT(0x81c2c92e, 0x47edaee6), INIT(0x92722c85, 0x1482353b),
-		INIT(0xa2bfe8a1, 0x4cf10364), INIT(0xa81a664b, 0xbc423001),
-		INIT(0xc24b8b70, 0xd0f89791), INIT(0xc76c51a3, 0x0654be30),
-		INIT(0xd192e819, 0xd6ef5218), INIT(0xd6990624, 0x5565a910),
-		INIT(0xf40e3585, 0x5771202a), INIT(0x106aa070, 0x32bbd1b8),
-		INIT(0x19a4c116, 0xb8d2d0c8), INIT(0x1e376c08, 0x5141ab53),
-		INIT(0x2748774c, 0xdf8eeb99), INIT(0x34b0bcb5, 0xe19b48a8),
-		INIT(0x391c0cb3, 0xc5c95a63), INIT(0x4ed8aa4a, 0xe3418acb),
-		INIT(0x5b9cca4f, 0x7763e373), INIT(0x682e6ff3, 0xd6b2b8a3),
-		INIT(0x748f82ee, 0x5defb2fc), INIT(0x78a5636f, 0x43172f60),
-		INIT(0x84c87814, 0xa1f0ab72), INIT(0x8cc70208, 0x1a6439ec),
-		INIT(0x90befffa, 0x23631e28), INIT(0xa4506ceb, 0xde82bde9),
-		INIT(0xbef9a3f7, 0xb2c67915), INIT(0xc67178f2, 0xe372532b),
-		INIT(0xca273ece, 0xea26619c), INIT(0xd186b8c7, 0x21c0c207),
-		INIT(0xeada7dd6, 0xcde0eb1e), INIT(0xf57d4f7f, 0xee6ed178),
-		INIT(0x06f067aa, 0x72176fba), INIT(0x0a637dc5, 0xa2c898a6),
-		INIT(0x113f9804, 0xbef90dae), INIT(0x1b710b35, 0x131c471b),
-		INIT(0x28db77f5, 0x23047d84), INIT(0x32caab7b, 0x40c72493),
-		INIT(0x3c9ebe0a, 0x15c9bebc), INIT(0x431d67c4, 0x9c100d4c),
-		INIT(0x4cc5d4be, 0xcb3e42b6), INIT(0x597f299c, 0xfc657e2a),
-		INIT(0x5fcb6fab, 0x3ad6faec), INIT(0x6c44198c, 0x4a475817),
-	};
-
 	int t;
 
-	for (t = 0; t < 16; t++)
-		w[t] = block[t];
+	for (t = 0; t < 16; t++) {
+		w[t] = GET_64BIT_MSB_FIRST(block + t * 8);
+		wk[t] = w[t] + k[t];
+	}
 
 	for (t = 16; t < 80; t++) {
-		uint64 p, q, r, tmp;
-		smallsigma1(p, tmp, w[t - 2]);
-		smallsigma0(q, tmp, w[t - 15]);
-		add(r, p, q);
-		add(p, r, w[t - 7]);
-		add(w[t], p, w[t - 16]);
+		w[t] = smallsigma1(w[t - 2]) + w[t - 7] +
+			smallsigma0(w[t - 15]) + w[t - 16];
+		wk[t] = w[t] + k[t];
 	}
 
+	smemclr(w, sizeof(w));
+}
+
+static void SHA512_Block(SHA512_State *s, const unsigned char *block) {
+	uint64 wk[80];
+	uint64 a, b, c, d, e, f, g, h, t1, t2;
+	int t;
+
+#ifdef SHA512_AVX2
+	if (avx2_enabled && sha512_avx2_available())
+		sha512_avx2_schedule(wk, block, k);
+	else
+#endif
+		SHA512_Schedule(wk, block);
+
 	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
 	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
 
 	for (t = 0; t < 80; t += 8) {
-		uint64 tmp, p, q, r;
-
 #define ROUND(j,a,b,c,d,e,f,g,h) \
-	bigsigma1(p, tmp, e); \
-	Ch(q, tmp, e, f, g); \
-	add(r, p, q); \
-	add(p, r, k[j]) ; \
-	add(q, p, w[j]); \
-	add(r, q, h); \
-	bigsigma0(p, tmp, a); \
-	Maj(tmp, q, a, b, c); \
-	add(q, tmp, p); \
-	add(p, r, d); \
-	d = p; \
-	add(h, q, r);
+	t1 = h + bigsigma1(e) + Ch(e, f, g) + wk[j]; \
+	t2 = bigsigma0(a) + Maj(a, b, c); \
+	d += t1; \
+	h = t1 + t2;
 
 		ROUND(t + 0, a, b, c, d, e, f, g, h);
 		ROUND(t + 1, h, a, b, c, d, e, f, g);
@@ -154,14 +152,10 @@ static void SHA512_Block(SHA512_State *s, uint64 *block) {
 		ROUND(t + 7, b, c, d, e, f, g, h, a);
 	}
 
-	{
-		uint64 tmp;
-#define UPDATE(state, local) ( tmp = state, add(state, tmp, local) )
-		UPDATE(s->h[0], a); UPDATE(s->h[1], b);
-		UPDATE(s->h[2], c); UPDATE(s->h[3], d);
-		UPDATE(s->h[4], e); UPDATE(s->h[5], f);
-		UPDATE(s->h[6], g); UPDATE(s->h[7], h);
-	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+
+	smemclr(wk, sizeof(wk));
 }
 
 /* ----------------------------------------------------------------------
@@ -171,26 +165,20 @@ static void SHA512_Block(SHA512_State *s, uint64 *block) {
 */
 
 void SHA512_Init(SHA512_State *s) {
-	int i;
 	SHA512_Core_Init(s);
 	s->blkused = 0;
-	for (i = 0; i < 4; i++)
-		s->len[i] = 0;
+	s->lenhi = s->lenlo = 0;
 }
 
 void SHA512_Bytes(SHA512_State *s, const void *p, int len) {
-	unsigned char *q = (unsigned char *)p;
-	uint64 wordblock[16];
-	uint32 lenw = len;
-	int i;
+	const unsigned char *q = (const unsigned char *)p;
 
 	/*
-	* Update the length field.
+	* Update the length field (in bytes; SHA512_Final converts it
+	* to bits).
 	*/
-	for (i = 0; i < 4; i++) {
-		s->len[i] += lenw;
-		lenw = (s->len[i] < lenw);
-	}
+	s->lenlo += len;
+	s->lenhi += (s->lenlo < (uint64)len);
 
 	if (s->blkused && s->blkused + len < BLKSIZE) {
 		/*
@@ -198,77 +186,62 @@ void SHA512_Bytes(SHA512_State *s, const void *p, int len) {
 		*/
 		memcpy(s->block + s->blkused, q, len);
 		s->blkused += len;
+		return;
 	}
-	else {
-		/*
-		* We must complete and process at least one block.
-		*/
-		while (s->blkused + len >= BLKSIZE) {
-			memcpy(s->block + s->blkused, q, BLKSIZE - s->blkused);
-			q += BLKSIZE - s->blkused;
-			len -= BLKSIZE - s->blkused;
-			/* Now process the block. Gather bytes big-endian into words */
-			for (i = 0; i < 16; i++) {
-				uint32 h, l;
-				h = (((uint32)s->block[i * 8 + 0]) << 24) |
-					(((uint32)s->block[i * 8 + 1]) << 16) |
-					(((uint32)s->block[i * 8 + 2]) << 8) |
-					(((uint32)s->block[i * 8 + 3]) << 0);
-				l = (((uint32)s->block[i * 8 + 4]) << 24) |
-					(((uint32)s->block[i * 8 + 5]) << 16) |
-					(((uint32)s->block[i * 8 + 6]) << 8) |
-					(((uint32)s->block[i * 8 + 7]) << 0);
-				BUILD(wordblock[i], h, l);
-			}
-			SHA512_Block(s, wordblock);
-			s->blkused = 0;
-		}
-		memcpy(s->block, q, len);
-		s->blkused = len;
+
+	/*
+	* Complete and process the partial block, if there is one.
+	*/
+	if (s->blkused) {
+		memcpy(s->block + s->blkused, q, BLKSIZE - s->blkused);
+		q += BLKSIZE - s->blkused;
+		len -= BLKSIZE - s->blkused;
+		SHA512_Block(s, s->block);
+		s->blkused = 0;
 	}
+
+	/*
+	* Whole blocks can be processed straight from the caller's
+	* buffer.
+	*/
+	while (len >= BLKSIZE) {
+		SHA512_Block(s, q);
+		q += BLKSIZE;
+		len -= BLKSIZE;
+	}
+
+	memcpy(s->block, q, len);
+	s->blkused = len;
 }
 
 void SHA512_Final(SHA512_State *s, unsigned char *digest) {
 	int i;
 	int pad;
 	unsigned char c[BLKSIZE];
-	uint32 len[4];
+	uint64 lenhi, lenlo;
 
 	if (s->blkused >= BLKSIZE - 16)
 		pad = (BLKSIZE - 16) + BLKSIZE - s->blkused;
 	else
 		pad = (BLKSIZE - 16) - s->blkused;
 
-	for (i = 4; i--;) {
-		uint32 lenhi = s->len[i];
-		uint32 lenlo = i > 0 ? s->len[i - 1] : 0;
-		len[i] = (lenhi << 3) | (lenlo >> (32 - 3));
-	}
+	lenhi = (s->lenhi << 3) | (s->lenlo >> 61);
+	lenlo = s->lenlo << 3;
 
 	memset(c, 0, pad);
 	c[0] = 0x80;
 	SHA512_Bytes(s, &c, pad);
 
-	for (i = 0; i < 4; i++) {
-		c[i * 4 + 0] = (len[3 - i] >> 24) & 0xFF;
-		c[i * 4 + 1] = (len[3 - i] >> 16) & 0xFF;
-		c[i * 4 + 2] = (len[3 - i] >> 8) & 0xFF;
-		c[i * 4 + 3] = (len[3 - i] >> 0) & 0xFF;
-	}
+	PUT_32BIT_MSB_FIRST(c, (uint32)(lenhi >> 32));
+	PUT_32BIT_MSB_FIRST(c + 4, (uint32)lenhi);
+	PUT_32BIT_MSB_FIRST(c + 8, (uint32)(lenlo >> 32));
+	PUT_32BIT_MSB_FIRST(c + 12, (uint32)lenlo);
 
 	SHA512_Bytes(s, &c, 16);
 
 	for (i = 0; i < 8; i++) {
-		uint32 h, l;
-		EXTRACT(h, l, s->h[i]);
-		digest[i * 8 + 0] = (h >> 24) & 0xFF;
-		digest[i * 8 + 1] = (h >> 16) & 0xFF;
-		digest[i * 8 + 2] = (h >> 8) & 0xFF;
-		digest[i * 8 + 3] = (h >> 0) & 0xFF;
-		digest[i * 8 + 4] = (l >> 24) & 0xFF;
-		digest[i * 8 + 5] = (l >> 16) & 0xFF;
-		digest[i * 8 + 6] = (l >> 8) & 0xFF;
-		digest[i * 8 + 7] = (l >> 0) & 0xFF;
+		PUT_32BIT_MSB_FIRST(digest + i * 8, (uint32)(s->h[i] >> 32));
+		PUT_32BIT_MSB_FIRST(digest + i * 8 + 4, (uint32)s->h[i]);
 	}
 }
 
@@ -286,11 +259,56 @@ void SHA512_Simple(const void *p, int len, unsigned char *output) {
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
-int main(void) {
+/*
+* 'sshsh512 --bench' measures throughput for a few message lengths,
+* with and without the AVX2 message schedule.
+*/
+static void bench(void) {
+	static const int sizes[] = { 64, 1024, 65536 };
+	static unsigned char buf[65536];
+	unsigned char digest[64];
+	int s, avx2;
+	long i, reps;
+
+	for (i = 0; i < (long)sizeof(buf); i++)
+		buf[i] = (unsigned char)(i * 7 + 1);
+
+	for (avx2 = 0; avx2 < 2; avx2++) {
+#ifndef SHA512_AVX2
+		if (avx2)
+			break;
+#else
+		if (avx2 && !sha512_avx2_available())
+			break;
+#endif
+		sha512_set_avx2(avx2);
+		for (s = 0; s < (int)lenof(sizes); s++) {
+			clock_t start;
+			double secs;
+
+			reps = (64L << 20) / sizes[s];
+			start = clock();
+			for (i = 0; i < reps; i++)
+				SHA512_Simple(buf, sizes[s], digest);
+			secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+			printf("%s %5d bytes: %.1f MB/s\n", avx2 ? "avx2  " : "scalar",
+				sizes[s], reps * (double)sizes[s] / secs / 1e6);
+		}
+	}
+	sha512_set_avx2(1);
+}
+
+int main(int argc, char **argv) {
 	unsigned char digest[64];
 	int i, j, errors;
 
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench();
+		return 0;
+	}
+
 	struct {
 		const char *teststring;
 		unsigned char digest512[64];
@@ -356,6 +374,44 @@ int main(void) {
 
 	}
 
+	/*
+	* Every length up to a few blocks, fed in one go and in uneven
+	* pieces, with and without AVX2, must all agree.
+	*/
+	{
+		static unsigned char buf[400];
+		unsigned char ref[64];
+		int len, avx2, step;
+
+		for (i = 0; i < (int)sizeof(buf); i++)
+			buf[i] = (unsigned char)(i * 37 + 11);
+
+		for (len = 0; len <= (int)sizeof(buf); len++) {
+			sha512_set_avx2(0);
+			SHA512_Simple(buf, len, ref);
+			for (avx2 = 0; avx2 < 2; avx2++) {
+				sha512_set_avx2(avx2);
+				for (step = 1; step <= 129; step += 64) {
+					SHA512_State s;
+					int done;
+
+					SHA512_Init(&s);
+					for (done = 0; done < len; done += step)
+						SHA512_Bytes(&s, buf + done,
+							len - done < step ? len - done : step);
+					SHA512_Final(&s, digest);
+					if (memcmp(digest, ref, 64)) {
+						fprintf(stderr, "length %d in steps of %d%s: "
+							"wrong digest\n", len, step,
+							avx2 ? " with AVX2" : "");
+						errors++;
+					}
+				}
+			}
+		}
+		sha512_set_avx2(1);
+	}
+
 	printf("%d errors\n", errors);
 
 	return 0;
@@ -0,0 +1,104 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* The SHA-512 message schedule using AVX2. Each step works out four
+* new schedule words at once: the parts depending on words at least
+* seven back are done as one 256-bit vector, and the sigma1 term, which
+* depends on the two words just before, in two 128-bit halves. The
+* rounds themselves stay in sshsh512.cpp, since they are a serial
+* chain of 64-bit operations.
+*/
+
+#include "ssh.h"
+
+#ifdef SHA512_AVX2
+
+#include <immintrin.h>
+
+#if defined __GNUC__ || defined __clang__
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+/*
+* Check whether the CPU has AVX2, and whether the OS saves the
+* YMM registers across context switches.
+*/
+int sha512_avx2_available(void)
+{
+	return cpu_has_avx2();
+}
+
+#define ROR256(x,y) _mm256_or_si256(_mm256_srli_epi64(x, y), \
+				    _mm256_slli_epi64(x, 64 - (y)))
+#define ROR128(x,y) _mm_or_si128(_mm_srli_epi64(x, y), \
+				 _mm_slli_epi64(x, 64 - (y)))
+
+AVX2_TARGET static inline __m256i smallsigma0(__m256i x)
+{
+	return _mm256_xor_si256(_mm256_xor_si256(ROR256(x, 1), ROR256(x, 8)),
+		_mm256_srli_epi64(x, 7));
+}
+
+AVX2_TARGET static inline __m128i smallsigma1(__m128i x)
+{
+	return _mm_xor_si128(_mm_xor_si128(ROR128(x, 19), ROR128(x, 61)),
+		_mm_srli_epi64(x, 6));
+}
+
+/*
+* Given vectors holding words i..i+3 and i+4..i+7, make one holding
+* words i+1..i+4.
+*/
+#define NEXT1(x,y) _mm256_permute4x64_epi64(_mm256_blend_epi32(x, y, 0x03), 0x39)
+
+/*
+* The same as SHA512_Schedule in sshsh512.cpp: expand a 128-byte block
+* into wk[0..79], the schedule words plus the round constants k.
+*
+* The last sixteen words are kept in w0..w3, oldest first.
+*/
+AVX2_TARGET void sha512_avx2_schedule(uint64 *wk, const unsigned char *block,
+	const uint64 *k)
+{
+	/* Reverse the bytes of each 64-bit lane */
+	const __m256i bswap = _mm256_set_epi8(
+		8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+		8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i w0, w1, w2, w3, v;
+	__m128i lo, hi;
+	int t;
+
+#define LOAD(w,t) \
+	w = _mm256_shuffle_epi8(_mm256_loadu_si256( \
+		(const __m256i *)(block + (t) * 8)), bswap); \
+	_mm256_storeu_si256((__m256i *)(wk + (t)), _mm256_add_epi64(w, \
+		_mm256_loadu_si256((const __m256i *)(k + (t)))))
+
+	LOAD(w0, 0);
+	LOAD(w1, 4);
+	LOAD(w2, 8);
+	LOAD(w3, 12);
+
+	for (t = 16; t < 80; t += 4) {
+		/* w[t-16] + sigma0(w[t-15]) + w[t-7], for four words */
+		v = _mm256_add_epi64(w0, smallsigma0(NEXT1(w0, w1)));
+		v = _mm256_add_epi64(v, NEXT1(w2, w3));
+
+		/* then sigma1(w[t-2]), which for the top two is w[t] and w[t+1] */
+		lo = _mm_add_epi64(_mm256_castsi256_si128(v),
+			smallsigma1(_mm256_extracti128_si256(w3, 1)));
+		hi = _mm_add_epi64(_mm256_extracti128_si256(v, 1), smallsigma1(lo));
+
+		w0 = w1;
+		w1 = w2;
+		w2 = w3;
+		w3 = _mm256_set_m128i(hi, lo);
+		_mm256_storeu_si256((__m256i *)(wk + t), _mm256_add_epi64(w3,
+			_mm256_loadu_si256((const __m256i *)(k + t))));
+	}
+}
+
+#endif
@@ -16,6 +16,46 @@
 
 #define rol(x,y) ( ((x) << (y)) | (((uint32)x) >> (32-y)) )
 
+#ifdef SHA_SIMD
+/*
+* The fastest code sha_simd allows; see sha_set_simd.
+*/
+static int sha_simd = SHA_SIMD_NI;
+#endif
+
+void sha_set_simd(int level)
+{
+#ifdef SHA_SIMD
+	sha_simd = level;
+#endif
+}
+
+int sha_get_simd(void)
+{
+#ifdef SHA_SIMD
+	return sha_simd;
+#else
+	return SHA_SIMD_NONE;
+#endif
+}
+
+#ifdef SHA_SIMD
+/*
+* Whether the _multi functions should hash n messages in the AVX2
+* lanes of sshshamulti.cpp: only if there are enough of them to fill
+* most of the lanes, and the SHA extensions, which are faster one
+* message at a time, aren't to be used.
+*/
+int sha_use_multi(int n)
+{
+	if (n < 4 || sha_simd < SHA_SIMD_SSSE3)
+		return 0;
+	if (sha_simd >= SHA_SIMD_NI && sha_ni_available())
+		return 0;
+	return sha_multi_available();
+}
+#endif
+
 static void SHA_Core_Init(uint32 h[5])
 {
 	h[0] = 0x67452301;
@@ -25,35 +65,15 @@ static void SHA_Core_Init(uint32 h[5])
 	h[4] = 0xc3d2e1f0;
 }
 
-void SHATransform(word32 * digest, word32 * block)
+/*
+* The 80 rounds, given the message schedule with the round constants
+* already added in.
+*/
+static void SHA_Rounds(word32 * digest, const word32 * wk)
 {
-	word32 w[80];
 	word32 a, b, c, d, e;
 	int t;
 
-#ifdef RANDOM_DIAGNOSTICS
-	{
-		extern int random_diagnostics;
-		if (random_diagnostics) {
-			int i;
-			printf("SHATransform:");
-			for (i = 0; i < 5; i++)
-				printf(" %08x", digest[i]);
-			printf(" +");
-			for (i = 0; i < 16; i++)
-				printf(" %08x", block[i]);
-		}
-	}
-#endif
-
-	for (t = 0; t < 16; t++)
-		w[t] = block[t];
-
-	for (t = 16; t < 80; t++) {
-		word32 tmp = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
-		w[t] = rol(tmp, 1);
-	}
-
 	a = digest[0];
 	b = digest[1];
 	c = digest[2];
@@ -61,8 +81,7 @@ void SHATransform(word32 * digest, word32 * block)
 	e = digest[4];
 
 	for (t = 0; t < 20; t++) {
-		word32 tmp =
-			rol(a, 5) + ((b & c) | (d & ~b)) + e + w[t] + 0x5a827999;
+		word32 tmp = rol(a, 5) + ((b & c) | (d & ~b)) + e + wk[t];
 		e = d;
 		d = c;
 		c = rol(b, 30);
@@ -70,7 +89,7 @@ void SHATransform(word32 * digest, word32 * block)
 		a = tmp;
 	}
 	for (t = 20; t < 40; t++) {
-		word32 tmp = rol(a, 5) + (b ^ c ^ d) + e + w[t] + 0x6ed9eba1;
+		word32 tmp = rol(a, 5) + (b ^ c ^ d) + e + wk[t];
 		e = d;
 		d = c;
 		c = rol(b, 30);
@@ -78,9 +97,7 @@ void SHATransform(word32 * digest, word32 * block)
 		a = tmp;
 	}
 	for (t = 40; t < 60; t++) {
-		word32 tmp = rol(a,
-			5) + ((b & c) | (b & d) | (c & d)) + e + w[t] +
-			0x8f1bbcdc;
+		word32 tmp = rol(a, 5) + ((b & c) | (b & d) | (c & d)) + e + wk[t];
 		e = d;
 		d = c;
 		c = rol(b, 30);
@@ -88,7 +105,7 @@ void SHATransform(word32 * digest, word32 * block)
 		a = tmp;
 	}
 	for (t = 60; t < 80; t++) {
-		word32 tmp = rol(a, 5) + (b ^ c ^ d) + e + w[t] + 0xca62c1d6;
+		word32 tmp = rol(a, 5) + (b ^ c ^ d) + e + wk[t];
 		e = d;
 		d = c;
 		c = rol(b, 30);
@@ -101,6 +118,46 @@ void SHATransform(word32 * digest, word32 * block)
 	digest[2] += c;
 	digest[3] += d;
 	digest[4] += e;
+}
+
+void SHATransform(word32 * digest, word32 * block)
+{
+	word32 w[80];
+	int t;
+
+#ifdef RANDOM_DIAGNOSTICS
+	{
+		extern int random_diagnostics;
+		if (random_diagnostics) {
+			int i;
+			printf("SHATransform:");
+			for (i = 0; i < 5; i++)
+				printf(" %08x", digest[i]);
+			printf(" +");
+			for (i = 0; i < 16; i++)
+				printf(" %08x", block[i]);
+		}
+	}
+#endif
+
+	for (t = 0; t < 16; t++)
+		w[t] = block[t];
+
+	for (t = 16; t < 80; t++) {
+		word32 tmp = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+		w[t] = rol(tmp, 1);
+	}
+
+	for (t = 0; t < 20; t++)
+		w[t] += 0x5a827999;
+	for (t = 20; t < 40; t++)
+		w[t] += 0x6ed9eba1;
+	for (t = 40; t < 60; t++)
+		w[t] += 0x8f1bbcdc;
+	for (t = 60; t < 80; t++)
+		w[t] += 0xca62c1d6;
+
+	SHA_Rounds(digest, w);
 
 #ifdef RANDOM_DIAGNOSTICS
 	{
@@ -116,6 +173,39 @@ void SHATransform(word32 * digest, word32 * block)
 #endif
 }
 
+/*
+* Process nblocks whole 64-byte blocks, with the fastest code the CPU
+* has and sha_simd allows.
+*/
+static void SHA_Blocks(uint32 * h, const unsigned char *p, int nblocks)
+{
+	word32 w[80];
+	int i;
+
+#ifdef SHA_SIMD
+	if (sha_simd >= SHA_SIMD_NI && sha_ni_available()) {
+		sha1_ni_blocks(h, p, nblocks);
+		return;
+	}
+	if (sha_simd >= SHA_SIMD_SSSE3 && sha_ssse3_available()) {
+		for (; nblocks > 0; nblocks--, p += 64) {
+			sha1_ssse3_schedule(w, p);
+			SHA_Rounds(h, w);
+		}
+		smemclr(w, sizeof(w));
+		return;
+	}
+#endif
+
+	for (; nblocks > 0; nblocks--, p += 64) {
+		/* Gather bytes big-endian into words */
+		for (i = 0; i < 16; i++)
+			w[i] = GET_32BIT_MSB_FIRST(p + i * 4);
+		SHATransform(h, w);
+	}
+	smemclr(w, sizeof(w));
+}
+
 /* ----------------------------------------------------------------------
 * Outer SHA algorithm: take an arbitrary length byte string,
 * convert it into 16-word blocks with the prescribed padding at
@@ -132,9 +222,7 @@ void SHA_Init(SHA_State * s)
 void SHA_Bytes(SHA_State * s, const void *p, int len)
 {
 	const unsigned char *q = (const unsigned char *)p;
-	uint32 wordblock[16];
 	uint32 lenw = len;
-	int i;
 
 	/*
 	* Update the length field.
@@ -148,29 +236,32 @@ void SHA_Bytes(SHA_State * s, const void *p, int len)
 		*/
 		memcpy(s->block + s->blkused, q, len);
 		s->blkused += len;
+		return;
 	}
-	else {
-		/*
-		* We must complete and process at least one block.
-		*/
-		while (s->blkused + len >= 64) {
-			memcpy(s->block + s->blkused, q, 64 - s->blkused);
-			q += 64 - s->blkused;
-			len -= 64 - s->blkused;
-			/* Now process the block. Gather bytes big-endian into words */
-			for (i = 0; i < 16; i++) {
-				wordblock[i] =
-					(((uint32)s->block[i * 4 + 0]) << 24) |
-					(((uint32)s->block[i * 4 + 1]) << 16) |
-					(((uint32)s->block[i * 4 + 2]) << 8) |
-					(((uint32)s->block[i * 4 + 3]) << 0);
-			}
-			SHATransform(s->h, wordblock);
-			s->blkused = 0;
-		}
-		memcpy(s->block, q, len);
-		s->blkused = len;
+
+	/*
+	* Complete and process the partial block, if there is one.
+	*/
+	if (s->blkused) {
+		memcpy(s->block + s->blkused, q, 64 - s->blkused);
+		q += 64 - s->blkused;
+		len -= 64 - s->blkused;
+		SHA_Blocks(s->h, s->block, 1);
+		s->blkused = 0;
+	}
+
+	/*
+	* Whole blocks can be processed straight from the caller's
+	* buffer.
+	*/
+	if (len >= 64) {
+		SHA_Blocks(s->h, q, len / 64);
+		q += len & ~63;
+		len &= 63;
 	}
+
+	memcpy(s->block, q, len);
+	s->blkused = len;
 }
 
 void SHA_Final(SHA_State * s, unsigned char *output)
@@ -221,6 +312,29 @@ void SHA_Simple(const void *p, int len, unsigned char *output)
 	smemclr(&s, sizeof(s));
 }
 
+/*
+* Hash n separate messages, p[i] of len[i] bytes, into output[i].
+*/
+void SHA_Simple_multi(int n, const void *const *p, const int *len,
+	unsigned char *const *output)
+{
+	int i;
+
+#ifdef SHA_SIMD
+	if (sha_use_multi(n)) {
+		uint32 init[5];
+
+		SHA_Core_Init(init);
+		sha1_multi(n, init, 0, (const unsigned char *const *)p, len,
+			output);
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+		SHA_Simple(p[i], len[i], output[i]);
+}
+
 /*
 * Thin abstraction for things where hashes are pluggable.
 */
@@ -276,17 +390,590 @@ static void sha1_key_internal(void *handle, unsigned char *key, int len)
 	smemclr(foo, 64);		       /* burn the evidence */
 }
 
+/* ----------------------------------------------------------------------
+* HMAC-SHA1. A context is three SHA_States: the inner and outer hashes
+* with their key blocks already absorbed, then the working copy for
+* the current message. Setting the key costs two compressions, once;
+* after that each MAC only pays for its own data and the two final
+* blocks.
+*/
+
+void *hmacsha1_make_context(void)
+{
+	return snewn(3, SHA_State);
+}
+
+void hmacsha1_free_context(void *handle)
+{
+	smemclr(handle, 3 * sizeof(SHA_State));
+	sfree(handle);
+}
+
+void hmacsha1_key(void *handle, void const *key, int len)
+{
+	sha1_key_internal(handle, (unsigned char *)key, len);
+}
+
+static void hmacsha1_key_20(void *handle, unsigned char *key)
+{
+	hmacsha1_key(handle, key, 20);
+}
+
+static void hmacsha1_start(void *handle)
+{
+	SHA_State *keys = (SHA_State *)handle;
+
+	keys[2] = keys[0];		      /* structure copy */
+}
+
+static void hmacsha1_bytes(void *handle, unsigned char const *blk, int len)
+{
+	SHA_State *keys = (SHA_State *)handle;
+
+	SHA_Bytes(&keys[2], blk, len);
+}
+
+static void hmacsha1_genresult(void *handle, unsigned char *hmac)
+{
+	SHA_State *keys = (SHA_State *)handle;
+	SHA_State s;
+	unsigned char intermediate[20];
+
+	s = keys[2];		       /* structure copy */
+	SHA_Final(&s, intermediate);
+	s = keys[1];		       /* structure copy */
+	SHA_Bytes(&s, intermediate, 20);
+	SHA_Final(&s, hmac);
+	smemclr(intermediate, sizeof(intermediate));
+}
+
+static int hmacsha1_verresult(void *handle, unsigned char const *hmac)
+{
+	unsigned char correct[20];
+	hmacsha1_genresult(handle, correct);
+	return smemeq(correct, hmac, 20);
+}
+
+static void hmacsha1_do_hmac_internal(void *handle,
+	unsigned char const *blk, int len,
+	unsigned char const *blk2, int len2,
+	unsigned char *hmac)
+{
+	hmacsha1_start(handle);
+	hmacsha1_bytes(handle, blk, len);
+	if (blk2) hmacsha1_bytes(handle, blk2, len2);
+	hmacsha1_genresult(handle, hmac);
+}
+
+void hmacsha1_do_hmac(void *handle, unsigned char const *blk, int len,
+	unsigned char *hmac)
+{
+	hmacsha1_do_hmac_internal(handle, blk, len, NULL, 0, hmac);
+}
+
+/*
+* MAC n separate messages with the same key. In the multi-buffer code
+* every message's inner hash starts from the saved inner state, with
+* the key block counted in the length; then the outer hashes are done
+* the same way.
+*/
+void hmacsha1_do_hmac_multi(void *handle, int n,
+	unsigned char const *const *blk, const int *len,
+	unsigned char *const *hmac)
+{
+	int i;
+
+#ifdef SHA_SIMD
+	if (sha_use_multi(n)) {
+		SHA_State *keys = (SHA_State *)handle;
+		unsigned char *inner = snewn(n * 20, unsigned char);
+		unsigned char **innerp = snewn(n, unsigned char *);
+		int *innerlen = snewn(n, int);
+
+		for (i = 0; i < n; i++) {
+			innerp[i] = inner + 20 * i;
+			innerlen[i] = 20;
+		}
+		sha1_multi(n, keys[0].h, 64, blk, len, innerp);
+		sha1_multi(n, keys[1].h, 64, innerp, innerlen, hmac);
+
+		smemclr(inner, n * 20);
+		sfree(inner);
+		sfree(innerp);
+		sfree(innerlen);
+		return;
+	}
+#endif
+
+	for (i = 0; i < n; i++)
+		hmacsha1_do_hmac(handle, blk[i], len[i], hmac[i]);
+}
+
+static void hmacsha1_do_hmac_ssh(void *handle, unsigned char const *blk,
+	int len, unsigned long seq, unsigned char *hmac)
+{
+	unsigned char seqbuf[4];
+
+	PUT_32BIT_MSB_FIRST(seqbuf, seq);
+	hmacsha1_do_hmac_internal(handle, seqbuf, 4, blk, len, hmac);
+}
+
+static void hmacsha1_generate(void *handle, unsigned char *blk, int len,
+	unsigned long seq)
+{
+	hmacsha1_do_hmac_ssh(handle, blk, len, seq, blk + len);
+}
+
+static int hmacsha1_verify(void *handle, unsigned char *blk, int len,
+	unsigned long seq)
+{
+	unsigned char correct[20];
+	hmacsha1_do_hmac_ssh(handle, blk, len, seq, correct);
+	return smemeq(correct, blk + len, 20);
+}
+
+const struct ssh_mac ssh_hmac_sha1 = {
+	hmacsha1_make_context, hmacsha1_free_context, hmacsha1_key_20,
+	hmacsha1_generate, hmacsha1_verify,
+	hmacsha1_start, hmacsha1_bytes, hmacsha1_genresult, hmacsha1_verresult,
+	"hmac-sha1",
+	20,
+	"HMAC-SHA1"
+};
 
 //389
 void hmac_sha1_simple(void *key, int keylen, void *data, int datalen,
 	unsigned char *output) {
-	SHA_State states[2];
-	unsigned char intermediate[20];
+	SHA_State states[3];
+
+	hmacsha1_key(states, key, keylen);
+	hmacsha1_do_hmac(states, (unsigned char *)data, datalen, output);
+	smemclr(states, sizeof(states));
+}
+
+#ifdef TEST
+
+/*
+* This tests SHA-1 and SHA-256 (sshsh256.cpp), with each of their
+* implementations the CPU can run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *const simd_names[] = { "portable", "ssse3   ", "sha-ni  " };
+
+static const struct ssh_hash *const hashes[] = { &ssh_sha1, &ssh_sha256 };
+static void (*const simple_multi[])(int, const void *const *, const int *,
+	unsigned char *const *) = { SHA_Simple_multi, SHA256_Simple_multi };
+
+/*
+* Whether the CPU can run the code for the given sha_set_simd level.
+*/
+static int simd_usable(int level) {
+#ifdef SHA_SIMD
+	return level == SHA_SIMD_NONE ||
+		(level == SHA_SIMD_SSSE3 && sha_ssse3_available()) ||
+		(level == SHA_SIMD_NI && sha_ni_available());
+#else
+	return level == SHA_SIMD_NONE;
+#endif
+}
 
-	sha1_key_internal(states, (unsigned char *)key, keylen);
-	SHA_Bytes(&states[0], data, datalen);
-	SHA_Final(&states[0], intermediate);
+static int sha_use_multi_test(int n) {
+#ifdef SHA_SIMD
+	return sha_use_multi(n);
+#else
+	return 0;
+#endif
+}
+
+static void hash_simple(const struct ssh_hash *h, const void *p, int len,
+	unsigned char *output) {
+	void *ctx = h->init();
+	h->bytes(ctx, (void *)p, len);
+	h->final(ctx, output);
+}
+
+/*
+* 'sshsha --bench' measures throughput for a few message lengths,
+* with each implementation the CPU can run.
+*/
+static void bench(void) {
+	static const int sizes[] = { 64, 1024, 65536 };
+	static unsigned char buf[65536];
+	unsigned char digest[32];
+	int s, level, hi;
+	long i, reps;
+
+	for (i = 0; i < (long)sizeof(buf); i++)
+		buf[i] = (unsigned char)(i * 7 + 1);
+
+	for (hi = 0; hi < (int)lenof(hashes); hi++) {
+		for (level = SHA_SIMD_NONE; level <= SHA_SIMD_NI; level++) {
+			/* SHA-256 has no SSSE3 code of its own */
+			if (!simd_usable(level) ||
+				(hashes[hi] == &ssh_sha256 && level == SHA_SIMD_SSSE3))
+				continue;
+			sha_set_simd(level);
+			for (s = 0; s < (int)lenof(sizes); s++) {
+				clock_t start;
+				double secs;
+
+				reps = (64L << 20) / sizes[s];
+				start = clock();
+				for (i = 0; i < reps; i++)
+					hash_simple(hashes[hi], buf, sizes[s], digest);
+				secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+				printf("%-7s %s %5d bytes: %.1f MB/s\n",
+					hashes[hi]->text_name, simd_names[level], sizes[s],
+					reps * (double)sizes[s] / secs / 1e6);
+			}
+		}
+	}
+	sha_set_simd(SHA_SIMD_NI);
+
+	/*
+	* Many short messages at once, which is what the multi-buffer code
+	* is for.
+	*/
+	for (hi = 0; hi < (int)lenof(hashes); hi++) {
+		static const void *ptrs[64];
+		static unsigned char out[64][32];
+		unsigned char *outp[64];
+		int lens[64];
+
+		for (i = 0; i < 64; i++) {
+			ptrs[i] = buf + 1024 * i;
+			outp[i] = out[i];
+		}
+		for (level = SHA_SIMD_NONE; level <= SHA_SIMD_NI; level++) {
+			if (!simd_usable(level))
+				continue;
+			sha_set_simd(level);
+			for (s = 0; s < 2; s++) {
+				clock_t start;
+				double secs;
+
+				for (i = 0; i < 64; i++)
+					lens[i] = sizes[s];
+				reps = (64L << 20) / (64 * sizes[s]);
+				start = clock();
+				for (i = 0; i < reps; i++)
+					simple_multi[hi](64, ptrs, lens, outp);
+				secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+				printf("%-7s %s %5d bytes x64: %.1f MB/s%s\n",
+					hashes[hi]->text_name, simd_names[level], sizes[s],
+					reps * 64.0 * sizes[s] / secs / 1e6,
+					sha_use_multi_test(64) ? " (multi-buffer)" : "");
+			}
+		}
+	}
+	sha_set_simd(SHA_SIMD_NI);
+
+	/*
+	* HMAC on short messages, keying a fresh context every time and
+	* reusing one keyed context.
+	*/
+	{
+		SHA_State states[3];
+		clock_t start;
+		double secs;
+
+		reps = 1L << 20;
+		start = clock();
+		for (i = 0; i < reps; i++)
+			hmac_sha1_simple(buf, 20, buf + 64, 64, digest);
+		secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("HMAC-SHA1 rekeyed each time:  %.0f ns/MAC\n",
+			secs / reps * 1e9);
+
+		hmacsha1_key(states, buf, 20);
+		start = clock();
+		for (i = 0; i < reps; i++)
+			hmacsha1_do_hmac(states, buf + 64, 64, digest);
+		secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("HMAC-SHA1 keyed context:      %.0f ns/MAC\n",
+			secs / reps * 1e9);
+	}
+}
+
+static void from_hex(const char *hex, unsigned char *out) {
+	for (; hex[0] && hex[1]; hex += 2) {
+		unsigned int byte;
+		sscanf(hex, "%2x", &byte);
+		*out++ = (unsigned char)byte;
+	}
+}
+
+int main(int argc, char **argv) {
+	unsigned char digest[32];
+	int i, j, hi, errors;
+
+	struct {
+		const char *teststring;
+		unsigned char digest1[20];
+		unsigned char digest256[32];
+	} tests[] = {
+		{ "abc", {
+			0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+			0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d,
+		}, {
+			0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+			0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+			0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+			0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+		} },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", {
+			0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae,
+			0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1,
+		}, {
+			0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+			0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+			0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+			0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1,
+		} },
+		{ NULL, {
+			0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+			0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f,
+		}, {
+			0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92,
+			0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+			0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+			0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0,
+		} },
+	};
+
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench();
+		return 0;
+	}
+
+	errors = 0;
+
+	for (hi = 0; hi < (int)lenof(hashes); hi++) {
+		const struct ssh_hash *h = hashes[hi];
+
+		for (i = 0; i < (int)lenof(tests); i++) {
+			const unsigned char *expected = h == &ssh_sha1 ?
+				tests[i].digest1 : tests[i].digest256;
 
-	SHA_Bytes(&states[1], intermediate, 20);
-	SHA_Final(&states[1], output);
+			if (tests[i].teststring) {
+				hash_simple(h, tests[i].teststring,
+					strlen(tests[i].teststring), digest);
+			}
+			else {
+				void *ctx = h->init();
+				int n;
+				for (n = 0; n < 1000000 / 40; n++)
+					h->bytes(ctx, (void *)"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+					40);
+				h->final(ctx, digest);
+			}
+			for (j = 0; j < h->hlen; j++) {
+				if (digest[j] != expected[j]) {
+					fprintf(stderr,
+						"%s \"%s\" digest byte %d should be 0x%02x, "
+						"is 0x%02x\n", h->text_name, tests[i].teststring,
+						j, expected[j], digest[j]);
+					errors++;
+				}
+			}
+		}
+	}
+
+	/*
+	* Every length up to a few blocks, fed in one go and in uneven
+	* pieces, with each implementation, must agree with the portable
+	* code.
+	*/
+	for (hi = 0; hi < (int)lenof(hashes); hi++) {
+		const struct ssh_hash *h = hashes[hi];
+		static unsigned char buf[300];
+		unsigned char ref[32];
+		int len, level, step;
+
+		for (i = 0; i < (int)sizeof(buf); i++)
+			buf[i] = (unsigned char)(i * 37 + 11);
+
+		for (len = 0; len <= (int)sizeof(buf); len++) {
+			sha_set_simd(SHA_SIMD_NONE);
+			hash_simple(h, buf, len, ref);
+			for (level = SHA_SIMD_NONE; level <= SHA_SIMD_NI; level++) {
+				if (!simd_usable(level))
+					continue;
+				sha_set_simd(level);
+				for (step = 1; step <= 129; step += 64) {
+					void *ctx = h->init();
+					int done;
+
+					for (done = 0; done < len; done += step)
+						h->bytes(ctx, buf + done,
+							len - done < step ? len - done : step);
+					h->final(ctx, digest);
+					if (memcmp(digest, ref, h->hlen)) {
+						fprintf(stderr, "%s length %d in steps of %d with "
+							"%s: wrong digest\n", h->text_name, len, step,
+							simd_names[level]);
+						errors++;
+					}
+				}
+			}
+		}
+		sha_set_simd(SHA_SIMD_NI);
+	}
+
+	/*
+	* The _multi functions, over a batch of messages of every length up
+	* to a few blocks and over a few short batches, must agree with
+	* hashing and MACing one message at a time.
+	*/
+	{
+		static unsigned char buf[300], out[301][32];
+		static const void *ptrs[301];
+		static unsigned char *outp[301];
+		static int lens[301];
+		static const int batches[] = { 1, 2, 3, 4, 5, 7, 8, 9, 17, 301 };
+		unsigned char key[20], ref[32];
+		void *ctx1 = hmacsha1_make_context();
+		void *ctx256 = hmacsha256_make_context();
+		int level, b, n, start;
+
+		for (i = 0; i < (int)sizeof(buf); i++)
+			buf[i] = (unsigned char)(i * 53 + 5);
+		for (i = 0; i < 20; i++)
+			key[i] = (unsigned char)(i * 3 + 1);
+		hmacsha1_key(ctx1, key, 20);
+		hmacsha256_key(ctx256, key, 20);
+
+		for (level = SHA_SIMD_NONE; level <= SHA_SIMD_NI; level++) {
+			if (!simd_usable(level))
+				continue;
+			sha_set_simd(level);
+			for (b = 0; b < (int)lenof(batches); b++) {
+				n = batches[b];
+				/* lengths 0..300 for the big batch, mixed otherwise */
+				for (i = 0; i < n; i++) {
+					start = n == 301 ? 0 : (i * 97) % 200;
+					lens[i] = n == 301 ? i : (i * 61 + 30) % 100;
+					ptrs[i] = buf + start;
+					outp[i] = out[i];
+				}
+
+				for (hi = 0; hi < (int)lenof(hashes); hi++) {
+					const struct ssh_hash *h = hashes[hi];
+
+					simple_multi[hi](n, ptrs, lens, outp);
+					for (i = 0; i < n; i++) {
+						hash_simple(h, ptrs[i], lens[i], ref);
+						if (memcmp(out[i], ref, h->hlen)) {
+							fprintf(stderr, "%s multi %d/%d with %s: "
+								"wrong digest\n", h->text_name, i, n,
+								simd_names[level]);
+							errors++;
+						}
+					}
+				}
+
+				hmacsha1_do_hmac_multi(ctx1, n,
+					(unsigned char const *const *)ptrs, lens, outp);
+				for (i = 0; i < n; i++) {
+					hmacsha1_do_hmac(ctx1, (unsigned char const *)ptrs[i],
+						lens[i], ref);
+					if (memcmp(out[i], ref, 20)) {
+						fprintf(stderr, "HMAC-SHA1 multi %d/%d with %s: "
+							"wrong MAC\n", i, n, simd_names[level]);
+						errors++;
+					}
+				}
+				hmacsha256_do_hmac_multi(ctx256, n,
+					(unsigned char const *const *)ptrs, lens, outp);
+				for (i = 0; i < n; i++) {
+					hmacsha256_do_hmac(ctx256,
+						(unsigned char const *)ptrs[i], lens[i], ref);
+					if (memcmp(out[i], ref, 32)) {
+						fprintf(stderr, "HMAC-SHA-256 multi %d/%d with %s: "
+							"wrong MAC\n", i, n, simd_names[level]);
+						errors++;
+					}
+				}
+			}
+		}
+		sha_set_simd(SHA_SIMD_NI);
+		hmacsha1_free_context(ctx1);
+		hmacsha256_free_context(ctx256);
+	}
+
+	/*
+	* HMAC test vectors from RFC 2202 and RFC 4231. Each context is
+	* keyed once and then used for the message twice, to check that
+	* the saved inner and outer states aren't disturbed.
+	*/
+	{
+		static const struct {
+			const char *key, *data, *mac1, *mac256;
+		} hmac_tests[] = {
+			{ "0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b", "Hi There",
+			"b617318655057264e28bc0b6fb378c8ef146be00",
+			"b0344c61d8db38535ca8afceaf0bf12b"
+			"881dc200c9833da726e9376c2e32cff7" },
+			{ "4a656665", "what do ya want for nothing?",
+			"effcdf6ae5eb2fa2d27416d5f184df9c259a7c79",
+			"5bdcc146bf60754e6a042426089575c7"
+			"5a003f089d2739839dec58b964ec3843" },
+		};
+		unsigned char key[64], expected[32];
+
+		for (i = 0; i < (int)lenof(hmac_tests); i++) {
+			void *ctx1 = hmacsha1_make_context();
+			void *ctx256 = hmacsha256_make_context();
+			int keylen = strlen(hmac_tests[i].key) / 2;
+			int datalen = strlen(hmac_tests[i].data);
+			int rep;
+
+			from_hex(hmac_tests[i].key, key);
+			hmacsha1_key(ctx1, key, keylen);
+			hmacsha256_key(ctx256, key, keylen);
+			for (rep = 0; rep < 2; rep++) {
+				hmacsha1_do_hmac(ctx1,
+					(unsigned char const *)hmac_tests[i].data, datalen,
+					digest);
+				from_hex(hmac_tests[i].mac1, expected);
+				if (memcmp(digest, expected, 20)) {
+					fprintf(stderr, "HMAC-SHA1 test %d pass %d: wrong "
+						"MAC\n", i + 1, rep + 1);
+					errors++;
+				}
+
+				hmacsha256_do_hmac(ctx256,
+					(unsigned char const *)hmac_tests[i].data, datalen,
+					digest);
+				from_hex(hmac_tests[i].mac256, expected);
+				if (memcmp(digest, expected, 32)) {
+					fprintf(stderr, "HMAC-SHA-256 test %d pass %d: wrong "
+						"MAC\n", i + 1, rep + 1);
+					errors++;
+				}
+			}
+
+			hmac_sha1_simple(key, keylen, (void *)hmac_tests[i].data,
+				datalen, digest);
+			from_hex(hmac_tests[i].mac1, expected);
+			if (memcmp(digest, expected, 20)) {
+				fprintf(stderr, "hmac_sha1_simple test %d: wrong MAC\n",
+					i + 1);
+				errors++;
+			}
+
+			hmacsha1_free_context(ctx1);
+			hmacsha256_free_context(ctx256);
+		}
+	}
+
+	printf("%d errors\n", errors);
+
+	return 0;
 }
+
+#endif
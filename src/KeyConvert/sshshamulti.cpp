@@ -0,0 +1,316 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* Multi-buffer SHA-1 and SHA-256 with AVX2: eight independent messages
+* are hashed in lockstep, one in each 32-bit lane of the vector
+* registers, so each vector instruction does a step of eight hashes.
+* This is for CPUs without the SHA extensions; with them, hashing the
+* messages one after another with sshshasimd.cpp is faster still.
+*/
+
+#include "ssh.h"
+
+#ifdef SHA_SIMD
+
+#include <immintrin.h>
+
+#if defined __GNUC__ || defined __clang__
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+/*
+* Check whether the CPU has AVX2, and whether the OS saves the
+* YMM registers across context switches.
+*/
+int sha_multi_available(void)
+{
+	return cpu_has_avx2();
+}
+
+#define LANES 8
+
+#define ROL(x,y) _mm256_or_si256(_mm256_slli_epi32(x, y), \
+				 _mm256_srli_epi32(x, 32 - (y)))
+#define ROR(x,y) _mm256_or_si256(_mm256_srli_epi32(x, y), \
+				 _mm256_slli_epi32(x, 32 - (y)))
+#define ADD(x,y) _mm256_add_epi32(x, y)
+#define XOR(x,y) _mm256_xor_si256(x, y)
+#define AND(x,y) _mm256_and_si256(x, y)
+#define OR(x,y) _mm256_or_si256(x, y)
+
+/*
+* Load the next block of each lane's message into w[0..15], so that
+* w[t] holds word t of all eight blocks. Each half of a block is
+* loaded as it is, then an 8x8 transpose turns lanes into words.
+*/
+AVX2_TARGET static void load_blocks(__m256i *w,
+	const unsigned char *const *p)
+{
+	/* Reverse the bytes of each 32-bit word */
+	const __m256i bswap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8], t[8], u[8];
+	int half, i;
+
+	for (half = 0; half < 2; half++) {
+		for (i = 0; i < 8; i++)
+			r[i] = _mm256_loadu_si256((const __m256i *)(p[i] + half * 32));
+
+		for (i = 0; i < 8; i += 2) {
+			t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+			t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+		}
+		for (i = 0; i < 8; i += 4) {
+			u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+			u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+			u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+			u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+		}
+		for (i = 0; i < 4; i++) {
+			w[half * 8 + i] = _mm256_shuffle_epi8(
+				_mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+			w[half * 8 + i + 4] = _mm256_shuffle_epi8(
+				_mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+		}
+	}
+
+	smemclr(r, sizeof(r));
+	smemclr(t, sizeof(t));
+	smemclr(u, sizeof(u));
+}
+
+/*
+* One block of SHA-1 in each lane. h holds the five state words of
+* each lane, word-major: h[8*i + lane].
+*/
+AVX2_TARGET static void sha1_lanes(uint32 *h, const unsigned char *const *p,
+	const uint32 *k)
+{
+	__m256i w[16];
+	__m256i a, b, c, d, e, f, kt, tmp;
+	int t;
+
+	(void)k;
+	load_blocks(w, p);
+
+	a = _mm256_loadu_si256((const __m256i *)(h + 0));
+	b = _mm256_loadu_si256((const __m256i *)(h + 8));
+	c = _mm256_loadu_si256((const __m256i *)(h + 16));
+	d = _mm256_loadu_si256((const __m256i *)(h + 24));
+	e = _mm256_loadu_si256((const __m256i *)(h + 32));
+
+	for (t = 0; t < 80; t++) {
+		if (t >= 16) {
+			tmp = XOR(XOR(w[(t - 3) & 15], w[(t - 8) & 15]),
+				XOR(w[(t - 14) & 15], w[t & 15]));
+			w[t & 15] = ROL(tmp, 1);
+		}
+		if (t < 20) {
+			f = XOR(d, AND(b, XOR(c, d)));
+			kt = _mm256_set1_epi32(0x5a827999);
+		}
+		else if (t < 40) {
+			f = XOR(XOR(b, c), d);
+			kt = _mm256_set1_epi32(0x6ed9eba1);
+		}
+		else if (t < 60) {
+			f = OR(AND(b, c), AND(d, OR(b, c)));
+			kt = _mm256_set1_epi32(0x8f1bbcdc);
+		}
+		else {
+			f = XOR(XOR(b, c), d);
+			kt = _mm256_set1_epi32(0xca62c1d6);
+		}
+		tmp = ADD(ADD(ROL(a, 5), f), ADD(ADD(e, kt), w[t & 15]));
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = tmp;
+	}
+
+#define UPDATE(i, x) _mm256_storeu_si256((__m256i *)(h + 8 * (i)), \
+	ADD(_mm256_loadu_si256((const __m256i *)(h + 8 * (i))), x))
+	UPDATE(0, a);
+	UPDATE(1, b);
+	UPDATE(2, c);
+	UPDATE(3, d);
+	UPDATE(4, e);
+
+	/* The schedule holds the message (which may be a key) */
+	smemclr(w, sizeof(w));
+}
+
+/*
+* One block of SHA-256 in each lane, laid out as for sha1_lanes.
+*/
+AVX2_TARGET static void sha256_lanes(uint32 *h, const unsigned char *const *p,
+	const uint32 *k)
+{
+	__m256i w[16];
+	__m256i a, b, c, d, e, f, g, hh, t1, t2, s0, s1;
+	int t;
+
+	load_blocks(w, p);
+
+	a = _mm256_loadu_si256((const __m256i *)(h + 0));
+	b = _mm256_loadu_si256((const __m256i *)(h + 8));
+	c = _mm256_loadu_si256((const __m256i *)(h + 16));
+	d = _mm256_loadu_si256((const __m256i *)(h + 24));
+	e = _mm256_loadu_si256((const __m256i *)(h + 32));
+	f = _mm256_loadu_si256((const __m256i *)(h + 40));
+	g = _mm256_loadu_si256((const __m256i *)(h + 48));
+	hh = _mm256_loadu_si256((const __m256i *)(h + 56));
+
+	for (t = 0; t < 64; t++) {
+		if (t >= 16) {
+			__m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+			s0 = XOR(XOR(ROR(w15, 7), ROR(w15, 18)),
+				_mm256_srli_epi32(w15, 3));
+			s1 = XOR(XOR(ROR(w2, 17), ROR(w2, 19)),
+				_mm256_srli_epi32(w2, 10));
+			w[t & 15] = ADD(ADD(w[t & 15], s0), ADD(w[(t - 7) & 15], s1));
+		}
+		s1 = XOR(XOR(ROR(e, 6), ROR(e, 11)), ROR(e, 25));
+		t1 = ADD(ADD(hh, s1), XOR(g, AND(e, XOR(f, g))));
+		t1 = ADD(t1, ADD(_mm256_set1_epi32(k[t]), w[t & 15]));
+		s0 = XOR(XOR(ROR(a, 2), ROR(a, 13)), ROR(a, 22));
+		t2 = ADD(s0, OR(AND(a, b), AND(c, OR(a, b))));
+		hh = g;
+		g = f;
+		f = e;
+		e = ADD(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = ADD(t1, t2);
+	}
+
+	UPDATE(0, a);
+	UPDATE(1, b);
+	UPDATE(2, c);
+	UPDATE(3, d);
+	UPDATE(4, e);
+	UPDATE(5, f);
+	UPDATE(6, g);
+	UPDATE(7, hh);
+#undef UPDATE
+
+	smemclr(w, sizeof(w));
+}
+
+typedef void (*lanes_fn)(uint32 *h, const unsigned char *const *p,
+	const uint32 *k);
+
+/*
+* Hash n messages, feeding them through the lanes: whenever a lane's
+* message is finished, the next waiting message takes the lane over.
+* Every message starts from the state init (hwords words), as if
+* prefix bytes had already been hashed, and its digest goes to out[i].
+*
+* A message's final one or two blocks, holding its last partial block
+* and the padding, are built in tail[] when it takes its lane, and
+* the lane goes on to them after the message's whole blocks. Lanes
+* with nothing to do hash a block of zeros and are ignored.
+*/
+static void sha_multi(lanes_fn lanes, int hwords, const uint32 *init,
+	int prefix, int n, const unsigned char *const *p, const int *len,
+	unsigned char *const *out, const uint32 *k)
+{
+	static const unsigned char idle[64] = { 0 };
+	uint32 h[8 * LANES];
+	unsigned char tail[LANES][128];
+	const unsigned char *lp[LANES];    /* next block in each lane */
+	int left[LANES];		       /* blocks before lp must move */
+	int msg[LANES];			       /* message in each lane, or -1 */
+	int ntail[LANES];		       /* tail blocks still to come */
+	int next, lane, busy, i;
+
+	next = 0;
+	for (lane = 0; lane < LANES; lane++)
+		msg[lane] = -1;
+
+	do {
+		/*
+		* Finish off any lane that has run out of blocks, and give
+		* it the next message.
+		*/
+		busy = 0;
+		for (lane = 0; lane < LANES; lane++) {
+			if (msg[lane] >= 0 && left[lane] == 0 && ntail[lane]) {
+				lp[lane] = tail[lane];
+				left[lane] = ntail[lane];
+				ntail[lane] = 0;
+			}
+			if (msg[lane] >= 0 && left[lane] == 0) {
+				for (i = 0; i < hwords; i++)
+					PUT_32BIT_MSB_FIRST(out[msg[lane]] + 4 * i,
+						h[8 * i + lane]);
+				msg[lane] = -1;
+			}
+			if (msg[lane] < 0 && next < n) {
+				int whole = len[next] / 64, r = len[next] % 64;
+				uint32 bitshi, bitslo;
+
+				msg[lane] = next;
+				lp[lane] = p[next];
+				left[lane] = whole;
+				ntail[lane] = r < 56 ? 1 : 2;
+
+				memcpy(tail[lane], p[next] + whole * 64, r);
+				tail[lane][r] = 0x80;
+				memset(tail[lane] + r + 1, 0, ntail[lane] * 64 - 8 - r - 1);
+				bitshi = (uint32)(((unsigned long long)prefix + len[next])
+					>> 29);
+				bitslo = (uint32)(prefix + len[next]) << 3;
+				PUT_32BIT_MSB_FIRST(tail[lane] + ntail[lane] * 64 - 8, bitshi);
+				PUT_32BIT_MSB_FIRST(tail[lane] + ntail[lane] * 64 - 4, bitslo);
+				if (!left[lane]) {
+					lp[lane] = tail[lane];
+					left[lane] = ntail[lane];
+					ntail[lane] = 0;
+				}
+
+				for (i = 0; i < hwords; i++)
+					h[8 * i + lane] = init[i];
+				next++;
+			}
+			if (msg[lane] < 0)
+				lp[lane] = idle;
+			else
+				busy = 1;
+		}
+
+		if (busy) {
+			lanes(h, lp, k);
+			for (lane = 0; lane < LANES; lane++) {
+				if (msg[lane] >= 0) {
+					lp[lane] += 64;
+					left[lane]--;
+				}
+			}
+		}
+	} while (busy);
+
+	smemclr(h, sizeof(h));
+	smemclr(tail, sizeof(tail));
+}
+
+void sha1_multi(int n, const uint32 *init, int prefix,
+	const unsigned char *const *p, const int *len, unsigned char *const *out)
+{
+	sha_multi(sha1_lanes, 5, init, prefix, n, p, len, out, NULL);
+}
+
+void sha256_multi(int n, const uint32 *init, int prefix,
+	const unsigned char *const *p, const int *len, unsigned char *const *out,
+	const uint32 *k)
+{
+	sha_multi(sha256_lanes, 8, init, prefix, n, p, len, out, k);
+}
+
+#endif
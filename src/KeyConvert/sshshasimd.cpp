@@ -0,0 +1,248 @@
+// Copyright Amazon.com, Inc. or its affiliates. All Rights Reserved.
+// SPDX-License-Identifier: MIT-0
+
+/*
+* SHA-1 and SHA-256 using the x86 SHA extensions (SHA-NI), which do
+* several rounds or one step of the message schedule per instruction,
+* and, for CPUs without them, an SSSE3 SHA-1 message schedule feeding
+* the ordinary rounds in sshsha.cpp.
+*/
+
+#include "ssh.h"
+
+#ifdef SHA_SIMD
+
+#include <immintrin.h>
+
+#if defined __GNUC__ || defined __clang__
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#else
+#define SHANI_TARGET
+#define SSSE3_TARGET
+#endif
+
+int sha_ssse3_available(void)
+{
+	unsigned int c1, b7;
+
+	cpu_cpuid(&c1, &b7);
+	return (c1 & (1U << 9)) != 0;      /* SSSE3 */
+}
+
+int sha_ni_available(void)
+{
+	unsigned int c1, b7;
+
+	cpu_cpuid(&c1, &b7);
+	/* SHA is CPUID.7.0:EBX bit 29; we also use SSSE3 and SSE4.1 */
+	return (b7 & (1U << 29)) && (c1 & (1U << 9)) && (c1 & (1U << 19));
+}
+
+/*
+* Four rounds of SHA-1 with the SHA extensions: group i (rounds 4i to
+* 4i+3) takes its message words from m0, and finishes off or moves on
+* the words for groups i+1, i+2 and i+3 in m1, m2 and m3 as far as it
+* can. The E value for the group is built in ea; eb saves abcd, which
+* becomes the next group's E.
+*/
+#define SHA1_ROUNDS4(i, ea, eb, m0, m1, m2, m3) \
+	ea = _mm_sha1nexte_epu32(ea, m0); \
+	eb = abcd; \
+	if ((i) >= 3 && (i) <= 18) \
+		m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, ea, (i) / 5); \
+	if ((i) >= 1 && (i) <= 16) \
+		m3 = _mm_sha1msg1_epu32(m3, m0); \
+	if ((i) >= 2 && (i) <= 17) \
+		m2 = _mm_xor_si128(m2, m0)
+
+SHANI_TARGET void sha1_ni_blocks(uint32 *h, const unsigned char *p,
+	int nblocks)
+{
+	/* Reverse all sixteen bytes, so that word 0 ends up in lane 3 */
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+		0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e1, e_save, msg0, msg1, msg2, msg3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1B);
+	e0 = _mm_set_epi32(h[4], 0, 0, 0);
+	msg2 = msg3 = _mm_setzero_si128();
+
+	for (; nblocks > 0; nblocks--, p += 64) {
+		abcd_save = abcd;
+		e_save = e0;
+
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+		e0 = _mm_add_epi32(e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		msg1 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 16)), bswap);
+		SHA1_ROUNDS4(1, e1, e0, msg1, msg2, msg3, msg0);
+		msg2 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 32)), bswap);
+		SHA1_ROUNDS4(2, e0, e1, msg2, msg3, msg0, msg1);
+		msg3 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 48)), bswap);
+		SHA1_ROUNDS4(3, e1, e0, msg3, msg0, msg1, msg2);
+
+		SHA1_ROUNDS4(4, e0, e1, msg0, msg1, msg2, msg3);
+		SHA1_ROUNDS4(5, e1, e0, msg1, msg2, msg3, msg0);
+		SHA1_ROUNDS4(6, e0, e1, msg2, msg3, msg0, msg1);
+		SHA1_ROUNDS4(7, e1, e0, msg3, msg0, msg1, msg2);
+		SHA1_ROUNDS4(8, e0, e1, msg0, msg1, msg2, msg3);
+		SHA1_ROUNDS4(9, e1, e0, msg1, msg2, msg3, msg0);
+		SHA1_ROUNDS4(10, e0, e1, msg2, msg3, msg0, msg1);
+		SHA1_ROUNDS4(11, e1, e0, msg3, msg0, msg1, msg2);
+		SHA1_ROUNDS4(12, e0, e1, msg0, msg1, msg2, msg3);
+		SHA1_ROUNDS4(13, e1, e0, msg1, msg2, msg3, msg0);
+		SHA1_ROUNDS4(14, e0, e1, msg2, msg3, msg0, msg1);
+		SHA1_ROUNDS4(15, e1, e0, msg3, msg0, msg1, msg2);
+		SHA1_ROUNDS4(16, e0, e1, msg0, msg1, msg2, msg3);
+		SHA1_ROUNDS4(17, e1, e0, msg1, msg2, msg3, msg0);
+		SHA1_ROUNDS4(18, e0, e1, msg2, msg3, msg0, msg1);
+		SHA1_ROUNDS4(19, e1, e0, msg3, msg0, msg1, msg2);
+
+		e0 = _mm_sha1nexte_epu32(e0, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1B));
+	h[4] = _mm_extract_epi32(e0, 3);
+}
+
+#define ROL1(x) _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31))
+
+/*
+* The SHA-1 message schedule with SSSE3, four words at a time: expand
+* a 64-byte block into wk[0..79], the schedule words plus the round
+* constants, as SHA_Rounds in sshsha.cpp wants them.
+*
+* The last sixteen words are kept in w0..w3, oldest first. Of the four
+* new words, the last depends on the first (w[t+3] on w[t]), so it is
+* worked out without it and then fixed up.
+*/
+SSSE3_TARGET void sha1_ssse3_schedule(uint32 *wk, const unsigned char *block)
+{
+	/* Reverse the bytes of each 32-bit lane */
+	const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+		4, 5, 6, 7, 0, 1, 2, 3);
+	static const uint32 k[4] = {
+		0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+	};
+	__m128i w0, w1, w2, w3, v;
+	int t;
+
+#define LOAD(w,t) \
+	w = _mm_shuffle_epi8(_mm_loadu_si128( \
+		(const __m128i *)(block + (t) * 4)), bswap); \
+	_mm_storeu_si128((__m128i *)(wk + (t)), \
+		_mm_add_epi32(w, _mm_set1_epi32(k[0])))
+
+	LOAD(w0, 0);
+	LOAD(w1, 4);
+	LOAD(w2, 8);
+	LOAD(w3, 12);
+
+	for (t = 16; t < 80; t += 4) {
+		/* w[t-3..t] ^ w[t-8..] ^ w[t-14..] ^ w[t-16..], w[t] as 0 */
+		v = _mm_xor_si128(_mm_srli_si128(w3, 4), w2);
+		v = _mm_xor_si128(v, _mm_alignr_epi8(w1, w0, 8));
+		v = ROL1(_mm_xor_si128(v, w0));
+		/* now put back w[t] in the top word */
+		v = _mm_xor_si128(v, ROL1(_mm_slli_si128(v, 12)));
+
+		w0 = w1;
+		w1 = w2;
+		w2 = w3;
+		w3 = v;
+		_mm_storeu_si128((__m128i *)(wk + t),
+			_mm_add_epi32(v, _mm_set1_epi32(k[t / 20])));
+	}
+}
+
+/*
+* Four rounds of SHA-256 with the SHA extensions: group i (rounds 4i
+* to 4i+3) takes its message words from m0, finishes off the words for
+* group i+1 in m1 (which needs m3, the words for group i-1), and
+* starts those for group i+3 in m3. sha256rnds2 does two rounds, on
+* the low two words of msg.
+*/
+#define SHA256_ROUNDS4(i, m0, m1, m3) \
+	msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *)(k + 4 * (i)))); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+	if ((i) >= 3 && (i) <= 14) { \
+		m1 = _mm_add_epi32(m1, _mm_alignr_epi8(m0, m3, 4)); \
+		m1 = _mm_sha256msg2_epu32(m1, m0); \
+	} \
+	msg = _mm_shuffle_epi32(msg, 0x0E); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, msg); \
+	if ((i) >= 1 && (i) <= 12) \
+		m3 = _mm_sha256msg1_epu32(m3, m0)
+
+/*
+* SHA-256 over nblocks whole 64-byte blocks, with the round constants
+* k from sshsh256.cpp.
+*/
+SHANI_TARGET void sha256_ni_blocks(uint32 *h, const unsigned char *p,
+	int nblocks, const uint32 *k)
+{
+	/* Reverse the bytes of each 32-bit lane */
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+		0x0405060700010203ULL);
+	__m128i state0, state1, abef_save, cdgh_save, msg, tmp;
+	__m128i msg0, msg1, msg2, msg3;
+
+	/*
+	* The instructions want the state as ABEF and CDGH (A in the top
+	* lane), not ABCD and EFGH.
+	*/
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xB1);
+	state1 = _mm_shuffle_epi32(
+		_mm_loadu_si128((const __m128i *)(h + 4)), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+	msg1 = msg2 = msg3 = _mm_setzero_si128();
+
+	for (; nblocks > 0; nblocks--, p += 64) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+		SHA256_ROUNDS4(0, msg0, msg1, msg3);
+		msg1 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 16)), bswap);
+		SHA256_ROUNDS4(1, msg1, msg2, msg0);
+		msg2 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 32)), bswap);
+		SHA256_ROUNDS4(2, msg2, msg3, msg1);
+		msg3 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(p + 48)), bswap);
+		SHA256_ROUNDS4(3, msg3, msg0, msg2);
+
+		SHA256_ROUNDS4(4, msg0, msg1, msg3);
+		SHA256_ROUNDS4(5, msg1, msg2, msg0);
+		SHA256_ROUNDS4(6, msg2, msg3, msg1);
+		SHA256_ROUNDS4(7, msg3, msg0, msg2);
+		SHA256_ROUNDS4(8, msg0, msg1, msg3);
+		SHA256_ROUNDS4(9, msg1, msg2, msg0);
+		SHA256_ROUNDS4(10, msg2, msg3, msg1);
+		SHA256_ROUNDS4(11, msg3, msg0, msg2);
+		SHA256_ROUNDS4(12, msg0, msg1, msg3);
+		SHA256_ROUNDS4(13, msg1, msg2, msg0);
+		SHA256_ROUNDS4(14, msg2, msg3, msg1);
+		SHA256_ROUNDS4(15, msg3, msg0, msg2);
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((__m128i *)h, _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#endif
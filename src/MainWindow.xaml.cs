@@ -692,10 +692,13 @@ namespace GameLiftRemotePlus
             {
                 string path = Path.GetDirectoryName(Assembly.GetExecutingAssembly().Location);
                 string secret = giares.InstanceAccess.Credentials.Secret;
-                File.WriteAllText(Path.Combine(path, giares.InstanceAccess.InstanceId + ".pem"), secret);
-                CLR.KeyConvert.Convert(Path.Combine(path, giares.InstanceAccess.InstanceId + ".pem"), Path.Combine(path, giares.InstanceAccess.InstanceId + ".ppk"));
+                string ppk = CLR.KeyConvert.ConvertToPpk(secret);
 
                 path = Path.Combine(path, giares.InstanceAccess.InstanceId + ".ppk");
+                if (ppk != null)
+                {
+                    File.WriteAllText(path, ppk);
+                }
 
                 // Save a PuTTY session so user can access instances again directly with PuTTY
                 RegistryKey key = Registry.CurrentUser.OpenSubKey("Software", true);